@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2020 niedong
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "rbfc.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sched.h>
+
+enum
+{
+    _RBFC_NONE, _RBFC_INSERT, _RBFC_ERASE, _RBFC_FIND
+};
+
+// spins before a waiting thread yields its CPU
+#define _RBFC_SPINS 64
+
+/*
+ * A request, alone on its cache line. op is the handshake: the owner
+ * sets it last, the combiner clears it last.
+ */
+struct _rbfc_slot
+{
+    int                   op;   // pending operation, _RBFC_NONE when served
+    int                   out;  // rb_insert's *out
+    const struct rb_node *arg;  // node or value
+    struct rb_node *      res;  // result node
+    size_t                cnt;  // rb_erase_val's result
+    char                  _pad[RB_CACHE_LINE - 2 * sizeof(int) -
+        2 * sizeof(void *) - sizeof(size_t)];
+};
+
+static void
+impl_combine(struct rbfc_tree *fc)
+{
+    struct rb_tree *rb = fc->_rb;
+    const struct rb_node *finger = rb_head(rb);
+    size_t n = 0, i, j;
+
+    for (i = 0; i < fc->_nslots; ++i)
+    {
+        if (__atomic_load_n(&fc->_slots[i].op, __ATOMIC_ACQUIRE) != _RBFC_NONE)
+        {
+            fc->_batch[n++] = i;
+        }
+    }
+
+    // insertion sort by key, batches are at most one request per thread
+    for (i = 1; i < n; ++i)
+    {
+        size_t cur = fc->_batch[i];
+
+        for (j = i; j > 0 && rb_comp(rb, fc->_slots[cur].arg,
+            fc->_slots[fc->_batch[j - 1]].arg); --j)
+        {
+            fc->_batch[j] = fc->_batch[j - 1];
+        }
+
+        fc->_batch[j] = cur;
+    }
+
+    for (i = 0; i < n; ++i)
+    {
+        struct _rbfc_slot *slot = &fc->_slots[fc->_batch[i]];
+
+        switch (slot->op)
+        {
+        case _RBFC_INSERT:
+            slot->res = rb_insert(rb, (struct rb_node *)slot->arg, &slot->out);
+            finger = rb_head(rb);
+            break;
+        case _RBFC_ERASE:
+            slot->cnt = rb_erase_val(rb, slot->arg);
+            finger = rb_head(rb);
+            break;
+        case _RBFC_FIND:
+            slot->res = rb_find_from(rb, finger, slot->arg);
+            finger = slot->res;
+            break;
+        }
+
+        __atomic_store_n(&slot->op, _RBFC_NONE, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Publish the request of slot and wait until some combiner, possibly
+ * this thread, has served it.
+ */
+static struct _rbfc_slot *
+impl_request(struct rbfc_tree *fc, size_t slot, int op, const struct rb_node *arg)
+{
+    struct _rbfc_slot *req = &fc->_slots[slot];
+    int spins;
+
+    req->arg = arg;
+    __atomic_store_n(&req->op, op, __ATOMIC_RELEASE);
+
+    for (;;)
+    {
+        if (!pthread_mutex_trylock(&fc->_lock))
+        {
+            // published before the scan, so it is served now
+            impl_combine(fc);
+            pthread_mutex_unlock(&fc->_lock);
+            break;
+        }
+        for (spins = 0; spins < _RBFC_SPINS; ++spins)
+        {
+            if (__atomic_load_n(&req->op, __ATOMIC_ACQUIRE) == _RBFC_NONE)
+            {
+                return req;
+            }
+        }
+
+        sched_yield();
+    }
+
+    return req;
+}
+
+int
+rbfc_init(struct rbfc_tree *fc, struct rb_tree *rb, size_t nslots)
+{
+    size_t i;
+    int err;
+
+    fc->_rb = rb;
+    fc->_nslots = nslots;
+
+    if (!(fc->_batch = (size_t *)malloc(nslots * sizeof(size_t))))
+    {
+        return -1;
+    }
+    if ((err = posix_memalign((void **)&fc->_slots, RB_CACHE_LINE,
+        nslots * sizeof(struct _rbfc_slot))))
+    {
+        free(fc->_batch);
+        errno = err;
+
+        return -1;
+    }
+    if ((err = pthread_mutex_init(&fc->_lock, NULL)))
+    {
+        free(fc->_slots);
+        free(fc->_batch);
+        errno = err;
+
+        return -1;
+    }
+
+    for (i = 0; i < nslots; ++i)
+    {
+        fc->_slots[i].op = _RBFC_NONE;
+    }
+
+    return 0;
+}
+
+void
+rbfc_destroy(struct rbfc_tree *fc)
+{
+    pthread_mutex_destroy(&fc->_lock);
+
+    free(fc->_slots);
+    free(fc->_batch);
+}
+
+struct rb_node *
+rbfc_insert(struct rbfc_tree *fc, size_t slot, struct rb_node *node, int *out)
+{
+    struct _rbfc_slot *req = impl_request(fc, slot, _RBFC_INSERT, node);
+
+    *out = req->out;
+
+    return req->res;
+}
+
+size_t
+rbfc_erase_val(struct rbfc_tree *fc, size_t slot, const struct rb_node *val)
+{
+    return impl_request(fc, slot, _RBFC_ERASE, val)->cnt;
+}
+
+struct rb_node *
+rbfc_find(struct rbfc_tree *fc, size_t slot, const struct rb_node *val)
+{
+    return impl_request(fc, slot, _RBFC_FIND, val)->res;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2020 niedong
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __RBFC__
+#define __RBFC__
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "rbtree.h"
+
+/*
+ * Flat-combining front-end for sharing one rb_tree among threads.
+ *
+ * Each thread owns a slot, where it publishes its request. Whichever
+ * thread gets the combiner lock collects every pending request, sorts
+ * them by key, and applies them in one pass while the tree is hot in
+ * its cache. Lookups of the batch use finger search from the previous
+ * one. The others only wait for their slot to be served, so the lock
+ * and the tree's cache lines stay with one core at a time.
+ *
+ * Slots are numbered from 0 to nslots - 1, and a slot must not be
+ * used by several threads at once. The tree must not be accessed
+ * directly while the front-end is in use.
+ */
+
+struct _rbfc_slot;
+
+struct rbfc_tree
+{
+    struct rb_tree *    _rb;     // the shared tree
+    struct _rbfc_slot * _slots;  // one request slot per thread
+    size_t *            _batch;  // combiner's scratch, slot indices
+    size_t              _nslots; // number of slots
+    pthread_mutex_t     _lock;   // combiner lock
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// returns 0, or -1 with errno set
+int rbfc_init(struct rbfc_tree *fc, struct rb_tree *rb, size_t nslots);
+void rbfc_destroy(struct rbfc_tree *fc);
+
+// same as rb_insert, rb_erase_val and rb_find
+struct rb_node *rbfc_insert(struct rbfc_tree *fc, size_t slot, struct rb_node *node, int *out);
+size_t rbfc_erase_val(struct rbfc_tree *fc, size_t slot, const struct rb_node *val);
+struct rb_node *rbfc_find(struct rbfc_tree *fc, size_t slot, const struct rb_node *val);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,472 @@
+/*
+ * Copyright (c) 2020 niedong
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "rbfile.h"
+
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define _RBF_MAGIC "rbfile1"
+
+// initial number of slots
+#define _RBF_MIN_CAP 1024
+
+// slot index standing for the search record of a lookup
+#define _RBF_PROBE (RBI_NIL - 1)
+
+struct _rbf_header
+{
+    char     magic[8]; // _RBF_MAGIC
+    uint64_t recsz;    // record size
+    uint64_t cap;      // number of slots
+    uint64_t used;     // slots ever handed out
+    uint64_t size;     // linked nodes
+    uint32_t free;     // first free slot, chained through _left
+    uint32_t root;     // root index
+    uint32_t lmst;     // leftmost index
+    uint32_t rmst;     // rightmost index
+    uint32_t multi;    // multi or not
+    uint32_t dirty;    // changed since the last rbf_sync
+};
+
+// the header is padded to keep the arrays aligned
+#define _RBF_NODES_OFF 64
+
+#define _RBF_HDR(rf) ((struct _rbf_header *)(rf)->_map)
+
+// what the compare thunk needs: the file and the search record
+struct _rbf_ctx
+{
+    const struct rbf_tree *rf;
+    const void *probe;
+};
+
+static size_t
+layout_recs(uint64_t cap)
+{
+    size_t off = _RBF_NODES_OFF + (size_t)cap * sizeof(struct rbi_node);
+
+    return (off + 7) & ~(size_t)7;
+}
+
+static size_t
+layout_size(uint64_t cap, uint64_t recsz)
+{
+    return layout_recs(cap) + (size_t)(cap * recsz);
+}
+
+static const void *
+impl_rec(const struct rbf_tree *rf, uint32_t node)
+{
+    const struct _rbf_header *hdr = _RBF_HDR(rf);
+
+    return rf->_map + layout_recs(hdr->cap) + (size_t)node * hdr->recsz;
+}
+
+static int
+impl_comp(uint32_t a, uint32_t b, void *args)
+{
+    const struct _rbf_ctx *ctx = (const struct _rbf_ctx *)args;
+
+    return ctx->rf->_comp(a == _RBF_PROBE ? ctx->probe : impl_rec(ctx->rf, a),
+        b == _RBF_PROBE ? ctx->probe : impl_rec(ctx->rf, b), ctx->rf->_args);
+}
+
+/*
+ * The tree state lives in the header, an rbi_tree is only assembled
+ * around it for the duration of an operation.
+ */
+static void
+impl_load(const struct rbf_tree *rf, struct rbi_tree *rb, struct _rbf_ctx *ctx)
+{
+    const struct _rbf_header *hdr = _RBF_HDR(rf);
+
+    rbi_init(rb, (struct rbi_node *)(rf->_map + _RBF_NODES_OFF), hdr->multi, impl_comp, ctx);
+
+    rb->_root = hdr->root;
+    rb->_lmst = hdr->lmst;
+    rb->_rmst = hdr->rmst;
+    rb->size = (size_t)hdr->size;
+}
+
+static void
+impl_store(struct rbf_tree *rf, const struct rbi_tree *rb)
+{
+    struct _rbf_header *hdr = _RBF_HDR(rf);
+
+    hdr->root = rb->_root;
+    hdr->lmst = rb->_lmst;
+    hdr->rmst = rb->_rmst;
+    hdr->size = rb->size;
+}
+
+static int
+impl_map(struct rbf_tree *rf, size_t size)
+{
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, rf->_fd, 0);
+
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    rf->_map = (unsigned char *)map;
+    rf->_mapsz = size;
+
+    return 0;
+}
+
+/*
+ * Double the slots. The record array moves up to make room for the
+ * new nodes, which is amortized O(1) per insert.
+ */
+static int
+impl_grow(struct rbf_tree *rf)
+{
+    struct _rbf_header *hdr = _RBF_HDR(rf);
+    uint64_t cap = hdr->cap, ncap = cap * 2, recsz = hdr->recsz;
+    unsigned char *old;
+    size_t oldsz;
+
+    if (ncap > _RBF_PROBE)
+    {
+        ncap = _RBF_PROBE;
+    }
+    if (ncap <= cap)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+    // the old mapping stays in use until the new one is in place
+    if (ftruncate(rf->_fd, (off_t)layout_size(ncap, recsz)))
+    {
+        return -1;
+    }
+
+    old = rf->_map;
+    oldsz = rf->_mapsz;
+
+    if (impl_map(rf, layout_size(ncap, recsz)))
+    {
+        return -1;
+    }
+
+    munmap(old, oldsz);
+    hdr = _RBF_HDR(rf);
+
+    memmove(rf->_map + layout_recs(ncap), rf->_map + layout_recs(cap),
+        (size_t)(hdr->used * recsz));
+
+    hdr->cap = ncap;
+
+    return 0;
+}
+
+/*
+ * Mark the file as changed before the first change after a checkpoint.
+ * The mark is synced first, so that no change reaches the disk without
+ * it.
+ */
+static int
+impl_dirty(struct rbf_tree *rf)
+{
+    struct _rbf_header *hdr = _RBF_HDR(rf);
+
+    if (hdr->dirty)
+    {
+        return 0;
+    }
+
+    hdr->dirty = 1;
+
+    return msync(rf->_map, sizeof(*hdr), MS_SYNC);
+}
+
+static uint32_t
+impl_alloc(struct rbf_tree *rf)
+{
+    struct _rbf_header *hdr = _RBF_HDR(rf);
+    uint32_t slot = hdr->free;
+
+    if (slot != RBI_NIL)
+    {
+        hdr->free = ((struct rbi_node *)(rf->_map + _RBF_NODES_OFF))[slot]._left;
+        return slot;
+    }
+    if (hdr->used == hdr->cap && impl_grow(rf))
+    {
+        return RBI_NIL;
+    }
+
+    hdr = _RBF_HDR(rf);
+
+    return (uint32_t)hdr->used++;
+}
+
+static void
+impl_free(struct rbf_tree *rf, uint32_t slot)
+{
+    struct _rbf_header *hdr = _RBF_HDR(rf);
+
+    ((struct rbi_node *)(rf->_map + _RBF_NODES_OFF))[slot]._left = hdr->free;
+    hdr->free = slot;
+}
+
+int
+rbf_open(struct rbf_tree *rf, const char *path, size_t recsz, int multi,
+    rbf_compare_f comp, void *args)
+{
+    struct _rbf_header *hdr;
+    struct stat st;
+    int err;
+
+    rf->_comp = comp;
+    rf->_args = args;
+    rf->_map = NULL;
+
+    if ((rf->_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+    {
+        return -1;
+    }
+    if (fstat(rf->_fd, &st))
+    {
+        goto fail;
+    }
+
+    if (!st.st_size)
+    {
+        // a new file
+        if (ftruncate(rf->_fd, (off_t)layout_size(_RBF_MIN_CAP, recsz)) ||
+            impl_map(rf, layout_size(_RBF_MIN_CAP, recsz)))
+        {
+            goto fail;
+        }
+
+        hdr = _RBF_HDR(rf);
+
+        memcpy(hdr->magic, _RBF_MAGIC, sizeof(hdr->magic));
+        hdr->recsz = recsz;
+        hdr->cap = _RBF_MIN_CAP;
+        hdr->used = hdr->size = 0;
+        hdr->free = hdr->root = hdr->lmst = hdr->rmst = RBI_NIL;
+        hdr->multi = !!multi;
+        hdr->dirty = 0;
+
+        return 0;
+    }
+
+    if ((size_t)st.st_size < sizeof(struct _rbf_header))
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+    if (impl_map(rf, (size_t)st.st_size))
+    {
+        goto fail;
+    }
+
+    hdr = _RBF_HDR(rf);
+
+    if (memcmp(hdr->magic, _RBF_MAGIC, sizeof(hdr->magic)) || hdr->recsz != recsz ||
+        hdr->multi != (uint32_t)!!multi || layout_size(hdr->cap, recsz) > rf->_mapsz ||
+        hdr->dirty)
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    err = errno;
+
+    if (rf->_map)
+    {
+        munmap(rf->_map, rf->_mapsz);
+    }
+
+    close(rf->_fd);
+    errno = err;
+
+    return -1;
+}
+
+int
+rbf_sync(struct rbf_tree *rf)
+{
+    struct _rbf_header *hdr = _RBF_HDR(rf);
+
+    if (msync(rf->_map, rf->_mapsz, MS_SYNC))
+    {
+        return -1;
+    }
+    if (!hdr->dirty)
+    {
+        return 0;
+    }
+
+    // the changes are on disk, only then the mark may go
+    hdr->dirty = 0;
+
+    return msync(rf->_map, sizeof(*hdr), MS_SYNC);
+}
+
+int
+rbf_close(struct rbf_tree *rf)
+{
+    int res = munmap(rf->_map, rf->_mapsz);
+
+    return close(rf->_fd) || res ? -1 : 0;
+}
+
+size_t
+rbf_size(const struct rbf_tree *rf)
+{
+    return (size_t)_RBF_HDR(rf)->size;
+}
+
+void *
+rbf_rec(const struct rbf_tree *rf, uint32_t node)
+{
+    return (void *)impl_rec(rf, node);
+}
+
+uint32_t
+rbf_lmst(const struct rbf_tree *rf)
+{
+    return _RBF_HDR(rf)->lmst;
+}
+
+uint32_t
+rbf_rmst(const struct rbf_tree *rf)
+{
+    return _RBF_HDR(rf)->rmst;
+}
+
+uint32_t
+rbf_prev(const struct rbf_tree *rf, uint32_t node)
+{
+    struct rbi_tree rb;
+    struct _rbf_ctx ctx = { rf, NULL };
+
+    impl_load(rf, &rb, &ctx);
+
+    return rbi_prev(&rb, node);
+}
+
+uint32_t
+rbf_next(const struct rbf_tree *rf, uint32_t node)
+{
+    struct rbi_tree rb;
+    struct _rbf_ctx ctx = { rf, NULL };
+
+    impl_load(rf, &rb, &ctx);
+
+    return rbi_next(&rb, node);
+}
+
+uint32_t
+rbf_insert(struct rbf_tree *rf, const void *rec, int *out)
+{
+    struct rbi_tree rb;
+    struct _rbf_ctx ctx = { rf, NULL };
+    uint32_t slot, res;
+
+    if (impl_dirty(rf) || (slot = impl_alloc(rf)) == RBI_NIL)
+    {
+        *out = 0;
+        return RBI_NIL;
+    }
+
+    memcpy((void *)impl_rec(rf, slot), rec, (size_t)_RBF_HDR(rf)->recsz);
+
+    impl_load(rf, &rb, &ctx);
+    res = rbi_insert(&rb, slot, out);
+
+    if (*out)
+    {
+        impl_store(rf, &rb);
+    }
+    else
+    {
+        impl_free(rf, slot);
+    }
+
+    return res;
+}
+
+uint32_t
+rbf_erase(struct rbf_tree *rf, uint32_t node)
+{
+    struct rbi_tree rb;
+    struct _rbf_ctx ctx = { rf, NULL };
+    uint32_t next;
+
+    if (impl_dirty(rf))
+    {
+        return RBI_NIL;
+    }
+
+    impl_load(rf, &rb, &ctx);
+    next = rbi_erase(&rb, node);
+    impl_store(rf, &rb);
+    impl_free(rf, node);
+
+    return next;
+}
+
+uint32_t
+rbf_find(const struct rbf_tree *rf, const void *rec)
+{
+    struct rbi_tree rb;
+    struct _rbf_ctx ctx = { rf, rec };
+
+    impl_load(rf, &rb, &ctx);
+
+    return rbi_find(&rb, _RBF_PROBE);
+}
+
+uint32_t
+rbf_lbnd(const struct rbf_tree *rf, const void *rec)
+{
+    struct rbi_tree rb;
+    struct _rbf_ctx ctx = { rf, rec };
+
+    impl_load(rf, &rb, &ctx);
+
+    return rbi_lbnd(&rb, _RBF_PROBE);
+}
+
+uint32_t
+rbf_ubnd(const struct rbf_tree *rf, const void *rec)
+{
+    struct rbi_tree rb;
+    struct _rbf_ctx ctx = { rf, rec };
+
+    impl_load(rf, &rb, &ctx);
+
+    return rbi_ubnd(&rb, _RBF_PROBE);
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2020 niedong
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __RBFILE__
+#define __RBFILE__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rbidx.h"
+
+/*
+ * A red-black tree stored in a memory-mapped file, so that opening it
+ * is an mmap without any rebuild. Nodes are the rbi_node of rbidx.h,
+ * whose links are indices relative to the start of the node array, so
+ * the mapping may land at any address. Each node owns a fixed-size
+ * record, holding the key and whatever goes with it.
+ *
+ * File layout: a header, the node array, then the record array. Both
+ * arrays grow together by doubling, and erased slots are reused
+ * through a free list. Changes go to the mapping directly, rbf_sync
+ * makes them durable. The file is consistent only at those
+ * checkpoints, a crash in between may leave it damaged. The header
+ * records whether the file changed since the last checkpoint, and
+ * rbf_open rejects such a file with EINVAL instead of trusting its
+ * links. A file closed without rbf_sync after a change counts as well.
+ *
+ * POSIX only. A tree must not be used by several threads at once, and
+ * record pointers are invalidated by the next insert, which may remap
+ * the file.
+ */
+
+/*
+ * Same contract as rb_compare_f, on two records: return whether a
+ * orders strictly before b.
+ */
+typedef int(*rbf_compare_f)(const void *, const void *, void *);
+
+struct rbf_tree
+{
+    int              _fd;    // the file
+    unsigned char *  _map;   // the mapping
+    size_t           _mapsz; // size of the mapping
+    rbf_compare_f    _comp;  // user's compare function
+    void *           _args;  // user's extra argument
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Open the tree at path, or create it if the file does not exist. An
+ * existing file must have been created with the same record size and
+ * multi flag. Returns 0, or -1 with errno set.
+ */
+int rbf_open(struct rbf_tree *rf, const char *path, size_t recsz, int multi,
+    rbf_compare_f comp, void *args);
+
+// msync the whole file, returns 0 or -1 with errno set
+int rbf_sync(struct rbf_tree *rf);
+
+// unmap and close without syncing, returns 0 or -1 with errno set
+int rbf_close(struct rbf_tree *rf);
+
+size_t rbf_size(const struct rbf_tree *rf);
+
+// the record of a node, valid until the next insert
+void *rbf_rec(const struct rbf_tree *rf, uint32_t node);
+
+uint32_t rbf_lmst(const struct rbf_tree *rf);
+uint32_t rbf_rmst(const struct rbf_tree *rf);
+uint32_t rbf_prev(const struct rbf_tree *rf, uint32_t node);
+uint32_t rbf_next(const struct rbf_tree *rf, uint32_t node);
+
+/*
+ * Copy rec into a new node and link it. Like rb_insert, *out is set
+ * to 0 when a unique tree already holds an equivalent record, whose
+ * node is returned. Returns RBI_NIL with errno set if the file can not
+ * grow, or be marked as changed. A failed grow keeps the old mapping.
+ */
+uint32_t rbf_insert(struct rbf_tree *rf, const void *rec, int *out);
+
+/*
+ * Unlink node, free its slot and return the next node. Returns RBI_NIL
+ * with errno set, and leaves node linked, if the file can not be marked
+ * as changed.
+ */
+uint32_t rbf_erase(struct rbf_tree *rf, uint32_t node);
+
+/*
+ * Searches, rec holds the key to look for. They return node indices,
+ * RBI_NIL for none.
+ */
+uint32_t rbf_find(const struct rbf_tree *rf, const void *rec);
+
+uint32_t rbf_lbnd(const struct rbf_tree *rf, const void *rec);
+uint32_t rbf_ubnd(const struct rbf_tree *rf, const void *rec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,547 @@
+/*
+ * Copyright (c) 2020 niedong
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "rbidx.h"
+
+#if defined _RB_DEBUG
+#include <assert.h>
+#endif
+
+#define _RBI_BLACK_BIT ((uint32_t)0x80000000)
+
+#define _RBI_NODE(rb, i)   ((rb)->_base[i])
+#define _RBI_PARENT(rb, i) (_RBI_NODE(rb, i)._parent & ~_RBI_BLACK_BIT)
+#define _RBI_LEFT(rb, i)   (_RBI_NODE(rb, i)._left)
+#define _RBI_RIGHT(rb, i)  (_RBI_NODE(rb, i)._right)
+
+// nil is black
+#define _RBI_IS_RED(rb, i) \
+    ((i) != RBI_NIL && !(_RBI_NODE(rb, i)._parent & _RBI_BLACK_BIT))
+
+static void
+node_set_parent(struct rbi_tree *rb, uint32_t node, uint32_t parent)
+{
+    _RBI_NODE(rb, node)._parent =
+        (_RBI_NODE(rb, node)._parent & _RBI_BLACK_BIT) | parent;
+}
+
+static void
+node_set_black(struct rbi_tree *rb, uint32_t node, int black)
+{
+    if (black)
+    {
+        _RBI_NODE(rb, node)._parent |= _RBI_BLACK_BIT;
+    }
+    else
+    {
+        _RBI_NODE(rb, node)._parent &= ~_RBI_BLACK_BIT;
+    }
+}
+
+static uint32_t
+node_min(const struct rbi_tree *rb, uint32_t node)
+{
+    while (_RBI_LEFT(rb, node) != RBI_NIL)
+    {
+        node = _RBI_LEFT(rb, node);
+    }
+
+    return node;
+}
+
+static uint32_t
+node_max(const struct rbi_tree *rb, uint32_t node)
+{
+    while (_RBI_RIGHT(rb, node) != RBI_NIL)
+    {
+        node = _RBI_RIGHT(rb, node);
+    }
+
+    return node;
+}
+
+// put child where node was below parent
+static void
+node_replace(struct rbi_tree *rb, uint32_t parent, uint32_t node, uint32_t child)
+{
+    if (parent == RBI_NIL)
+    {
+        rb->_root = child;
+    }
+    else if (_RBI_LEFT(rb, parent) == node)
+    {
+        _RBI_LEFT(rb, parent) = child;
+    }
+    else
+    {
+        _RBI_RIGHT(rb, parent) = child;
+    }
+}
+
+static void
+node_rotl(struct rbi_tree *rb, uint32_t node)
+{
+    uint32_t right = _RBI_RIGHT(rb, node);
+    uint32_t parent = _RBI_PARENT(rb, node);
+
+    _RBI_RIGHT(rb, node) = _RBI_LEFT(rb, right);
+
+    if (_RBI_LEFT(rb, right) != RBI_NIL)
+    {
+        node_set_parent(rb, _RBI_LEFT(rb, right), node);
+    }
+
+    node_set_parent(rb, right, parent);
+    node_replace(rb, parent, node, right);
+
+    _RBI_LEFT(rb, right) = node;
+    node_set_parent(rb, node, right);
+}
+
+static void
+node_rotr(struct rbi_tree *rb, uint32_t node)
+{
+    uint32_t left = _RBI_LEFT(rb, node);
+    uint32_t parent = _RBI_PARENT(rb, node);
+
+    _RBI_LEFT(rb, node) = _RBI_RIGHT(rb, left);
+
+    if (_RBI_RIGHT(rb, left) != RBI_NIL)
+    {
+        node_set_parent(rb, _RBI_RIGHT(rb, left), node);
+    }
+
+    node_set_parent(rb, left, parent);
+    node_replace(rb, parent, node, left);
+
+    _RBI_RIGHT(rb, left) = node;
+    node_set_parent(rb, node, left);
+}
+
+static void
+impl_insert_fixup(struct rbi_tree *rb, uint32_t node)
+{
+    uint32_t parent, grand, uncle;
+
+    while (_RBI_IS_RED(rb, parent = _RBI_PARENT(rb, node)))
+    {
+        grand = _RBI_PARENT(rb, parent);
+
+        if (parent == _RBI_LEFT(rb, grand))
+        {
+            uncle = _RBI_RIGHT(rb, grand);
+
+            if (_RBI_IS_RED(rb, uncle))
+            {
+                node_set_black(rb, parent, 1);
+                node_set_black(rb, uncle, 1);
+                node_set_black(rb, grand, 0);
+                node = grand;
+                continue;
+            }
+            if (node == _RBI_RIGHT(rb, parent))
+            {
+                node_rotl(rb, parent);
+                node = parent;
+                parent = _RBI_PARENT(rb, node);
+            }
+
+            node_set_black(rb, parent, 1);
+            node_set_black(rb, grand, 0);
+            node_rotr(rb, grand);
+        }
+        else
+        {
+            uncle = _RBI_LEFT(rb, grand);
+
+            if (_RBI_IS_RED(rb, uncle))
+            {
+                node_set_black(rb, parent, 1);
+                node_set_black(rb, uncle, 1);
+                node_set_black(rb, grand, 0);
+                node = grand;
+                continue;
+            }
+            if (node == _RBI_LEFT(rb, parent))
+            {
+                node_rotr(rb, parent);
+                node = parent;
+                parent = _RBI_PARENT(rb, node);
+            }
+
+            node_set_black(rb, parent, 1);
+            node_set_black(rb, grand, 0);
+            node_rotl(rb, grand);
+        }
+    }
+
+    node_set_black(rb, rb->_root, 1);
+}
+
+/*
+ * node took the place of a removed black node below parent. Without a
+ * head node, parent has to be tracked for a nil node.
+ */
+static void
+impl_erase_fixup(struct rbi_tree *rb, uint32_t node, uint32_t parent)
+{
+    uint32_t sibling;
+
+    while (node != rb->_root && !_RBI_IS_RED(rb, node))
+    {
+        if (node == _RBI_LEFT(rb, parent))
+        {
+            sibling = _RBI_RIGHT(rb, parent);
+
+            if (_RBI_IS_RED(rb, sibling))
+            {
+                node_set_black(rb, sibling, 1);
+                node_set_black(rb, parent, 0);
+                node_rotl(rb, parent);
+                sibling = _RBI_RIGHT(rb, parent);
+            }
+            if (!_RBI_IS_RED(rb, _RBI_LEFT(rb, sibling)) &&
+                !_RBI_IS_RED(rb, _RBI_RIGHT(rb, sibling)))
+            {
+                node_set_black(rb, sibling, 0);
+                node = parent;
+                parent = _RBI_PARENT(rb, node);
+                continue;
+            }
+            if (!_RBI_IS_RED(rb, _RBI_RIGHT(rb, sibling)))
+            {
+                node_set_black(rb, _RBI_LEFT(rb, sibling), 1);
+                node_set_black(rb, sibling, 0);
+                node_rotr(rb, sibling);
+                sibling = _RBI_RIGHT(rb, parent);
+            }
+
+            node_set_black(rb, sibling, !_RBI_IS_RED(rb, parent));
+            node_set_black(rb, parent, 1);
+            node_set_black(rb, _RBI_RIGHT(rb, sibling), 1);
+            node_rotl(rb, parent);
+        }
+        else
+        {
+            sibling = _RBI_LEFT(rb, parent);
+
+            if (_RBI_IS_RED(rb, sibling))
+            {
+                node_set_black(rb, sibling, 1);
+                node_set_black(rb, parent, 0);
+                node_rotr(rb, parent);
+                sibling = _RBI_LEFT(rb, parent);
+            }
+            if (!_RBI_IS_RED(rb, _RBI_LEFT(rb, sibling)) &&
+                !_RBI_IS_RED(rb, _RBI_RIGHT(rb, sibling)))
+            {
+                node_set_black(rb, sibling, 0);
+                node = parent;
+                parent = _RBI_PARENT(rb, node);
+                continue;
+            }
+            if (!_RBI_IS_RED(rb, _RBI_LEFT(rb, sibling)))
+            {
+                node_set_black(rb, _RBI_RIGHT(rb, sibling), 1);
+                node_set_black(rb, sibling, 0);
+                node_rotl(rb, sibling);
+                sibling = _RBI_LEFT(rb, parent);
+            }
+
+            node_set_black(rb, sibling, !_RBI_IS_RED(rb, parent));
+            node_set_black(rb, parent, 1);
+            node_set_black(rb, _RBI_LEFT(rb, sibling), 1);
+            node_rotr(rb, parent);
+        }
+
+        node = rb->_root;
+    }
+
+    if (node != RBI_NIL)
+    {
+        node_set_black(rb, node, 1);
+    }
+}
+
+void
+rbi_init(struct rbi_tree *rb, struct rbi_node *base, int multi, rbi_compare_f comp, void *args)
+{
+    rb->_base = base;
+    rb->_multi = multi;
+    rb->_comp = comp;
+    rb->_args = args;
+
+    rbi_clear(rb);
+}
+
+void
+rbi_rebase(struct rbi_tree *rb, struct rbi_node *base)
+{
+    rb->_base = base;
+}
+
+void
+rbi_clear(struct rbi_tree *rb)
+{
+    rb->_root = rb->_lmst = rb->_rmst = RBI_NIL;
+    rb->size = 0;
+}
+
+uint32_t
+rbi_lmst(const struct rbi_tree *rb)
+{
+    return rb->_lmst;
+}
+
+uint32_t
+rbi_rmst(const struct rbi_tree *rb)
+{
+    return rb->_rmst;
+}
+
+uint32_t
+rbi_prev(const struct rbi_tree *rb, uint32_t node)
+{
+    uint32_t parent;
+
+    if (node == RBI_NIL)
+    {
+        return rb->_rmst;
+    }
+    if (_RBI_LEFT(rb, node) != RBI_NIL)
+    {
+        return node_max(rb, _RBI_LEFT(rb, node));
+    }
+
+    while ((parent = _RBI_PARENT(rb, node)) != RBI_NIL && node == _RBI_LEFT(rb, parent))
+    {
+        node = parent;
+    }
+
+    return parent;
+}
+
+uint32_t
+rbi_next(const struct rbi_tree *rb, uint32_t node)
+{
+    uint32_t parent;
+
+    if (node == RBI_NIL)
+    {
+        return rb->_lmst;
+    }
+    if (_RBI_RIGHT(rb, node) != RBI_NIL)
+    {
+        return node_min(rb, _RBI_RIGHT(rb, node));
+    }
+
+    while ((parent = _RBI_PARENT(rb, node)) != RBI_NIL && node == _RBI_RIGHT(rb, parent))
+    {
+        node = parent;
+    }
+
+    return parent;
+}
+
+uint32_t
+rbi_insert(struct rbi_tree *rb, uint32_t node, int *out)
+{
+    uint32_t parent = RBI_NIL, it = rb->_root;
+    int addleft = 1;
+
+#if defined _RB_DEBUG
+    assert(out && "not a legal, writable address");
+    assert(node < RBI_NIL && "index out of range");
+#endif
+
+    while (it != RBI_NIL)
+    {
+        parent = it;
+        addleft = rb->_comp(node, it, rb->_args);
+        it = addleft ? _RBI_LEFT(rb, it) : _RBI_RIGHT(rb, it);
+    }
+
+    if (!rb->_multi && parent != RBI_NIL)
+    {
+        // the only node that may be equivalent is the predecessor
+        uint32_t prev = addleft ? (parent == rb->_lmst ? RBI_NIL : rbi_prev(rb, parent)) : parent;
+
+        if (prev != RBI_NIL && !rb->_comp(prev, node, rb->_args))
+        {
+            *out = 0;
+            return prev;
+        }
+    }
+
+    _RBI_NODE(rb, node)._parent = parent;
+    _RBI_LEFT(rb, node) = _RBI_RIGHT(rb, node) = RBI_NIL;
+
+    if (parent == RBI_NIL)
+    {
+        rb->_root = rb->_lmst = rb->_rmst = node;
+    }
+    else if (addleft)
+    {
+        _RBI_LEFT(rb, parent) = node;
+
+        if (parent == rb->_lmst)
+        {
+            rb->_lmst = node;
+        }
+    }
+    else
+    {
+        _RBI_RIGHT(rb, parent) = node;
+
+        if (parent == rb->_rmst)
+        {
+            rb->_rmst = node;
+        }
+    }
+
+    impl_insert_fixup(rb, node);
+
+    ++rb->size;
+    *out = 1;
+
+    return node;
+}
+
+uint32_t
+rbi_erase(struct rbi_tree *rb, uint32_t node)
+{
+    uint32_t next = rbi_next(rb, node);
+    uint32_t parent = _RBI_PARENT(rb, node);
+    uint32_t child, succ = node;
+    int black = !_RBI_IS_RED(rb, node);
+
+    if (node == rb->_lmst)
+    {
+        rb->_lmst = next;
+    }
+    if (node == rb->_rmst)
+    {
+        rb->_rmst = rbi_prev(rb, node);
+    }
+
+    if (_RBI_LEFT(rb, node) == RBI_NIL || _RBI_RIGHT(rb, node) == RBI_NIL)
+    {
+        child = _RBI_LEFT(rb, node) == RBI_NIL ? _RBI_RIGHT(rb, node) : _RBI_LEFT(rb, node);
+
+        node_replace(rb, parent, node, child);
+
+        if (child != RBI_NIL)
+        {
+            node_set_parent(rb, child, parent);
+        }
+    }
+    else
+    {
+        // the successor takes the place and colour of node
+        succ = next;
+        black = !_RBI_IS_RED(rb, succ);
+        child = _RBI_RIGHT(rb, succ);
+
+        if (_RBI_PARENT(rb, succ) == node)
+        {
+            parent = succ;
+        }
+        else
+        {
+            parent = _RBI_PARENT(rb, succ);
+            _RBI_LEFT(rb, parent) = child;
+
+            if (child != RBI_NIL)
+            {
+                node_set_parent(rb, child, parent);
+            }
+
+            _RBI_RIGHT(rb, succ) = _RBI_RIGHT(rb, node);
+            node_set_parent(rb, _RBI_RIGHT(rb, succ), succ);
+        }
+
+        node_replace(rb, _RBI_PARENT(rb, node), node, succ);
+
+        _RBI_NODE(rb, succ)._parent = _RBI_NODE(rb, node)._parent;
+        _RBI_LEFT(rb, succ) = _RBI_LEFT(rb, node);
+        node_set_parent(rb, _RBI_LEFT(rb, succ), succ);
+    }
+
+    if (black)
+    {
+        impl_erase_fixup(rb, child, parent);
+    }
+
+    --rb->size;
+
+    return next;
+}
+
+uint32_t
+rbi_lbnd(const struct rbi_tree *rb, uint32_t val)
+{
+    uint32_t res = RBI_NIL, it = rb->_root;
+
+    while (it != RBI_NIL)
+    {
+        if (rb->_comp(it, val, rb->_args))
+        {
+            it = _RBI_RIGHT(rb, it);
+        }
+        else
+        {
+            res = it;
+            it = _RBI_LEFT(rb, it);
+        }
+    }
+
+    return res;
+}
+
+uint32_t
+rbi_ubnd(const struct rbi_tree *rb, uint32_t val)
+{
+    uint32_t res = RBI_NIL, it = rb->_root;
+
+    while (it != RBI_NIL)
+    {
+        if (rb->_comp(val, it, rb->_args))
+        {
+            res = it;
+            it = _RBI_LEFT(rb, it);
+        }
+        else
+        {
+            it = _RBI_RIGHT(rb, it);
+        }
+    }
+
+    return res;
+}
+
+uint32_t
+rbi_find(const struct rbi_tree *rb, uint32_t val)
+{
+    uint32_t res = rbi_lbnd(rb, val);
+
+    return res == RBI_NIL || rb->_comp(val, res, rb->_args) ? RBI_NIL : res;
+}
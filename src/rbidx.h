@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2020 niedong
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __RBIDX__
+#define __RBIDX__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Red-black tree over a caller-supplied node array. Links are 32-bit
+ * indices into the array instead of pointers, and the colour lives in
+ * the top bit of the parent index, so a node takes 12 bytes instead of
+ * the 32 of rb_node. Keys are usually kept in a parallel array with
+ * the same indices, which the compare function reaches through args.
+ *
+ * The algorithms are those of rbtree.c, except that there is no head
+ * node: RBI_NIL stands for both the nil children and the end of the
+ * tree. Since only indices are stored, the array may be moved (e.g.
+ * by realloc) as long as rbi_rebase is told about it.
+ *
+ * Members starting with an underscore are protected, as in rbtree.h.
+ */
+
+// null index, also the end of the tree; valid indices are below it
+#define RBI_NIL ((uint32_t)0x7fffffff)
+
+struct rbi_node
+{
+    uint32_t _parent; // parent index, the top bit set for black
+    uint32_t _left;   // left child index
+    uint32_t _right;  // right child index
+};
+
+/*
+ * Same contract as rb_compare_f, on the indices of two nodes: return
+ * whether a orders strictly before b.
+ */
+typedef int(*rbi_compare_f)(uint32_t, uint32_t, void *);
+
+struct rbi_tree
+{
+    struct rbi_node *_base;  // the node array
+    uint32_t         _root;  // root index
+    uint32_t         _lmst;  // leftmost index
+    uint32_t         _rmst;  // rightmost index
+    int              _multi; // multi or not
+    rbi_compare_f    _comp;  // user's compare function
+    void *           _args;  // user's extra argument
+    size_t           size;   // public member, size of the tree
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void rbi_init(struct rbi_tree *rb, struct rbi_node *base, int multi, rbi_compare_f comp, void *args);
+void rbi_rebase(struct rbi_tree *rb, struct rbi_node *base);
+
+void rbi_clear(struct rbi_tree *rb);
+
+uint32_t rbi_lmst(const struct rbi_tree *rb);
+uint32_t rbi_rmst(const struct rbi_tree *rb);
+
+/*
+ * In-order neighbours of a linked node, RBI_NIL past either end. From
+ * RBI_NIL, rbi_next returns the leftmost and rbi_prev the rightmost.
+ */
+uint32_t rbi_prev(const struct rbi_tree *rb, uint32_t node);
+uint32_t rbi_next(const struct rbi_tree *rb, uint32_t node);
+
+/*
+ * Link node, an unlinked slot of the array. Like rb_insert, *out is
+ * set to 0 when a unique tree already holds an equivalent node, which
+ * is then returned instead.
+ */
+uint32_t rbi_insert(struct rbi_tree *rb, uint32_t node, int *out);
+
+// unlink node and return the next one
+uint32_t rbi_erase(struct rbi_tree *rb, uint32_t node);
+
+/*
+ * Searches. val is the index of any slot holding the key to look for,
+ * it does not have to be linked.
+ */
+uint32_t rbi_find(const struct rbi_tree *rb, uint32_t val);
+
+uint32_t rbi_lbnd(const struct rbi_tree *rb, uint32_t val);
+uint32_t rbi_ubnd(const struct rbi_tree *rb, uint32_t val);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
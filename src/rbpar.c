@@ -0,0 +1,689 @@
+/*
+ * Copyright (c) 2020 niedong
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "rbpar.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined _RB_DEBUG
+#include <assert.h>
+#endif
+
+// runs below this length are sorted by insertion
+#define _RBPAR_ISORT 16
+
+// subtrees handed out per thread when linking
+#define _RBPAR_TASKS 4
+
+/*
+ * Task pool: the threads claim task indices from a shared counter
+ * until there are none left. The tasks are all known up front, so
+ * per-thread deques with stealing would balance no better.
+ */
+struct _rbpar_pool
+{
+    void (*fn)(void *ctx, size_t task);
+    void *ctx;
+    size_t ntasks;
+    size_t next;
+};
+
+static void *
+pool_worker(void *arg)
+{
+    struct _rbpar_pool *pool = (struct _rbpar_pool *)arg;
+    size_t task;
+
+    while ((task = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->ntasks)
+    {
+        pool->fn(pool->ctx, task);
+    }
+
+    return NULL;
+}
+
+static void
+pool_run(size_t nthreads, size_t ntasks, void (*fn)(void *, size_t), void *ctx)
+{
+    struct _rbpar_pool pool;
+    pthread_t *tid = NULL;
+    size_t i, started = 0;
+
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.ntasks = ntasks;
+    pool.next = 0;
+
+    if (nthreads > ntasks)
+    {
+        nthreads = ntasks;
+    }
+    if (nthreads > 1 && (tid = (pthread_t *)malloc((nthreads - 1) * sizeof(pthread_t))))
+    {
+        for (i = 0; i < nthreads - 1; ++i)
+        {
+            if (pthread_create(&tid[started], NULL, pool_worker, &pool))
+            {
+                break;
+            }
+
+            ++started;
+        }
+    }
+
+    pool_worker(&pool);
+
+    for (i = 0; i < started; ++i)
+    {
+        pthread_join(tid[i], NULL);
+    }
+
+    free(tid);
+}
+
+struct _rbpar_sort
+{
+    const struct rb_tree *rb;
+    struct rb_node **nodes;
+    struct rb_node **tmp;
+    size_t n;
+    size_t nruns;
+    size_t width;          // runs merged so far are width chunks wide
+    struct rb_node **src;  // merge rounds alternate between nodes and tmp
+    struct rb_node **dst;
+    size_t *keep;          // nodes kept by each chunk in unique mode
+};
+
+static size_t
+sort_bound(const struct _rbpar_sort *st, size_t run)
+{
+    return run >= st->nruns ? st->n : st->n / st->nruns * run;
+}
+
+// stable merge of the sorted a[0, na) and b[0, nb) into out
+static void
+sort_merge_to(const struct rb_tree *rb, struct rb_node *const *a, size_t na,
+    struct rb_node *const *b, size_t nb, struct rb_node **out)
+{
+    size_t i = 0, j = 0;
+
+    while (i < na && j < nb)
+    {
+        *out++ = rb_comp(rb, b[j], a[i]) ? b[j++] : a[i++];
+    }
+
+    memcpy(out, a + i, (na - i) * sizeof(*a));
+    memcpy(out + na - i, b + j, (nb - j) * sizeof(*b));
+}
+
+// stable merge of the sorted a[0, m) and a[m, n) through tmp
+static void
+sort_merge(const struct rb_tree *rb, struct rb_node **a, struct rb_node **tmp,
+    size_t m, size_t n)
+{
+    sort_merge_to(rb, a, m, a + m, n - m, tmp);
+
+    memcpy(a, tmp, n * sizeof(*a));
+}
+
+/*
+ * The first k nodes of the stable merge of a[0, na) and b[0, nb) are
+ * a[0, i) and b[0, k - i). Returns i, by binary search.
+ */
+static size_t
+sort_corank(const struct rb_tree *rb, struct rb_node *const *a, size_t na,
+    struct rb_node *const *b, size_t nb, size_t k)
+{
+    size_t lo = k > nb ? k - nb : 0, hi = k < na ? k : na, i;
+
+    while (lo < hi)
+    {
+        i = lo + (hi - lo) / 2;
+
+        // b[k - i - 1] only comes before a[i] if it is less
+        if (rb_comp(rb, b[k - i - 1], a[i]))
+        {
+            hi = i;
+        }
+        else
+        {
+            lo = i + 1;
+        }
+    }
+
+    return lo;
+}
+
+static void
+sort_serial(const struct rb_tree *rb, struct rb_node **a, struct rb_node **tmp, size_t n)
+{
+    size_t i, j;
+
+    if (n < _RBPAR_ISORT)
+    {
+        for (i = 1; i < n; ++i)
+        {
+            struct rb_node *cur = a[i];
+
+            for (j = i; j > 0 && rb_comp(rb, cur, a[j - 1]); --j)
+            {
+                a[j] = a[j - 1];
+            }
+
+            a[j] = cur;
+        }
+
+        return;
+    }
+
+    sort_serial(rb, a, tmp, n / 2);
+    sort_serial(rb, a + n / 2, tmp, n - n / 2);
+    sort_merge(rb, a, tmp, n / 2, n);
+}
+
+static void
+sort_task(void *ctx, size_t task)
+{
+    struct _rbpar_sort *st = (struct _rbpar_sort *)ctx;
+    size_t lo = sort_bound(st, task), hi = sort_bound(st, task + 1);
+
+    sort_serial(st->rb, st->nodes + lo, st->tmp + lo, hi - lo);
+}
+
+/*
+ * A merge of two runs is split into as many pieces as runs it covers,
+ * cut at equal output positions by co-ranking, so that every round has
+ * nruns tasks of about the same size.
+ */
+static void
+merge_task(void *ctx, size_t task)
+{
+    struct _rbpar_sort *st = (struct _rbpar_sort *)ctx;
+    size_t parts = 2 * st->width, pair = task / parts, part = task % parts;
+    size_t lo = sort_bound(st, pair * parts);
+    size_t mid = sort_bound(st, pair * parts + st->width);
+    size_t hi = sort_bound(st, (pair + 1) * parts);
+    size_t k0 = (hi - lo) * part / parts, k1 = (hi - lo) * (part + 1) / parts;
+    size_t i0, i1;
+
+    struct rb_node *const *a = st->src + lo, *const *b = st->src + mid;
+
+    i0 = sort_corank(st->rb, a, mid - lo, b, hi - mid, k0);
+    i1 = sort_corank(st->rb, a, mid - lo, b, hi - mid, k1);
+
+    sort_merge_to(st->rb, a + i0, i1 - i0, b + k0 - i0, (k1 - i1) - (k0 - i0),
+        st->dst + lo + k0);
+}
+
+static void
+copy_task(void *ctx, size_t task)
+{
+    struct _rbpar_sort *st = (struct _rbpar_sort *)ctx;
+    size_t lo = sort_bound(st, task), hi = sort_bound(st, task + 1);
+
+    memcpy(st->nodes + lo, st->tmp + lo, (hi - lo) * sizeof(*st->nodes));
+}
+
+// a node is kept if it is not equivalent to the one before it
+static int
+uniq_keep(const struct _rbpar_sort *st, size_t i)
+{
+    return !i || rb_comp(st->rb, st->nodes[i - 1], st->nodes[i]);
+}
+
+static void
+uniq_count_task(void *ctx, size_t task)
+{
+    struct _rbpar_sort *st = (struct _rbpar_sort *)ctx;
+    size_t lo = sort_bound(st, task), hi = sort_bound(st, task + 1), i;
+
+    for (st->keep[task] = 0, i = lo; i < hi; ++i)
+    {
+        st->keep[task] += uniq_keep(st, i);
+    }
+}
+
+// keep[] holds the first kept and rejected positions of each chunk
+static void
+uniq_move_task(void *ctx, size_t task)
+{
+    struct _rbpar_sort *st = (struct _rbpar_sort *)ctx;
+    size_t lo = sort_bound(st, task), hi = sort_bound(st, task + 1), i;
+    size_t k = st->keep[task], r = st->keep[st->nruns + task];
+
+    for (i = lo; i < hi; ++i)
+    {
+        st->tmp[uniq_keep(st, i) ? k++ : r++] = st->nodes[i];
+    }
+}
+
+struct _rbpar_build
+{
+    struct rb_tree *rb;
+    struct rb_node **nodes;
+    size_t n;
+    size_t level;  // depth of the independent subtrees
+    struct rb_node **roots;
+};
+
+static void
+build_task(void *ctx, size_t task)
+{
+    struct _rbpar_build *bd = (struct _rbpar_build *)ctx;
+
+    bd->roots[task] = _rb_build(bd->rb, bd->nodes, bd->n, bd->level, task, NULL);
+}
+
+/*
+ * A chunk of a scan: a whole subtree, or one node above the subtrees.
+ */
+struct _rbpar_chunk
+{
+    struct rb_node *node;
+    int whole;
+};
+
+struct _rbpar_scan
+{
+    struct _rbpar_chunk *chunks;
+    size_t nchunks;
+    size_t level;
+
+    rb_visit_f visit;
+    rb_reduce_f reduce;
+    void *args;
+    char *accs;    // accumulator of each chunk, for reduce
+    size_t size;
+};
+
+// the chunks under node, in order
+static void
+scan_split(struct _rbpar_scan *sc, struct rb_node *node, size_t depth)
+{
+    if (node->_isnil)
+    {
+        return;
+    }
+    if (depth == sc->level)
+    {
+        sc->chunks[sc->nchunks].node = node;
+        sc->chunks[sc->nchunks++].whole = 1;
+
+        return;
+    }
+
+    scan_split(sc, node->_left, depth + 1);
+
+    if (!node->_isdead)
+    {
+        sc->chunks[sc->nchunks].node = node;
+        sc->chunks[sc->nchunks++].whole = 0;
+    }
+
+    scan_split(sc, node->_right, depth + 1);
+}
+
+static void
+scan_one(const struct _rbpar_scan *sc, void *acc, struct rb_node *node)
+{
+    if (sc->visit)
+    {
+        sc->visit(node, sc->args);
+    }
+    else
+    {
+        sc->reduce(acc, node, sc->args);
+    }
+}
+
+// a node, then the duplicates on its chain in a chained tree
+static void
+scan_node(const struct _rbpar_scan *sc, void *acc, struct rb_node *node)
+{
+    struct rb_node *it;
+
+    scan_one(sc, acc, node);
+
+    if (node->_chained == _RB_CHAIN_KEY)
+    {
+        for (it = ((struct rb_cnode *)node)->_dups; it && it != node; it = it->_right)
+        {
+            scan_one(sc, acc, it);
+        }
+    }
+}
+
+static void
+scan_chunk(const struct _rbpar_scan *sc, size_t task)
+{
+    struct rb_node *sub = sc->chunks[task].node, *it = sub;
+    void *acc = sc->accs + task * sc->size;
+
+    if (!sc->chunks[task].whole)
+    {
+        scan_node(sc, acc, it);
+
+        return;
+    }
+
+    while (!it->_left->_isnil)
+    {
+        it = it->_left;
+    }
+
+    // in order, without leaving the subtree
+    for (;;)
+    {
+        if (!it->_isdead)
+        {
+            scan_node(sc, acc, it);
+        }
+        if (!it->_right->_isnil)
+        {
+            it = it->_right;
+
+            while (!it->_left->_isnil)
+            {
+                it = it->_left;
+            }
+
+            continue;
+        }
+
+        while (it != sub && it == it->_parent->_right)
+        {
+            it = it->_parent;
+        }
+        if (it == sub)
+        {
+            break;
+        }
+
+        it = it->_parent;
+    }
+}
+
+static void
+scan_task(void *ctx, size_t task)
+{
+    scan_chunk((const struct _rbpar_scan *)ctx, task);
+}
+
+static int
+scan_init(struct _rbpar_scan *sc, const struct rb_tree *rb, size_t nthreads)
+{
+    size_t tasks;
+
+    sc->level = 0;
+    sc->nchunks = 0;
+
+    for (tasks = 1; tasks < nthreads * _RBPAR_TASKS; tasks *= 2)
+    {
+        ++sc->level;
+    }
+
+    // the subtrees and the nodes above them
+    sc->chunks = (struct _rbpar_chunk *)malloc(2 * tasks * sizeof(struct _rbpar_chunk));
+
+    if (!sc->chunks)
+    {
+        return -1;
+    }
+
+    scan_split(sc, rb_head(rb)->_parent, 0);
+
+    return 0;
+}
+
+void
+rb_parallel_foreach(struct rb_tree *rb, rb_visit_f fn, void *arg, size_t nthreads)
+{
+    struct _rbpar_scan sc;
+    struct rb_node *it;
+
+    if (scan_init(&sc, rb, nthreads ? nthreads : 1))
+    {
+        for (it = rb_lmst(rb); it != rb_head(rb); it = rb_next(it))
+        {
+            fn(it, arg);
+        }
+
+        return;
+    }
+
+    sc.visit = fn;
+    sc.reduce = NULL;
+    sc.args = arg;
+    sc.accs = NULL;
+    sc.size = 0;
+
+    pool_run(nthreads, sc.nchunks, scan_task, &sc);
+
+    free(sc.chunks);
+}
+
+void
+rb_parallel_reduce(const struct rb_tree *rb, void *acc, size_t size,
+    rb_reduce_f reduce, rb_combine_f combine, void *args, size_t nthreads)
+{
+    struct _rbpar_scan sc;
+    struct rb_node *it;
+    size_t i;
+
+    if (scan_init(&sc, rb, nthreads ? nthreads : 1))
+    {
+        sc.accs = NULL;
+    }
+    else if (!(sc.accs = (char *)malloc(sc.nchunks * size + !sc.nchunks)))
+    {
+        free(sc.chunks);
+    }
+    if (!sc.accs)
+    {
+        for (it = rb_lmst(rb); it != rb_head(rb); it = rb_next(it))
+        {
+            reduce(acc, it, args);
+        }
+
+        return;
+    }
+
+    for (i = 0; i < sc.nchunks; ++i)
+    {
+        memcpy(sc.accs + i * size, acc, size);
+    }
+
+    sc.visit = NULL;
+    sc.reduce = reduce;
+    sc.args = args;
+    sc.size = size;
+
+    pool_run(nthreads, sc.nchunks, scan_task, &sc);
+
+    for (i = 0; i < sc.nchunks; ++i)
+    {
+        combine(acc, sc.accs + i * size, args);
+    }
+
+    free(sc.accs);
+    free(sc.chunks);
+}
+
+// fallback without scratch memory
+static size_t
+impl_build_serial(struct rb_tree *rb, struct rb_node **nodes, size_t n)
+{
+    size_t i, k = 0;
+    int out;
+
+    for (i = 0; i < n; ++i)
+    {
+        struct rb_node *node = nodes[i];
+
+        rb_insert(rb, node, &out);
+
+        if (out)
+        {
+            memmove(nodes + k + 1, nodes + k, (i - k) * sizeof(*nodes));
+            nodes[k++] = node;
+        }
+    }
+
+    return k;
+}
+
+size_t
+rb_build_parallel(struct rb_tree *rb, struct rb_node **nodes, size_t n, size_t nthreads)
+{
+    struct _rbpar_sort st;
+    struct _rbpar_build bd;
+    struct rb_node *root;
+    size_t i, k, nrej, tasks, red = 0;
+
+#if defined _RB_DEBUG
+    assert(!rb->size && !rb_ndead(rb) && "tree is not empty");
+    assert(!_RB_IMPL(rb)->_chain && "not supported by chained trees");
+#endif
+
+    if (!nthreads)
+    {
+        nthreads = 1;
+    }
+    if (!n)
+    {
+        return 0;
+    }
+
+    st.rb = rb;
+    st.nodes = nodes;
+    st.n = n;
+    st.nruns = n < nthreads ? 1 : nthreads;
+
+    if (!(st.tmp = (struct rb_node **)malloc(n * sizeof(*nodes))))
+    {
+        return impl_build_serial(rb, nodes, n);
+    }
+
+    // sort the runs, then merge them pairwise, a round per level
+    pool_run(nthreads, st.nruns, sort_task, &st);
+
+    st.src = nodes;
+    st.dst = st.tmp;
+
+    for (st.width = 1; st.width < st.nruns; st.width *= 2)
+    {
+        struct rb_node **swap = st.src;
+
+        pool_run(nthreads, (st.nruns + 2 * st.width - 1) / (2 * st.width) * (2 * st.width),
+            merge_task, &st);
+
+        st.src = st.dst;
+        st.dst = swap;
+    }
+    if (st.src == st.tmp)
+    {
+        pool_run(nthreads, st.nruns, copy_task, &st);
+    }
+
+    // keep the first of equivalent nodes, the others go to the end
+    k = n;
+
+    if (!_RB_IMPL(rb)->_multi)
+    {
+        if (!(st.keep = (size_t *)malloc(2 * st.nruns * sizeof(size_t))))
+        {
+            for (i = 1, k = 1, nrej = 0; i < n; ++i)
+            {
+                if (rb_comp(rb, nodes[k - 1], nodes[i]))
+                {
+                    nodes[k++] = nodes[i];
+                }
+                else
+                {
+                    st.tmp[nrej++] = nodes[i];
+                }
+            }
+
+            memcpy(nodes + k, st.tmp, nrej * sizeof(*nodes));
+        }
+        else
+        {
+            pool_run(nthreads, st.nruns, uniq_count_task, &st);
+
+            for (i = 0, k = 0; i < st.nruns; ++i)
+            {
+                k += st.keep[i];
+            }
+            for (i = 0, nrej = k, k = 0; i < st.nruns; ++i)
+            {
+                size_t kept = st.keep[i];
+
+                st.keep[st.nruns + i] = nrej;
+                st.keep[i] = k;
+                nrej += sort_bound(&st, i + 1) - sort_bound(&st, i) - kept;
+                k += kept;
+            }
+
+            pool_run(nthreads, st.nruns, uniq_move_task, &st);
+            pool_run(nthreads, st.nruns, copy_task, &st);
+
+            free(st.keep);
+        }
+    }
+
+    // link: enough independent subtrees to keep every thread busy, all
+    // above the deepest level so that none is empty
+    bd.rb = rb;
+    bd.nodes = nodes;
+    bd.n = k;
+    bd.level = 0;
+
+    while (k >> (red + 1))
+    {
+        ++red;
+    }
+    for (tasks = 1; tasks < nthreads * _RBPAR_TASKS && bd.level + 1 < red; tasks *= 2)
+    {
+        ++bd.level;
+    }
+
+    if (!(bd.roots = (struct rb_node **)malloc(tasks * sizeof(*bd.roots))))
+    {
+        bd.level = 0;
+        bd.roots = &root;
+        tasks = 1;
+    }
+
+    pool_run(nthreads, tasks, build_task, &bd);
+    _rb_build(rb, nodes, k, bd.level, 0, bd.roots);
+
+    if (bd.roots != &root)
+    {
+        free(bd.roots);
+    }
+
+    free(st.tmp);
+
+    return k;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2020 niedong
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __RBPAR__
+#define __RBPAR__
+
+#include <stddef.h>
+
+#include "rbtree.h"
+
+/*
+ * Multi-threaded operations on a whole rb_tree, with POSIX threads.
+ * nthreads counts the calling thread, which takes part in the work;
+ * 0 or 1 runs everything on the calling thread. When a thread can not
+ * be started, the work is shared by the threads that could.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Visit function of rb_parallel_foreach. It is called concurrently
+ * from several threads, and may modify the payload of the node but
+ * not the tree.
+ */
+typedef void(*rb_visit_f)(struct rb_node *, void *);
+
+/*
+ * Reduce functions of rb_parallel_reduce. The first one folds a node
+ * into an accumulator, the second one folds into an accumulator the
+ * one of the range that follows it in order. Both receive the extra
+ * argument, and combine must be associative but need not commute.
+ */
+typedef void(*rb_reduce_f)(void *, const struct rb_node *, void *);
+typedef void(*rb_combine_f)(void *, const void *, void *);
+
+/*
+ * Build the tree from n unlinked nodes in any order. The nodes are
+ * sorted by a stable parallel merge sort using the tree's ordering,
+ * whose merges are cut by binary search into one piece per thread, so
+ * that every round keeps all threads busy. They are then linked as a
+ * balanced tree whose subtrees below the top levels are built
+ * independently. The tree must be empty and not chained.
+ *
+ * In unique mode, only the first of equivalent nodes is linked, as
+ * with successive rb_insert calls. On return nodes[0, k) holds the k
+ * linked nodes in order and nodes[k, n) the rejected ones. Returns k.
+ *
+ * Without memory for the scratch array, the nodes are inserted one by
+ * one instead, and nodes[0, k) is not sorted.
+ */
+size_t rb_build_parallel(struct rb_tree *rb, struct rb_node **nodes, size_t n, size_t nthreads);
+
+/*
+ * The tree is split into disjoint chunks near the root: subtrees at a
+ * fixed depth, and the single nodes above them. Several chunks are
+ * made for each thread and the threads claim them one at a time from
+ * a shared atomic counter, so that unevenly sized subtrees are balanced
+ * out. This stands in for work stealing: all chunks exist up front and
+ * none spawns more, so a thread out of work takes the next unclaimed
+ * chunk, as a steal would, for one atomic add per chunk. Tombstones of
+ * lazy erase are skipped, the chains of a chained tree are followed.
+ * The tree must not be modified meanwhile.
+ */
+
+/*
+ * Call fn(node, arg) on every node. The nodes of a chunk are visited
+ * in order, the chunks in no particular order.
+ */
+void rb_parallel_foreach(struct rb_tree *rb, rb_visit_f fn, void *arg, size_t nthreads);
+
+/*
+ * Reduce all nodes into acc, an accumulator of size bytes that holds
+ * the identity on entry and the result on return. Every chunk folds
+ * its nodes in order into a copy of the identity, then the chunks are
+ * combined in order, so the result is that of a serial in-order fold.
+ *
+ * Without memory for the chunk accumulators, the nodes are folded into
+ * acc on the calling thread.
+ */
+void rb_parallel_reduce(const struct rb_tree *rb, void *acc, size_t size,
+    rb_reduce_f reduce, rb_combine_f combine, void *args, size_t nthreads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
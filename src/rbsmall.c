@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2020 niedong
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "rbsmall.h"
+
+#include <string.h>
+
+#if defined _RB_DEBUG
+#include <assert.h>
+#endif
+
+/*
+ * Index of the first node not before val (upper = 0), or after it
+ * (upper = 1), in the array.
+ */
+static size_t
+small_bnd(const struct rbs_tree *rbs, const struct rb_node *val, int upper)
+{
+    size_t lo = 0, hi = rbs->size;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (upper ? !rb_comp(&rbs->_rb, val, rbs->_small[mid]) :
+            rb_comp(&rbs->_rb, rbs->_small[mid], val))
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static struct rb_node *
+small_at(const struct rbs_tree *rbs, size_t i)
+{
+    return i < rbs->size ? rbs->_small[i] : rb_head(&rbs->_rb);
+}
+
+// thread the array in order through _left/_right
+static void
+small_link(struct rbs_tree *rbs, size_t from)
+{
+    size_t i;
+
+    for (i = from; i < rbs->size; ++i)
+    {
+        rbs->_small[i]->_left = i ? rbs->_small[i - 1] : rb_head(&rbs->_rb);
+        rbs->_small[i]->_right = small_at(rbs, i + 1);
+    }
+}
+
+static void
+impl_grow(struct rbs_tree *rbs)
+{
+    size_t i;
+    int out;
+
+    // sorted already, every node goes to the rightmost position
+    for (i = 0; i < rbs->size; ++i)
+    {
+        rb_insert(&rbs->_rb, rbs->_small[i], &out);
+    }
+
+    rbs->_big = 1;
+}
+
+static void
+impl_shrink(struct rbs_tree *rbs)
+{
+    struct rb_node *it;
+    size_t i = 0;
+
+    for (it = rb_lmst(&rbs->_rb); it != rb_head(&rbs->_rb); it = rb_next(it))
+    {
+        rbs->_small[i++] = it;
+    }
+
+    rb_clear(&rbs->_rb);
+    small_link(rbs, 0);
+
+    rbs->_big = 0;
+}
+
+void
+rbs_init(struct rbs_tree *rbs, int multi, rb_compare_f comp, void *args)
+{
+    rb_init(&rbs->_rb, multi, comp, args);
+
+    rbs->_big = 0;
+    rbs->size = 0;
+}
+
+void
+rbs_clear(struct rbs_tree *rbs)
+{
+    rb_clear(&rbs->_rb);
+
+    rbs->_big = 0;
+    rbs->size = 0;
+}
+
+struct rb_node *
+rbs_lmst(const struct rbs_tree *rbs)
+{
+    return rbs->_big ? rb_lmst(&rbs->_rb) : small_at(rbs, 0);
+}
+
+struct rb_node *
+rbs_rmst(const struct rbs_tree *rbs)
+{
+    return rbs->_big ? rb_rmst(&rbs->_rb) : small_at(rbs, rbs->size - 1);
+}
+
+struct rb_node *
+rbs_head(const struct rbs_tree *rbs)
+{
+    return rb_head(&rbs->_rb);
+}
+
+struct rb_node *
+rbs_prev(const struct rbs_tree *rbs, const struct rb_node *node)
+{
+    if (rbs->_big)
+    {
+        return rb_prev(node);
+    }
+
+    return node == rb_head(&rbs->_rb) ? rbs_rmst(rbs) : node->_left;
+}
+
+struct rb_node *
+rbs_next(const struct rbs_tree *rbs, const struct rb_node *node)
+{
+    if (rbs->_big)
+    {
+        return rb_next(node);
+    }
+
+    return node == rb_head(&rbs->_rb) ? rbs_lmst(rbs) : node->_right;
+}
+
+struct rb_node *
+rbs_insert(struct rbs_tree *rbs, struct rb_node *node, int *out)
+{
+    struct rb_node *res;
+    size_t i;
+
+#ifdef _RB_DEBUG
+    assert(out && "not a legal, writable address");
+#endif
+
+    if (!rbs->_big)
+    {
+        i = small_bnd(rbs, node, _RB_IMPL(&rbs->_rb)->_multi);
+
+        if (!_RB_IMPL(&rbs->_rb)->_multi && i < rbs->size &&
+            !rb_comp(&rbs->_rb, node, rbs->_small[i]))
+        {
+            *out = 0;
+
+            return rbs->_small[i];
+        }
+        if (rbs->size < RBS_SMALL)
+        {
+            memmove(rbs->_small + i + 1, rbs->_small + i, (rbs->size - i) * sizeof(node));
+
+            rbs->_small[i] = node;
+            ++rbs->size;
+            *out = 1;
+
+            small_link(rbs, i ? i - 1 : 0);
+
+            return node;
+        }
+
+        impl_grow(rbs);
+    }
+
+    res = rb_insert(&rbs->_rb, node, out);
+    rbs->size = rbs->_rb.size;
+
+    return res;
+}
+
+struct rb_node *
+rbs_erase(struct rbs_tree *rbs, struct rb_node *node)
+{
+    struct rb_node *next;
+    size_t i;
+
+    if (rbs->_big)
+    {
+        next = rb_erase(&rbs->_rb, node);
+        rbs->size = rbs->_rb.size;
+
+        if (rbs->size <= RBS_SMALL / 2)
+        {
+            impl_shrink(rbs);
+        }
+
+        return next;
+    }
+
+    // equivalent nodes are told apart by address
+    for (i = small_bnd(rbs, node, 0); rbs->_small[i] != node; ++i)
+    {
+    }
+
+    next = node->_right;
+
+    memmove(rbs->_small + i, rbs->_small + i + 1, (rbs->size - i - 1) * sizeof(node));
+    --rbs->size;
+
+    if (i)
+    {
+        rbs->_small[i - 1]->_right = next;
+    }
+    if (i < rbs->size)
+    {
+        next->_left = i ? rbs->_small[i - 1] : rb_head(&rbs->_rb);
+    }
+
+    return next;
+}
+
+size_t
+rbs_erase_val(struct rbs_tree *rbs, const struct rb_node *val)
+{
+    size_t lo, hi;
+
+    if (rbs->_big)
+    {
+        lo = rb_erase_val(&rbs->_rb, val);
+        rbs->size = rbs->_rb.size;
+
+        if (rbs->size <= RBS_SMALL / 2)
+        {
+            impl_shrink(rbs);
+        }
+
+        return lo;
+    }
+
+    lo = small_bnd(rbs, val, 0);
+    hi = small_bnd(rbs, val, 1);
+
+    memmove(rbs->_small + lo, rbs->_small + hi, (rbs->size - hi) * sizeof(val));
+    rbs->size -= hi - lo;
+
+    small_link(rbs, lo ? lo - 1 : 0);
+
+    return hi - lo;
+}
+
+struct rb_pair
+rbs_eqrange(const struct rbs_tree *rbs, const struct rb_node *val)
+{
+    struct rb_pair pr;
+
+    if (rbs->_big)
+    {
+        return rb_eqrange(&rbs->_rb, val);
+    }
+
+    pr.first = small_at(rbs, small_bnd(rbs, val, 0));
+    pr.second = small_at(rbs, small_bnd(rbs, val, 1));
+
+    return pr;
+}
+
+struct rb_node *
+rbs_find(const struct rbs_tree *rbs, const struct rb_node *val)
+{
+    struct rb_node *fr = rbs_lbnd(rbs, val);
+
+    return fr == rbs_head(rbs) || rb_comp(&rbs->_rb, val, fr) ?
+        rbs_head(rbs) : fr;
+}
+
+struct rb_node *
+rbs_lbnd(const struct rbs_tree *rbs, const struct rb_node *val)
+{
+    return rbs->_big ? rb_lbnd(&rbs->_rb, val) : small_at(rbs, small_bnd(rbs, val, 0));
+}
+
+struct rb_node *
+rbs_ubnd(const struct rbs_tree *rbs, const struct rb_node *val)
+{
+    return rbs->_big ? rb_ubnd(&rbs->_rb, val) : small_at(rbs, small_bnd(rbs, val, 1));
+}
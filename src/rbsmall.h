@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2020 niedong
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __RBSMALL__
+#define __RBSMALL__
+
+#include <stddef.h>
+
+#include "rbtree.h"
+
+/*
+ * Ordered container of rb_node for the many sets that stay small. Up
+ * to RBS_SMALL nodes are kept in an inline sorted array, searched by
+ * binary search, and linked in order through _left/_right with the
+ * head at both ends. Inserting past RBS_SMALL turns it into a real
+ * rb_tree, and erasing down to RBS_SMALL / 2 turns it back, so that a
+ * size swinging around the threshold does not convert every time.
+ *
+ * Iteration goes through rbs_prev/rbs_next in both forms, from rbs_lmst
+ * or rbs_rmst to rbs_head. Searches, inserts and erases have the same
+ * semantics as their rb_ counterparts.
+ *
+ * Members starting with an underscore are protected, as in rbtree.h.
+ */
+
+#if !defined RBS_SMALL
+// most nodes kept in the array
+#define RBS_SMALL 32
+#endif
+
+struct rbs_tree
+{
+    struct rb_tree  _rb;               // the tree once big, and the ordering
+    struct rb_node *_small[RBS_SMALL]; // the nodes in order while small
+    int             _big;              // big or not
+    size_t          size;              // public member, size of the container
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void rbs_init(struct rbs_tree *rbs, int multi, rb_compare_f comp, void *args);
+void rbs_clear(struct rbs_tree *rbs);
+
+struct rb_node *rbs_lmst(const struct rbs_tree *rbs);
+struct rb_node *rbs_rmst(const struct rbs_tree *rbs);
+struct rb_node *rbs_head(const struct rbs_tree *rbs);
+struct rb_node *rbs_prev(const struct rbs_tree *rbs, const struct rb_node *node);
+struct rb_node *rbs_next(const struct rbs_tree *rbs, const struct rb_node *node);
+
+struct rb_node *rbs_insert(struct rbs_tree *rbs, struct rb_node *node, int *out);
+
+struct rb_node *rbs_erase(struct rbs_tree *rbs, struct rb_node *node);
+size_t rbs_erase_val(struct rbs_tree *rbs, const struct rb_node *val);
+
+struct rb_pair rbs_eqrange(const struct rbs_tree *rbs, const struct rb_node *val);
+
+struct rb_node *rbs_find(const struct rbs_tree *rbs, const struct rb_node *val);
+struct rb_node *rbs_lbnd(const struct rbs_tree *rbs, const struct rb_node *val);
+struct rb_node *rbs_ubnd(const struct rbs_tree *rbs, const struct rb_node *val);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
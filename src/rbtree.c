@@ -22,10 +22,34 @@
 
 #include "rbtree.h"
 
+#include <stdint.h>
+#include <string.h>
+
 #if defined _RB_DEBUG
 #include <assert.h>
 #endif
 
+#if defined _RB_STATS
+// relaxed atomic adds, so that concurrent lookups do not race on them
+#if defined _MSC_VER
+#include <intrin.h>
+#if defined _WIN64
+#define _RB_STAT_ADD(ptr, n) \
+    ((void)_InterlockedExchangeAdd64((volatile __int64 *)(ptr), (__int64)(n)))
+#else
+#define _RB_STAT_ADD(ptr, n) \
+    ((void)_InterlockedExchangeAdd((volatile long *)(ptr), (long)(n)))
+#endif
+#else
+#define _RB_STAT_ADD(ptr, n) \
+    ((void)__atomic_fetch_add((ptr), (size_t)(n), __ATOMIC_RELAXED))
+#endif
+#define _RB_STAT(impl, name, n) \
+    _RB_STAT_ADD(&((struct _rb_impl *)(impl))->_stats.name, n)
+#else
+#define _RB_STAT(impl, name, n) ((void)(impl))
+#endif
+
 static struct rb_node *
 node_min(const struct rb_node *node)
 {
@@ -48,8 +72,11 @@ node_max(const struct rb_node *node)
     return (struct rb_node *)node;
 }
 
+/*
+ * The in-order neighbours, adding the parent climbs to *climbs.
+ */
 static struct rb_node *
-node_prev(const struct rb_node *node)
+node_step_prev(const struct rb_node *node, size_t *climbs)
 {
     if (node->_isnil)
     {
@@ -62,6 +89,7 @@ node_prev(const struct rb_node *node)
         while (!(parent = node->_parent)->_isnil && node == parent->_left)
         {
             node = parent;
+            ++*climbs;
         }
 
         if (!node->_isnil)
@@ -78,7 +106,7 @@ node_prev(const struct rb_node *node)
 }
 
 static struct rb_node *
-node_next(const struct rb_node *node)
+node_step_next(const struct rb_node *node, size_t *climbs)
 {
     if (node->_right->_isnil)
     {
@@ -87,6 +115,7 @@ node_next(const struct rb_node *node)
         while (!(parent = node->_parent)->_isnil && node == parent->_right)
         {
             node = parent;
+            ++*climbs;
         }
 
         node = parent;
@@ -99,11 +128,81 @@ node_next(const struct rb_node *node)
     return (struct rb_node *)node;
 }
 
+static struct rb_node *
+node_prev(const struct _rb_impl *impl, const struct rb_node *node)
+{
+    size_t climbs = 0;
+
+    node = node_step_prev(node, &climbs);
+
+    _RB_STAT(impl, climbs, climbs);
+
+    return (struct rb_node *)node;
+}
+
+static struct rb_node *
+node_next(const struct _rb_impl *impl, const struct rb_node *node)
+{
+    size_t climbs = 0;
+
+    node = node_step_next(node, &climbs);
+
+    _RB_STAT(impl, climbs, climbs);
+
+    return (struct rb_node *)node;
+}
+
+/*
+ * Skip the tombstones of lazy erase, starting from node itself.
+ */
+static struct rb_node *
+node_live_prev(const struct _rb_impl *impl, const struct rb_node *node)
+{
+    while (node->_isdead)
+    {
+        node = node_prev(impl, node);
+    }
+
+    return (struct rb_node *)node;
+}
+
+static struct rb_node *
+node_live_next(const struct _rb_impl *impl, const struct rb_node *node)
+{
+    while (node->_isdead)
+    {
+        node = node_next(impl, node);
+    }
+
+    return (struct rb_node *)node;
+}
+
+#if defined _RB_STATS
+/*
+ * The tree of a node, found at the head above the root, so that rb_prev
+ * and rb_next can count their climbs. The climb here is not counted.
+ */
+static const struct _rb_impl *
+node_impl(const struct rb_node *node)
+{
+    while (!node->_isnil)
+    {
+        node = node->_parent;
+    }
+
+    return (const struct _rb_impl *)((const char *)node - offsetof(struct _rb_impl, _head));
+}
+#else
+#define node_impl(node) ((const struct _rb_impl *)NULL)
+#endif
+
 static void
 impl_rotate_left(struct _rb_impl *impl, struct rb_node *node)
 {
     struct rb_node *root = node->_right;
 
+    _RB_STAT(impl, rotls, 1);
+
     node->_right = root->_left;
 
     if (!root->_left->_isnil)
@@ -135,6 +234,8 @@ impl_rotate_right(struct _rb_impl *impl, struct rb_node *node)
 {
     struct rb_node *root = node->_left;
 
+    _RB_STAT(impl, rotrs, 1);
+
     node->_left = root->_right;
 
     if (!root->_right->_isnil)
@@ -161,6 +262,165 @@ impl_rotate_right(struct _rb_impl *impl, struct rb_node *node)
     node->_parent = root;
 }
 
+/*
+ * One fixup step of a relaxed tree, at the topmost violation of a run
+ * of red nodes: node and its parent are red, its grandparent is black.
+ * The steps are those of an insert fixup, and only move the violations
+ * below node along with their nodes. Returns the grandparent if it was
+ * turned red, since it may be a new violation, or else the head.
+ */
+static struct rb_node *
+impl_relax_step(struct _rb_impl *impl, struct rb_node *node)
+{
+    struct rb_node *pnode = node->_parent;
+    struct rb_node *gnode = pnode->_parent;
+    struct rb_node *pos;
+
+    _RB_STAT(impl, insfix, 1);
+
+    if (gnode == _RB_IMPL_HEAD(impl))
+    {
+        pnode->_color = _RB_BLACK;
+
+        return gnode;
+    }
+
+    pos = pnode == gnode->_left ? gnode->_right : gnode->_left;
+
+    if (pos->_color == _RB_RED)
+    {
+        pnode->_color = _RB_BLACK;
+        pos->_color = _RB_BLACK;
+        gnode->_color = _RB_RED;
+
+        return gnode;
+    }
+    if (pnode == gnode->_left)
+    {
+        if (node == pnode->_right)
+        {
+            impl_rotate_left(impl, pnode);
+            pnode = node;
+        }
+
+        impl_rotate_right(impl, gnode);
+    }
+    else
+    {
+        if (node == pnode->_left)
+        {
+            impl_rotate_right(impl, pnode);
+            pnode = node;
+        }
+
+        impl_rotate_left(impl, gnode);
+    }
+
+    pnode->_color = _RB_BLACK;
+    gnode->_color = _RB_RED;
+
+    return _RB_IMPL_HEAD(impl);
+}
+
+/*
+ * Fix the violation of node with its parent, if still there. Any run of
+ * red nodes above it is fixed first, from the top, together with the
+ * violations the recolouring pushes up. The others stay in the log.
+ */
+static void
+impl_relax_fix(struct _rb_impl *impl, struct rb_node *node)
+{
+    struct rb_node *top, *next;
+
+    while (node->_color == _RB_RED && node->_parent->_color == _RB_RED)
+    {
+        next = node;
+
+        do
+        {
+            for (top = next; top->_parent->_parent->_color == _RB_RED; top = top->_parent);
+
+            next = impl_relax_step(impl, top);
+        } while (next->_color == _RB_RED && next->_parent->_color == _RB_RED);
+    }
+}
+
+static size_t
+impl_relax_flush(struct _rb_impl *impl, size_t budget)
+{
+    for (; budget && impl->_nlog; --budget)
+    {
+        impl_relax_fix(impl, impl->_log[--impl->_nlog]);
+    }
+
+    _RB_IMPL_ROOT(impl)->_color = _RB_BLACK;
+
+    return impl->_nlog;
+}
+
+#define _RB_KEY(node, off, type) \
+    (*(const type *)((const char *)(node) + (off)))
+
+/*
+ * The built-in key types, strictly less as rb_compare_f does. Trees of
+ * rb_init_typed get their impl as extra argument.
+ */
+static int
+typed_less(int type, ptrdiff_t off, const struct rb_node *n1, const struct rb_node *n2)
+{
+    switch (type)
+    {
+    case RB_KEY_I64:
+        return _RB_KEY(n1, off, int64_t) < _RB_KEY(n2, off, int64_t);
+    case RB_KEY_U64:
+        return _RB_KEY(n1, off, uint64_t) < _RB_KEY(n2, off, uint64_t);
+    case RB_KEY_DOUBLE:
+        return _RB_KEY(n1, off, double) < _RB_KEY(n2, off, double);
+    default:
+        return strcmp(_RB_KEY(n1, off, const char *), _RB_KEY(n2, off, const char *)) < 0;
+    }
+}
+
+static int
+typed_comp(const struct rb_node *n1, const struct rb_node *n2, void *args)
+{
+    const struct _rb_impl *impl = (const struct _rb_impl *)args;
+
+    return typed_less(impl->_ktype, impl->_koff, n1, n2);
+}
+
+static int
+typed_kcomp(const struct rb_node *node, const void *key, void *args)
+{
+    const struct _rb_impl *impl = (const struct _rb_impl *)args;
+    ptrdiff_t off = impl->_koff;
+
+    switch (impl->_ktype)
+    {
+    case RB_KEY_I64:
+        return _RB_KEY(node, off, int64_t) < *(const int64_t *)key ? -1 :
+            _RB_KEY(node, off, int64_t) > *(const int64_t *)key;
+    case RB_KEY_U64:
+        return _RB_KEY(node, off, uint64_t) < *(const uint64_t *)key ? -1 :
+            _RB_KEY(node, off, uint64_t) > *(const uint64_t *)key;
+    case RB_KEY_DOUBLE:
+        return _RB_KEY(node, off, double) < *(const double *)key ? -1 :
+            _RB_KEY(node, off, double) > *(const double *)key;
+    default:
+        return strcmp(_RB_KEY(node, off, const char *), *(const char *const *)key);
+    }
+}
+
+static const void *
+typed_skey(const struct rb_node *node, size_t *len, void *args)
+{
+    const char *str = _RB_KEY(node, ((const struct _rb_impl *)args)->_koff, const char *);
+
+    *len = strlen(str);
+
+    return str;
+}
+
 static int
 impl_comp(const struct _rb_impl *impl,
     const struct rb_node *n1, const struct rb_node *n2)
@@ -168,7 +428,28 @@ impl_comp(const struct _rb_impl *impl,
 #define _IMPL_COMP(impl, n1, n2) \
     ((impl)->_comp(n1, n2, (impl)->_args))
 
-    int cmpr = _IMPL_COMP(impl, n1, n2);
+    int cmpr;
+
+    if (impl->_pfx)
+    {
+        uint64_t p1 = ((const struct rb_pnode *)n1)->prefix;
+        uint64_t p2 = ((const struct rb_pnode *)n2)->prefix;
+
+        if (p1 != p2)
+        {
+            return p1 < p2;
+        }
+    }
+    if (impl->_ktype)
+    {
+        _RB_STAT(impl, comps, 1);
+
+        return typed_less(impl->_ktype, impl->_koff, n1, n2);
+    }
+
+    cmpr = _IMPL_COMP(impl, n1, n2);
+
+    _RB_STAT(impl, comps, 1);
 
 #if defined _RB_DEBUG
     assert(!cmpr || (!_IMPL_COMP(impl, n2, n1) && "reflexivity detected"));
@@ -180,20 +461,189 @@ impl_comp(const struct _rb_impl *impl,
 }
 
 static int
+impl_kcomp(const struct _rb_impl *impl,
+    const struct rb_node *node, const void *key)
+{
+#if defined _RB_DEBUG
+    assert(impl->_kcomp && "no key compare function, see rb_set_keycomp");
+#endif
+
+    _RB_STAT(impl, comps, 1);
+
+    return impl->_kcomp(node, key, impl->_args);
+}
+
+/*
+ * Compare the string key of node with key, knowing that the first
+ * *lcp bytes are equal. *lcp is advanced to their full common prefix.
+ */
+static int
+impl_scomp(const struct _rb_impl *impl,
+    const struct rb_node *node, const void *key, size_t len, size_t *lcp)
+{
+    const unsigned char *s1, *s2 = (const unsigned char *)key;
+    size_t len1, min, i = *lcp;
+
+#if defined _RB_DEBUG
+    assert(impl->_skey && "no string key accessor, see rb_set_strkey");
+#endif
+
+    _RB_STAT(impl, comps, 1);
+
+    s1 = (const unsigned char *)impl->_skey(node, &len1, impl->_args);
+    min = len1 < len ? len1 : len;
+
+    // a word at a time, then locate the byte within the differing word
+    for (; i + sizeof(uint64_t) <= min; i += sizeof(uint64_t))
+    {
+        uint64_t w1, w2;
+
+        memcpy(&w1, s1 + i, sizeof(w1));
+        memcpy(&w2, s2 + i, sizeof(w2));
+
+        if (w1 != w2)
+        {
+            break;
+        }
+    }
+    while (i < min && s1[i] == s2[i])
+    {
+        ++i;
+    }
+
+    *lcp = i;
+
+    if (i == min)
+    {
+        return len1 < len ? -1 : len1 > len;
+    }
+
+    return s1[i] < s2[i] ? -1 : 1;
+}
+
+int
 rb_comp(const struct rb_tree *rb,
     const struct rb_node *n1, const struct rb_node *n2)
 {
     return impl_comp(_RB_IMPL(rb), n1, n2);
 }
 
+// slots probed from the hash of a key
+#define _RB_CACHE_WAYS 4
+
+static uint64_t
+typed_hash(const struct rb_node *node, void *args)
+{
+    const struct _rb_impl *impl = (const struct _rb_impl *)args;
+    ptrdiff_t off = impl->_koff;
+    uint64_t hash;
+    double dbl;
+
+    switch (impl->_ktype)
+    {
+    case RB_KEY_I64:
+    case RB_KEY_U64:
+        return _RB_KEY(node, off, uint64_t);
+    case RB_KEY_DOUBLE:
+        // -0.0 is equivalent to 0.0
+        dbl = _RB_KEY(node, off, double) == 0 ? 0 : _RB_KEY(node, off, double);
+        memcpy(&hash, &dbl, sizeof(hash));
+        return hash;
+    default:
+        // FNV-1a
+        hash = 14695981039346656037ull;
+
+        for (const unsigned char *str = _RB_KEY(node, off, const unsigned char *); *str; ++str)
+        {
+            hash = (hash ^ *str) * 1099511628211ull;
+        }
+
+        return hash;
+    }
+}
+
+/*
+ * The user's hash, through the MurmurHash3 finalizer, so that the slot
+ * index taken from the low bits depends on all of them.
+ */
+static uint64_t
+impl_cache_hash(const struct _rb_impl *impl, const struct rb_node *node)
+{
+    uint64_t hash = impl->_cache->_hash(node, impl->_args);
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9f53ec5bd53ull;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+/*
+ * Remove node from the cache, or with equal, every node hashed like it.
+ */
+static void
+impl_cache_drop(const struct _rb_impl *impl, const struct rb_node *node, int equal)
+{
+    struct rb_cache *cache = impl->_cache;
+    struct rb_cache_slot *slot;
+
+    uint64_t hash = impl_cache_hash(impl, node);
+
+    for (size_t i = 0; i < _RB_CACHE_WAYS; ++i)
+    {
+        slot = &cache->_slots[(hash + i) & cache->_mask];
+
+        if (slot->_node == node || (equal && slot->_hash == hash))
+        {
+            slot->_node = NULL;
+        }
+    }
+}
+
+/*
+ * Remove node from the cache by scanning the whole table, for when the
+ * key it was cached under is no longer known.
+ */
+static void
+impl_cache_evict(struct rb_cache *cache, const struct rb_node *node)
+{
+    if (cache)
+    {
+        for (size_t i = 0; i <= cache->_mask; ++i)
+        {
+            if (cache->_slots[i]._node == node)
+            {
+                cache->_slots[i]._node = NULL;
+            }
+        }
+    }
+}
+
+static void
+impl_cache_reset(struct rb_cache *cache)
+{
+    if (cache)
+    {
+        memset(cache->_slots, 0, (cache->_mask + 1) * sizeof(*cache->_slots));
+    }
+}
+
+/*
+ * The lower and upper bound searches start from the subtree rooted at
+ * node. parent is the result when no node of the subtree qualifies.
+ */
 static struct rb_node *
-impl_lbnd(const struct _rb_impl *impl, const struct rb_node *val)
+impl_lbnd_from(const struct _rb_impl *impl, const struct rb_node *node,
+    const struct rb_node *parent, const struct rb_node *val)
 {
-    const struct rb_node *parent = _RB_IMPL_HEAD(impl);
-    const struct rb_node *node = parent->_parent;
+    _RB_STAT(impl, descents, 1);
 
     while (!node->_isnil)
     {
+        _RB_STAT(impl, depth, 1);
+
         if (impl_comp(impl, node, val))
         {
             node = node->_right;
@@ -209,13 +659,15 @@ impl_lbnd(const struct _rb_impl *impl, const struct rb_node *val)
 }
 
 static struct rb_node *
-impl_ubnd(const struct _rb_impl *impl, const struct rb_node *val)
+impl_ubnd_from(const struct _rb_impl *impl, const struct rb_node *node,
+    const struct rb_node *parent, const struct rb_node *val)
 {
-    const struct rb_node *parent = _RB_IMPL_HEAD(impl);
-    const struct rb_node *node = parent->_parent;
+    _RB_STAT(impl, descents, 1);
 
     while (!node->_isnil)
     {
+        _RB_STAT(impl, depth, 1);
+
         if (impl_comp(impl, val, node))
         {
             parent = node;
@@ -230,35 +682,204 @@ impl_ubnd(const struct _rb_impl *impl, const struct rb_node *val)
     return (struct rb_node *)parent;
 }
 
-static struct rb_pair
-impl_eqrange(const struct _rb_impl *impl, const struct rb_node *val)
+static struct rb_node *
+impl_lbnd(const struct _rb_impl *impl, const struct rb_node *val)
 {
-    struct rb_pair pr;
+    return impl_lbnd_from(impl, _RB_IMPL_ROOT(impl), _RB_IMPL_HEAD(impl), val);
+}
+
+static struct rb_node *
+impl_ubnd(const struct _rb_impl *impl, const struct rb_node *val)
+{
+    return impl_ubnd_from(impl, _RB_IMPL_ROOT(impl), _RB_IMPL_HEAD(impl), val);
+}
 
+static struct rb_node *
+impl_lbnd_key(const struct _rb_impl *impl, const void *key)
+{
     const struct rb_node *node = _RB_IMPL_ROOT(impl);
-    const struct rb_node *begin = _RB_IMPL_HEAD(impl);
-    const struct rb_node *end = _RB_IMPL_HEAD(impl);
+    const struct rb_node *parent = _RB_IMPL_HEAD(impl);
+
+    _RB_STAT(impl, descents, 1);
 
     while (!node->_isnil)
     {
-        if (impl_comp(impl, node, val))
+        _RB_STAT(impl, depth, 1);
+
+        if (impl_kcomp(impl, node, key) < 0)
         {
             node = node->_right;
         }
         else
         {
-            if (end->_isnil && impl_comp(impl, val, node))
-            {
-                end = node;
-            }
-            begin = node;
+            parent = node;
             node = node->_left;
         }
     }
-    node = end->_isnil ? _RB_IMPL_ROOT(impl) : end->_left;
-    while (!node->_isnil)
-    {
-        if (impl_comp(impl, val, node))
+
+    return (struct rb_node *)parent;
+}
+
+static struct rb_node *
+impl_ubnd_key(const struct _rb_impl *impl, const void *key)
+{
+    const struct rb_node *node = _RB_IMPL_ROOT(impl);
+    const struct rb_node *parent = _RB_IMPL_HEAD(impl);
+
+    _RB_STAT(impl, descents, 1);
+
+    while (!node->_isnil)
+    {
+        _RB_STAT(impl, depth, 1);
+
+        if (impl_kcomp(impl, node, key) > 0)
+        {
+            parent = node;
+            node = node->_left;
+        }
+        else
+        {
+            node = node->_right;
+        }
+    }
+
+    return (struct rb_node *)parent;
+}
+
+/*
+ * llcp and rlcp are the common prefix lengths of key with the last
+ * node passed on the right and on the left. The nodes in between can
+ * not share less with key than the smaller of the two.
+ */
+static struct rb_node *
+impl_bnd_str(const struct _rb_impl *impl, const void *key, size_t len, int upper)
+{
+    const struct rb_node *node = _RB_IMPL_ROOT(impl);
+    const struct rb_node *parent = _RB_IMPL_HEAD(impl);
+
+    size_t llcp = 0, rlcp = 0, lcp;
+    int cmpr;
+
+    _RB_STAT(impl, descents, 1);
+
+    while (!node->_isnil)
+    {
+        _RB_STAT(impl, depth, 1);
+
+        lcp = llcp < rlcp ? llcp : rlcp;
+        cmpr = impl_scomp(impl, node, key, len, &lcp);
+
+        if (upper ? cmpr <= 0 : cmpr < 0)
+        {
+            llcp = lcp;
+            node = node->_right;
+        }
+        else
+        {
+            rlcp = lcp;
+            parent = node;
+            node = node->_left;
+        }
+    }
+
+    return (struct rb_node *)parent;
+}
+
+/*
+ * Climb from finger to the subtree whose search leads to the lower
+ * (upper = 0) or upper bound (upper = 1) of val. *bound receives the
+ * result for a search that finds no node in that subtree. Only the
+ * ancestors where the climb changes direction are compared, and the
+ * climb stops as soon as val is known to fall inside the subtree, so
+ * its cost grows with the rank distance from finger rather than n.
+ */
+static struct rb_node *
+impl_climb(const struct _rb_impl *impl, const struct rb_node *finger,
+    const struct rb_node *val, int upper, struct rb_node **bound)
+{
+#define BEFORE(node) \
+    (upper ? !impl_comp(impl, val, node) : impl_comp(impl, node, val))
+
+    const struct rb_node *node = finger;
+    const struct rb_node *parent;
+
+    *bound = (struct rb_node *)_RB_IMPL_HEAD(impl);
+
+    if (finger->_isnil)
+    {
+        return _RB_IMPL_ROOT(impl);
+    }
+
+    if (BEFORE(finger))
+    {
+        // the bound lies after finger
+        while (!(parent = node->_parent)->_isnil)
+        {
+            if (node == parent->_left && !BEFORE(parent))
+            {
+                *bound = (struct rb_node *)parent;
+                break;
+            }
+
+            node = parent;
+        }
+    }
+    else
+    {
+        // the bound is finger or lies before it
+        *bound = (struct rb_node *)finger;
+
+        while (!(parent = node->_parent)->_isnil)
+        {
+            if (node == parent->_right && BEFORE(parent))
+            {
+                break;
+            }
+
+            node = parent;
+        }
+    }
+
+    return (struct rb_node *)node;
+
+#undef BEFORE
+}
+
+static struct rb_pair
+impl_eqrange(const struct _rb_impl *impl, const struct rb_node *val)
+{
+    struct rb_pair pr;
+
+    const struct rb_node *node = _RB_IMPL_ROOT(impl);
+    const struct rb_node *begin = _RB_IMPL_HEAD(impl);
+    const struct rb_node *end = _RB_IMPL_HEAD(impl);
+
+    _RB_STAT(impl, descents, 1);
+
+    while (!node->_isnil)
+    {
+        _RB_STAT(impl, depth, 1);
+
+        if (impl_comp(impl, node, val))
+        {
+            node = node->_right;
+        }
+        else
+        {
+            if (end->_isnil && impl_comp(impl, val, node))
+            {
+                end = node;
+            }
+            begin = node;
+            node = node->_left;
+        }
+    }
+    node = end->_isnil ? _RB_IMPL_ROOT(impl) : end->_left;
+    while (!node->_isnil)
+    {
+        _RB_STAT(impl, depth, 1);
+
+        if (impl_comp(impl, val, node))
         {
             end = node;
             node = node->_left;
@@ -273,6 +894,81 @@ impl_eqrange(const struct _rb_impl *impl, const struct rb_node *val)
     return pr;
 }
 
+/*
+ * The three-way result lets the search split at the first equivalent
+ * node: the lower bound is then in its left subtree and the upper
+ * bound in its right one.
+ */
+static struct rb_pair
+impl_eqrange_key(const struct _rb_impl *impl, const void *key)
+{
+    struct rb_pair pr;
+
+    const struct rb_node *node = _RB_IMPL_ROOT(impl);
+    const struct rb_node *begin = _RB_IMPL_HEAD(impl);
+    const struct rb_node *end = _RB_IMPL_HEAD(impl);
+    const struct rb_node *up;
+
+    int cmpr;
+
+    _RB_STAT(impl, descents, 1);
+
+    while (!node->_isnil)
+    {
+        _RB_STAT(impl, depth, 1);
+
+        if ((cmpr = impl_kcomp(impl, node, key)) < 0)
+        {
+            node = node->_right;
+        }
+        else if (cmpr > 0)
+        {
+            begin = end = node;
+            node = node->_left;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (!node->_isnil)
+    {
+        begin = node;
+
+        for (up = node->_right, node = node->_left; !node->_isnil; )
+        {
+            _RB_STAT(impl, depth, 1);
+
+            if (impl_kcomp(impl, node, key) < 0)
+            {
+                node = node->_right;
+            }
+            else
+            {
+                begin = node;
+                node = node->_left;
+            }
+        }
+        while (!up->_isnil)
+        {
+            _RB_STAT(impl, depth, 1);
+
+            if (impl_kcomp(impl, up, key) > 0)
+            {
+                end = up;
+                up = up->_left;
+            }
+            else
+            {
+                up = up->_right;
+            }
+        }
+    }
+
+    pr.first = (struct rb_node *)begin, pr.second = (struct rb_node *)end;
+    return pr;
+}
+
 static struct rb_node *
 rb_erase_node(struct rb_tree *rb, struct rb_node *node)
 {
@@ -294,7 +990,16 @@ rb_erase_node(struct rb_tree *rb, struct rb_node *node)
     struct rb_node *erased = node;
     struct rb_node *pnode = erased;
 
-    node = node_next(node);
+    if (impl->_nlog)
+    {
+        impl_relax_flush(impl, SIZE_MAX);
+    }
+    if (impl->_cache)
+    {
+        impl_cache_drop(impl, node, 0);
+    }
+
+    node = node_next(impl, node);
 
     if (pnode->_left->_isnil)
     {
@@ -386,6 +1091,8 @@ rb_erase_node(struct rb_tree *rb, struct rb_node *node)
             && fixnode->_color == _RB_BLACK;
             fixparent = fixnode->_parent)
         {
+            _RB_STAT(impl, erasefix, 1);
+
             if (fixnode == fixparent->_left)
             {
                 pnode = fixparent->_right;
@@ -475,41 +1182,19 @@ rb_erase_node(struct rb_tree *rb, struct rb_node *node)
 #undef SWAP_COLOR
 }
 
-static struct rb_node *
-impl_node_insert(struct rb_tree *rb,
-    struct rb_node *node, struct rb_node *pos, int addleft)
+/*
+ * Restore the red-black properties after the red node has been linked
+ * below its parent. The root may be left red.
+ */
+static void
+impl_insert_fixup(struct _rb_impl *impl, struct rb_node *node)
 {
-    struct _rb_impl *impl = _RB_IMPL(rb);
-
-    node->_parent = pos;
-
-    if (pos == _RB_IMPL_HEAD(impl))
-    {
-        _RB_IMPL_ROOT(impl) = node;
-        _RB_IMPL_LMST(impl) = node;
-        _RB_IMPL_RMST(impl) = node;
-    }
-    else if (addleft)
-    {
-        pos->_left = node;
-
-        if (pos == _RB_IMPL_LMST(impl))
-        {
-            _RB_IMPL_LMST(impl) = node;
-        }
-    }
-    else
-    {
-        pos->_right = node;
-
-        if (pos == _RB_IMPL_RMST(impl))
-        {
-            _RB_IMPL_RMST(impl) = node;
-        }
-    }
+    struct rb_node *pos;
 
     for (struct rb_node *pnode = node; pnode->_parent->_color == _RB_RED; )
     {
+        _RB_STAT(impl, insfix, 1);
+
         if (pnode->_parent == pnode->_parent->_parent->_left)
         {
             pos = pnode->_parent->_parent->_right;
@@ -559,65 +1244,146 @@ impl_node_insert(struct rb_tree *rb,
             }
         }
     }
-
-    _RB_IMPL_ROOT(impl)->_color = _RB_BLACK;
-    ++rb->size;
-
-    return node;
 }
 
 static struct rb_node *
-rb_insert_node(struct rb_tree *rb, struct rb_node *node, int left, int *out)
+impl_node_insert(struct rb_tree *rb,
+    struct rb_node *node, struct rb_node *pos, int addleft)
 {
     struct _rb_impl *impl = _RB_IMPL(rb);
 
-    struct rb_node *position = _RB_IMPL_HEAD(impl);
-    struct rb_node *res = position->_parent;
-
-    int addleft = 1;
-
-    *out = 1;
+    node->_parent = pos;
 
-    while (!res->_isnil)
+    if (pos == _RB_IMPL_HEAD(impl))
     {
-        position = res;
+        _RB_IMPL_ROOT(impl) = node;
+        _RB_IMPL_LMST(impl) = node;
+        _RB_IMPL_RMST(impl) = node;
+    }
+    else if (addleft)
+    {
+        pos->_left = node;
 
-        if (left)
+        if (pos == _RB_IMPL_LMST(impl))
         {
-            addleft = !impl_comp(impl, res, node);
+            _RB_IMPL_LMST(impl) = node;
         }
-        else
+    }
+    else
+    {
+        pos->_right = node;
+
+        if (pos == _RB_IMPL_RMST(impl))
         {
-            addleft = impl_comp(impl, node, res);
+            _RB_IMPL_RMST(impl) = node;
         }
-
-        res = addleft ? res->_left : res->_right;
     }
 
-    if (impl->_multi)
+    if (!impl->_log || node->_parent->_color == _RB_BLACK)
     {
-        return impl_node_insert(rb, node, position, addleft);
+        impl_insert_fixup(impl, node);
+    }
+    else if (impl->_nlog < impl->_clog)
+    {
+        impl->_log[impl->_nlog++] = node;
     }
     else
     {
-        struct rb_node *pos = position;
+        impl_relax_fix(impl, node);
+    }
 
-        if (!addleft)
-        {
-        }
-        else if (pos == _RB_IMPL_LMST(impl))
+    _RB_IMPL_ROOT(impl)->_color = _RB_BLACK;
+    ++rb->size;
+
+    // the first of equal nodes may have changed
+    if (impl->_cache && impl->_multi)
+    {
+        impl_cache_drop(impl, node, 1);
+    }
+
+    return node;
+}
+
+/*
+ * Physically remove a tombstone left by lazy erase.
+ */
+static void
+impl_purge(struct rb_tree *rb, struct rb_node *node)
+{
+    rb_erase_node(rb, node);
+
+    ++rb->size;
+    --_RB_IMPL(rb)->_ndead;
+}
+
+/*
+ * Insert node by a search from the subtree rooted at start, which must
+ * contain the insert position.
+ */
+static struct rb_node *
+impl_insert_from(struct rb_tree *rb,
+    struct rb_node *node, struct rb_node *start, int left, int *out)
+{
+    struct _rb_impl *impl = _RB_IMPL(rb);
+
+    struct rb_node *position = _RB_IMPL_HEAD(impl);
+    struct rb_node *res = start;
+
+    int addleft = 1;
+
+    *out = 1;
+
+    _RB_STAT(impl, descents, 1);
+
+    while (!res->_isnil)
+    {
+        _RB_STAT(impl, depth, 1);
+
+        position = res;
+
+        if (left)
+        {
+            addleft = !impl_comp(impl, res, node);
+        }
+        else
+        {
+            addleft = impl_comp(impl, node, res);
+        }
+
+        res = addleft ? res->_left : res->_right;
+    }
+
+    if (impl->_multi)
+    {
+        return impl_node_insert(rb, node, position, addleft);
+    }
+    else
+    {
+        struct rb_node *pos = position;
+
+        if (!addleft)
+        {
+        }
+        else if (pos == _RB_IMPL_LMST(impl))
         {
             return impl_node_insert(rb, node, position, 1);
         }
         else
         {
-            pos = node_prev(pos);
+            pos = node_prev(impl, pos);
         }
 
         if (impl_comp(impl, pos, node))
         {
             return impl_node_insert(rb, node, position, addleft);
         }
+        else if (pos->_isdead)
+        {
+            // the only equivalent node is a tombstone, drop it and retry
+            impl_purge(rb, pos);
+
+            return impl_insert_from(rb, node, _RB_ROOT(rb), left, out);
+        }
         else
         {
             *out = 0;
@@ -627,195 +1393,1559 @@ rb_insert_node(struct rb_tree *rb, struct rb_node *node, int left, int *out)
     }
 }
 
-static void
-node_init(struct rb_node *node, struct rb_node *head)
+static struct rb_node *
+rb_insert_node(struct rb_tree *rb, struct rb_node *node, int left, int *out)
 {
-    node->_parent = head;
-    node->_left = head;
-    node->_right = head;
-    node->_color = _RB_RED;
-    node->_isnil = 0;
+    return impl_insert_from(rb, node, _RB_ROOT(rb), left, out);
 }
 
-static void
-head_init(struct rb_node *head)
-{
-    head->_parent = head;
-    head->_left = head;
-    head->_right = head;
-    head->_color = _RB_BLACK;
-    head->_isnil = 1;
-}
+#define _RB_CNODE(node) ((struct rb_cnode *)(node))
 
-static void
-impl_init(struct _rb_impl *impl, int multi, rb_compare_f comp, void *args)
+/*
+ * The chain of a key is a ring of its duplicates: the first one comes
+ * after the key and holds the last one in _parent, whose _right is the
+ * key again. From a duplicate, _left leads back to the key as well.
+ */
+static struct rb_node *
+node_chain_last(const struct rb_node *key)
 {
-    head_init(_RB_IMPL_HEAD(impl));
+    struct rb_node *first = _RB_CNODE(key)->_dups;
 
-    impl->_multi = multi;
-    impl->_comp = comp;
-    impl->_args = args;
+    return first ? first->_parent : (struct rb_node *)key;
 }
 
-struct rb_node *
-rb_lmst(const struct rb_tree *rb)
+// the key of a duplicate, searched towards both ends of the chain
+static struct rb_node *
+node_chain_key(const struct rb_node *dup)
 {
-    return _RB_LMST(rb);
-}
+    const struct rb_node *l = dup, *r = dup;
 
-struct rb_node *
-rb_rmst(const struct rb_tree *rb)
-{
-    return _RB_RMST(rb);
-}
+    while (l->_chained == _RB_CHAIN_DUP && r->_chained == _RB_CHAIN_DUP)
+    {
+        l = l->_left;
+        r = r->_right;
+    }
 
-struct rb_node *
-rb_head(const struct rb_tree *rb)
-{
-    return (struct rb_node *)_RB_HEAD(rb);
+    return (struct rb_node *)(l->_chained == _RB_CHAIN_KEY ? l : r);
 }
 
-struct rb_node *
-rb_prev(const struct rb_node *node)
+/*
+ * Insert by a single descent that also finds an equivalent key, whose
+ * chain node is then appended to.
+ */
+static struct rb_node *
+impl_chain_insert(struct rb_tree *rb, struct rb_node *node)
 {
-    return node_prev(node);
-}
+    struct _rb_impl *impl = _RB_IMPL(rb);
 
-struct rb_node *
-rb_next(const struct rb_node *node)
-{
-    return node_next(node);
-}
+    struct rb_node *position = _RB_IMPL_HEAD(impl);
+    struct rb_node *lbnd = position;
+    struct rb_node *res = _RB_IMPL_ROOT(impl);
 
-void
-rb_init(struct rb_tree *rb, int multi, rb_compare_f comp, void *args)
-{
-    impl_init(_RB_IMPL(rb), multi, comp, args);
+    int addleft = 1;
 
-    rb->size = 0;
-}
+    _RB_STAT(impl, descents, 1);
 
-void
-rb_clear(struct rb_tree *rb)
-{
-    head_init(_RB_HEAD(rb));
+    while (!res->_isnil)
+    {
+        _RB_STAT(impl, depth, 1);
 
-    rb->size = 0;
-}
+        position = res;
+        addleft = !impl_comp(impl, res, node);
 
-struct rb_node *
-rb_insert(struct rb_tree *rb, struct rb_node *node, int *out)
-{
-#ifdef _RB_DEBUG
-    assert(out && "not a legal, writable address");
-#endif
+        if (addleft)
+        {
+            lbnd = res;
+        }
 
-    node_init(node, _RB_HEAD(rb));
+        res = addleft ? res->_left : res->_right;
+    }
 
-    return rb_insert_node(rb, node, 0, out);
-}
+    if (!lbnd->_isnil && !impl_comp(impl, node, lbnd))
+    {
+        struct rb_cnode *key = _RB_CNODE(lbnd);
+        struct rb_node *last = node_chain_last(lbnd);
 
-struct rb_pair
-rb_eqrange(const struct rb_tree *rb, const struct rb_node *val)
-{
-    return impl_eqrange(_RB_IMPL(rb), val);
-}
+        node->_chained = _RB_CHAIN_DUP;
+        node->_left = last;
+        node->_right = lbnd;
 
-struct rb_node *
-rb_lbnd(const struct rb_tree *rb, const struct rb_node *val)
-{
-    return impl_lbnd(_RB_IMPL(rb), val);
-}
+        if (key->_dups)
+        {
+            last->_right = node;
+            key->_dups->_parent = node;
+        }
+        else
+        {
+            key->_dups = node;
+            node->_parent = node;
+        }
 
-struct rb_node *
-rb_ubnd(const struct rb_tree *rb, const struct rb_node *val)
-{
-    return impl_ubnd(_RB_IMPL(rb), val);
-}
+        ++key->_count;
+        ++rb->size;
 
-struct rb_node *
-rb_find(const struct rb_tree *rb, const struct rb_node *val)
-{
-    struct rb_node *fr = rb_lbnd(rb, val);
+        return node;
+    }
 
-    return fr == rb_head(rb) || rb_comp(rb, val, fr) ?
-        rb_head(rb) : fr;
-}
+    node->_chained = _RB_CHAIN_KEY;
+    _RB_CNODE(node)->_dups = NULL;
+    _RB_CNODE(node)->_count = 1;
 
-struct rb_node *
-rb_erase(struct rb_tree *rb, struct rb_node *node)
-{
-    return rb_erase_node(rb, node);
+    return impl_node_insert(rb, node, position, addleft);
 }
 
-struct rb_node *
-rb_erase_range(struct rb_tree *rb,
-    struct rb_node *begin, struct rb_node *end)
+/*
+ * Erase one node of a chained tree and return the next one. A key with
+ * duplicates is replaced in the tree by the first of them, without any
+ * rebalancing.
+ */
+static struct rb_node *
+impl_chain_erase(struct rb_tree *rb, struct rb_node *node)
 {
-    if (begin == rb_lmst(rb) && end == rb_head(rb))
-    {
-        rb_clear(rb);
+    struct _rb_impl *impl = _RB_IMPL(rb);
+    struct rb_node *key, *first, *last, *next;
 
-        return rb_lmst(rb);
+    // the relaxed log points at the key, so drain it before a copy replaces it
+    if (impl->_nlog)
+    {
+        impl_relax_flush(impl, SIZE_MAX);
     }
-    else
+
+    if (node->_chained == _RB_CHAIN_KEY)
     {
-        while (begin != end)
+        struct rb_node *rest;
+
+        if (!(first = _RB_CNODE(node)->_dups))
         {
-            begin = rb_erase(rb, begin);
+            return rb_erase_node(rb, node);
+        }
+        if (impl->_cache)
+        {
+            impl_cache_drop(impl, node, 0);
         }
 
-        return begin;
+        last = first->_parent;
+        rest = first->_right;
+
+        // the first copy takes the place and colour of its key
+        first->_parent = node->_parent;
+        first->_left = node->_left;
+        first->_right = node->_right;
+        first->_color = node->_color;
+        first->_chained = _RB_CHAIN_KEY;
+
+        if (!first->_left->_isnil)
+        {
+            first->_left->_parent = first;
+        }
+        if (!first->_right->_isnil)
+        {
+            first->_right->_parent = first;
+        }
+        if (_RB_IMPL_ROOT(impl) == node)
+        {
+            _RB_IMPL_ROOT(impl) = first;
+        }
+        else if (node->_parent->_left == node)
+        {
+            node->_parent->_left = first;
+        }
+        else
+        {
+            node->_parent->_right = first;
+        }
+        if (_RB_IMPL_LMST(impl) == node)
+        {
+            _RB_IMPL_LMST(impl) = first;
+        }
+        if (_RB_IMPL_RMST(impl) == node)
+        {
+            _RB_IMPL_RMST(impl) = first;
+        }
+
+        _RB_CNODE(first)->_count = _RB_CNODE(node)->_count - 1;
+        _RB_CNODE(first)->_dups = first == last ? NULL : rest;
+
+        if (first != last)
+        {
+            rest->_left = first;
+            rest->_parent = last;
+            last->_right = first;
+        }
+
+        --rb->size;
+
+        return first;
     }
-}
 
-size_t
-rb_erase_rgcnt(struct rb_tree *rb,
-    struct rb_node *begin, struct rb_node *end)
-{
-    size_t dist = 0;
+    key = node_chain_key(node);
+    first = _RB_CNODE(key)->_dups;
+    last = first->_parent;
+    next = node->_right;
 
-    if (begin == rb_lmst(rb) && end == rb_head(rb))
+    if (node == first)
     {
-        dist = rb->size;
+        _RB_CNODE(key)->_dups = node == last ? NULL : next;
 
-        rb_clear(rb);
+        if (node != last)
+        {
+            next->_left = key;
+            next->_parent = last;
+        }
     }
     else
     {
-        while (begin != end)
+        node->_left->_right = next;
+
+        if (node == last)
         {
-            begin = rb_erase(rb, begin);
-            ++dist;
+            first->_parent = node->_left;
+        }
+        else
+        {
+            next->_left = node->_left;
         }
     }
 
-    return dist;
+    --_RB_CNODE(key)->_count;
+    --rb->size;
+
+    return next == key ? node_next(impl, key) : next;
 }
 
-size_t
-rb_erase_val(struct rb_tree *rb, const struct rb_node *val)
+/*
+ * Erase every copy of the key at node, the equal range [node, end),
+ * with a single tree erase.
+ */
+static size_t
+impl_chain_erase_all(struct rb_tree *rb, struct rb_node *node, struct rb_node *end)
 {
-    struct rb_pair pr = rb_eqrange(rb, val);
-    
-    return rb_erase_rgcnt(rb, pr.first, pr.second);
+    size_t count;
+
+    if (node == end)
+    {
+        return 0;
+    }
+
+    count = _RB_CNODE(node)->_count;
+
+    rb_erase_node(rb, node);
+    rb->size -= count - 1;
+
+    return count;
 }
 
-size_t
-rb_dist(const struct rb_tree *rb,
-    const struct rb_node *begin, const struct rb_node *end)
+/*
+ * Black height of the subtree rooted at node, counting node itself
+ * but not the nil leaves.
+ */
+static size_t
+node_bheight(const struct rb_node *node)
 {
-    size_t dist = 0;
+    size_t height = 0;
 
-    if (begin == _RB_LMST(rb) && end == rb_head(rb))
+    for (; !node->_isnil; node = node->_left)
     {
-        dist = rb->size;
+        height += node->_color == _RB_BLACK;
     }
-    else
+
+    return height;
+}
+
+/*
+ * Detach the subtree rooted at node as a standalone tree with a black
+ * root. height is its black height, which is returned updated.
+ */
+static size_t
+impl_detach(struct _rb_impl *impl, struct rb_node *node, size_t height)
+{
+    if (!node->_isnil)
+    {
+        node->_parent = _RB_IMPL_HEAD(impl);
+
+        if (node->_color == _RB_RED)
+        {
+            node->_color = _RB_BLACK;
+            ++height;
+        }
+    }
+
+    return height;
+}
+
+/*
+ * Join the standalone trees left and right, with node ordered between
+ * them, into one tree in O(|lh - rh| + 1). Both roots must be black,
+ * lh and rh are their black heights. The joined root is returned and
+ * its black height is stored in *height.
+ *
+ * The head's root link is used as scratch during the join; the head's
+ * leftmost and rightmost links are not maintained.
+ */
+static struct rb_node *
+impl_join(struct _rb_impl *impl, struct rb_node *left, size_t lh,
+    struct rb_node *node, struct rb_node *right, size_t rh, size_t *height)
+{
+    struct rb_node *head = _RB_IMPL_HEAD(impl);
+    struct rb_node *parent = head;
+    struct rb_node *pos;
+    struct rb_node *root;
+    size_t ph;
+
+    if (lh >= rh)
+    {
+        // the right spine of left, down to a black node as high as right
+        for (pos = left, ph = lh; pos->_color == _RB_RED || ph > rh;
+            pos = pos->_right)
+        {
+            ph -= pos->_color == _RB_BLACK;
+            parent = pos;
+        }
+
+        node->_left = pos;
+        node->_right = right;
+        root = left;
+    }
+    else
+    {
+        for (pos = right, ph = rh; pos->_color == _RB_RED || ph > lh;
+            pos = pos->_left)
+        {
+            ph -= pos->_color == _RB_BLACK;
+            parent = pos;
+        }
+
+        node->_left = left;
+        node->_right = pos;
+        root = right;
+    }
+
+    node->_parent = parent;
+    node->_color = _RB_RED;
+
+    if (!node->_left->_isnil)
+    {
+        node->_left->_parent = node;
+    }
+    if (!node->_right->_isnil)
+    {
+        node->_right->_parent = node;
+    }
+
+    if (parent == head)
+    {
+        root = node;
+    }
+    else if (lh >= rh)
+    {
+        parent->_right = node;
+    }
+    else
+    {
+        parent->_left = node;
+    }
+
+    root->_parent = head;
+    _RB_IMPL_ROOT(impl) = root;
+
+    impl_insert_fixup(impl, node);
+
+    root = _RB_IMPL_ROOT(impl);
+    *height = lh >= rh ? lh : rh;
+
+    if (root->_color == _RB_RED)
+    {
+        root->_color = _RB_BLACK;
+        ++*height;
+    }
+
+    return root;
+}
+
+/*
+ * Split the standalone tree containing node around it in O(logn).
+ * node is unlinked, *left and *right receive the trees of the nodes
+ * ordered before and after it, *lh and *rh their black heights.
+ */
+static void
+impl_split(struct _rb_impl *impl, struct rb_node *node,
+    struct rb_node **left, size_t *lh, struct rb_node **right, size_t *rh)
+{
+    struct rb_node *cur = node;
+    struct rb_node *parent = node->_parent;
+    struct rb_node *lt = node->_left;
+    struct rb_node *rt = node->_right;
+
+    // black height of cur, and of the children of cur
+    size_t height = node_bheight(node);
+    size_t child = height - (node->_color == _RB_BLACK);
+
+    size_t hl = impl_detach(impl, lt, child);
+    size_t hr = impl_detach(impl, rt, child);
+
+    while (!parent->_isnil)
+    {
+        struct rb_node *up = parent->_parent;
+        struct rb_node *sibling;
+        int black = parent->_color == _RB_BLACK;
+
+        if (cur == parent->_left)
+        {
+            sibling = parent->_right;
+            rt = impl_join(impl, rt, hr, parent,
+                sibling, impl_detach(impl, sibling, height), &hr);
+        }
+        else
+        {
+            sibling = parent->_left;
+            lt = impl_join(impl, sibling, impl_detach(impl, sibling, height),
+                parent, lt, hl, &hl);
+        }
+
+        height += black;
+        cur = parent;
+        parent = up;
+    }
+
+    *left = lt, *lh = hl;
+    *right = rt, *rh = hr;
+}
+
+/*
+ * Insert node right after hint (the head meaning before the leftmost)
+ * in O(1) when that keeps the order, as in a sorted sequence of
+ * inserts. Otherwise fall back to a search from the root.
+ */
+static struct rb_node *
+impl_insert_hint(struct rb_tree *rb,
+    struct rb_node *node, struct rb_node *hint, int *out)
+{
+    struct _rb_impl *impl = _RB_IMPL(rb);
+    struct rb_node *next = hint->_isnil ?
+        _RB_IMPL_LMST(impl) : node_next(impl, hint);
+
+    if ((hint->_isnil || !impl_comp(impl, node, hint)) &&
+        (next->_isnil || impl_comp(impl, node, next)))
+    {
+        if (!impl->_multi && !hint->_isnil && !impl_comp(impl, hint, node))
+        {
+            if (hint->_isdead)
+            {
+                impl_purge(rb, hint);
+
+                return rb_insert_node(rb, node, 0, out);
+            }
+
+            *out = 0;
+
+            return hint;
+        }
+
+        *out = 1;
+
+        if (hint->_isnil)
+        {
+            return impl_node_insert(rb, node, next, 1);
+        }
+        else if (hint->_right->_isnil)
+        {
+            return impl_node_insert(rb, node, hint, 0);
+        }
+        else
+        {
+            return impl_node_insert(rb, node, next, 1);
+        }
+    }
+
+    return rb_insert_node(rb, node, 0, out);
+}
+
+static void
+node_init(struct rb_node *node, struct rb_node *head)
+{
+    node->_parent = head;
+    node->_left = head;
+    node->_right = head;
+    node->_color = _RB_RED;
+    node->_isnil = 0;
+    node->_isdead = 0;
+    node->_chained = 0;
+}
+
+static void
+head_init(struct rb_node *head)
+{
+    head->_parent = head;
+    head->_left = head;
+    head->_right = head;
+    head->_color = _RB_BLACK;
+    head->_isnil = 1;
+    head->_isdead = 0;
+    head->_chained = 0;
+}
+
+// where impl_build_sub takes its nodes from
+struct _rb_build
+{
+    struct rb_node *        list;  // the next node, threaded through _right
+    struct rb_node *const * roots; // subtrees linked beforehand, or NULL
+    size_t                  level; // depth of the subtrees in roots
+    size_t                  red;   // depth of the red nodes
+};
+
+// the deepest level of a balanced tree of n nodes
+static size_t
+impl_build_red(size_t n)
+{
+    size_t red = 0;
+
+    while (n >> (red + 1))
+    {
+        ++red;
+    }
+
+    return red;
+}
+
+/*
+ * Link the next n nodes of the sorted list, threaded through _right,
+ * into a perfectly balanced subtree and advance the list past them.
+ * Every nil link of such a subtree lies at depth red or red + 1, so
+ * coloring the nodes at depth red red and all others black is a valid
+ * coloring. With roots, the subtrees at depth level are taken from it
+ * in order instead, and their nodes are not on the list.
+ */
+static struct rb_node *
+impl_build_sub(struct _rb_impl *impl, struct _rb_build *bd, size_t n, size_t depth)
+{
+    struct rb_node *head = _RB_IMPL_HEAD(impl);
+    struct rb_node *node, *left;
+
+    if (!n)
+    {
+        return head;
+    }
+    if (bd->roots && depth == bd->level)
+    {
+        return *bd->roots++;
+    }
+
+    left = impl_build_sub(impl, bd, (n - 1) / 2, depth + 1);
+
+    node = bd->list;
+    bd->list = node->_right;
+
+    node->_left = left;
+    node->_right = impl_build_sub(impl, bd, n / 2, depth + 1);
+    node->_color = depth == bd->red ? _RB_RED : _RB_BLACK;
+    node->_isnil = 0;
+
+    if (!left->_isnil)
+    {
+        left->_parent = node;
+    }
+    if (!node->_right->_isnil)
+    {
+        node->_right->_parent = node;
+    }
+
+    return node;
+}
+
+/*
+ * Replace the content of the tree with the n sorted nodes of the
+ * builder, in O(n). The size is not touched.
+ */
+static void
+impl_build_from(struct _rb_impl *impl, struct _rb_build *bd, size_t n)
+{
+    struct rb_node *head = _RB_IMPL_HEAD(impl);
+    struct rb_node *root;
+
+    bd->red = impl_build_red(n);
+    root = impl_build_sub(impl, bd, n, 0);
+
+    head_init(head);
+
+    if (!root->_isnil)
+    {
+        root->_parent = head;
+        root->_color = _RB_BLACK;
+
+        _RB_IMPL_ROOT(impl) = root;
+        _RB_IMPL_LMST(impl) = node_min(root);
+        _RB_IMPL_RMST(impl) = node_max(root);
+    }
+}
+
+// the same from the n sorted nodes of list, threaded through _right
+static void
+impl_build(struct _rb_impl *impl, struct rb_node *list, size_t n)
+{
+    struct _rb_build bd = { list, NULL, 0, 0 };
+
+    impl_build_from(impl, &bd, n);
+}
+
+/*
+ * The node range of subtree part at depth level of the balanced tree
+ * of n nodes, split as impl_build_sub does.
+ */
+static void
+impl_build_part(size_t n, size_t level, size_t part, size_t *lo, size_t *cnt)
+{
+    *lo = 0;
+    *cnt = n;
+
+    while (level--)
+    {
+        if (part >> level & 1)
+        {
+            *lo += (*cnt - 1) / 2 + 1;
+            *cnt /= 2;
+        }
+        else
+        {
+            *cnt = (*cnt - 1) / 2;
+        }
+    }
+}
+
+// thread an unlinked node onto a builder list
+static void
+impl_build_push(struct rb_node ***tail, struct rb_node *node)
+{
+    node->_isdead = 0;
+    node->_chained = 0;
+
+    **tail = node;
+    *tail = &node->_right;
+}
+
+struct rb_node *
+_rb_build(struct rb_tree *rb, struct rb_node **nodes, size_t n,
+    size_t level, size_t part, struct rb_node *const *roots)
+{
+    struct _rb_impl *impl = _RB_IMPL(rb);
+    struct _rb_build bd = { NULL, roots, level, impl_build_red(n) };
+    struct rb_node **tail = &bd.list;
+    size_t lo, cnt, i;
+
+#if defined _RB_DEBUG
+    assert(n && (!level || level < bd.red) && "subtrees may be empty");
+#endif
+
+    if (!roots)
+    {
+        impl_build_part(n, level, part, &lo, &cnt);
+
+        for (i = lo; i < lo + cnt; ++i)
+        {
+            impl_build_push(&tail, nodes[i]);
+        }
+
+        return impl_build_sub(impl, &bd, cnt, level);
+    }
+
+    // in order, one node above the subtrees lies between each two
+    for (part = 0; part + 1 < (size_t)1 << level; ++part)
+    {
+        impl_build_part(n, level, part, &lo, &cnt);
+        impl_build_push(&tail, nodes[lo + cnt]);
+    }
+
+    impl_relax_flush(impl, SIZE_MAX);
+    impl_cache_reset(impl->_cache);
+    impl_build_from(impl, &bd, n);
+
+    impl->_ndead = 0;
+    rb->size = n;
+
+    return _RB_IMPL_ROOT(impl);
+}
+
+static void
+impl_init(struct _rb_impl *impl, int multi, rb_compare_f comp, void *args)
+{
+    head_init(_RB_IMPL_HEAD(impl));
+
+    impl->_multi = multi;
+    impl->_comp = comp;
+    impl->_args = args;
+    impl->_lazy = 0;
+    impl->_ndead = 0;
+    impl->_kcomp = NULL;
+    impl->_skey = NULL;
+    impl->_pfx = 0;
+    impl->_chain = 0;
+    impl->_ktype = RB_KEY_CUSTOM;
+    impl->_koff = 0;
+    impl->_log = NULL;
+    impl->_nlog = 0;
+    impl->_clog = 0;
+    impl->_cache = NULL;
+
+#if defined _RB_STATS
+    {
+        struct rb_stats zero = { 0 };
+
+        impl->_stats = zero;
+    }
+#endif
+}
+
+struct rb_node *
+rb_lmst(const struct rb_tree *rb)
+{
+    return node_live_next(_RB_IMPL(rb), _RB_LMST(rb));
+}
+
+struct rb_node *
+rb_rmst(const struct rb_tree *rb)
+{
+    struct rb_node *node = node_live_prev(_RB_IMPL(rb), _RB_RMST(rb));
+
+    return node->_chained ? node_chain_last(node) : node;
+}
+
+struct rb_node *
+rb_head(const struct rb_tree *rb)
+{
+    return (struct rb_node *)_RB_HEAD(rb);
+}
+
+struct rb_node *
+rb_prev(const struct rb_node *node)
+{
+    if (node->_chained == _RB_CHAIN_DUP)
+    {
+        return node->_left;
+    }
+
+    const struct _rb_impl *impl = node_impl(node);
+
+    node = node_live_prev(impl, node_prev(impl, node));
+
+    return node->_chained ? node_chain_last(node) : (struct rb_node *)node;
+}
+
+struct rb_node *
+rb_next(const struct rb_node *node)
+{
+    if (node->_chained == _RB_CHAIN_DUP)
+    {
+        if (node->_right->_chained == _RB_CHAIN_DUP)
+        {
+            return node->_right;
+        }
+
+        node = node->_right;
+    }
+    else if (node->_chained && _RB_CNODE(node)->_dups)
+    {
+        return _RB_CNODE(node)->_dups;
+    }
+
+    const struct _rb_impl *impl = node_impl(node);
+
+    return node_live_next(impl, node_next(impl, node));
+}
+
+void
+rb_init(struct rb_tree *rb, int multi, rb_compare_f comp, void *args)
+{
+    impl_init(_RB_IMPL(rb), multi, comp, args);
+
+    rb->size = 0;
+}
+
+void
+rb_init_typed(struct rb_tree *rb, int multi, int key_type, ptrdiff_t key_offset)
+{
+    struct _rb_impl *impl = _RB_IMPL(rb);
+
+#if defined _RB_DEBUG
+    assert(key_type >= RB_KEY_I64 && key_type <= RB_KEY_STR && "not a built-in key type");
+#endif
+
+    impl_init(impl, multi, typed_comp, impl);
+
+    impl->_ktype = key_type;
+    impl->_koff = key_offset;
+    impl->_kcomp = typed_kcomp;
+    impl->_skey = key_type == RB_KEY_STR ? typed_skey : NULL;
+
+    rb->size = 0;
+}
+
+void
+rb_clear(struct rb_tree *rb)
+{
+    head_init(_RB_HEAD(rb));
+
+    rb->size = 0;
+    _RB_IMPL(rb)->_ndead = 0;
+    _RB_IMPL(rb)->_nlog = 0;
+
+    impl_cache_reset(_RB_IMPL(rb)->_cache);
+}
+
+struct rb_node *
+rb_insert(struct rb_tree *rb, struct rb_node *node, int *out)
+{
+#ifdef _RB_DEBUG
+    assert(out && "not a legal, writable address");
+#endif
+
+    node_init(node, _RB_HEAD(rb));
+
+    if (_RB_IMPL(rb)->_chain)
+    {
+        *out = 1;
+
+        return impl_chain_insert(rb, node);
+    }
+
+    return rb_insert_node(rb, node, 0, out);
+}
+
+void
+rb_insert_at(struct rb_tree *rb,
+    struct rb_node *node, struct rb_node *parent, int left)
+{
+#if defined _RB_DEBUG
+    assert(!_RB_IMPL(rb)->_chain && "not supported by chained trees");
+    assert((parent->_isnil ? _RB_ROOT(rb)->_isnil :
+        (left ? parent->_left : parent->_right)->_isnil) && "position is taken");
+#endif
+
+    node_init(node, _RB_HEAD(rb));
+    impl_node_insert(rb, node, parent, left);
+}
+
+struct rb_pair
+rb_eqrange(const struct rb_tree *rb, const struct rb_node *val)
+{
+    struct rb_pair pr = impl_eqrange(_RB_IMPL(rb), val);
+
+    pr.first = node_live_next(_RB_IMPL(rb), pr.first);
+    pr.second = node_live_next(_RB_IMPL(rb), pr.second);
+
+    return pr;
+}
+
+struct rb_node *
+rb_lbnd(const struct rb_tree *rb, const struct rb_node *val)
+{
+    return node_live_next(_RB_IMPL(rb), impl_lbnd(_RB_IMPL(rb), val));
+}
+
+struct rb_node *
+rb_ubnd(const struct rb_tree *rb, const struct rb_node *val)
+{
+    return node_live_next(_RB_IMPL(rb), impl_ubnd(_RB_IMPL(rb), val));
+}
+
+/*
+ * rb_find through the cache. A miss takes an empty slot of the window
+ * if any, or else evicts one in turn.
+ */
+static struct rb_node *
+impl_cache_find(const struct rb_tree *rb, const struct rb_node *val)
+{
+    const struct _rb_impl *impl = _RB_IMPL(rb);
+    struct rb_cache *cache = impl->_cache;
+    struct rb_cache_slot *slot, *victim = NULL;
+    struct rb_node *fr;
+
+    uint64_t hash = impl_cache_hash(impl, val);
+
+    for (size_t i = 0; i < _RB_CACHE_WAYS; ++i)
+    {
+        slot = &cache->_slots[(hash + i) & cache->_mask];
+
+        if (!slot->_node)
+        {
+            victim = victim ? victim : slot;
+        }
+        else if (slot->_hash == hash &&
+            !impl_comp(impl, val, slot->_node) && !impl_comp(impl, slot->_node, val))
+        {
+            ++cache->hits;
+
+            return slot->_node;
+        }
+    }
+
+    ++cache->misses;
+
+    fr = rb_lbnd(rb, val);
+
+    if (fr == rb_head(rb) || impl_comp(impl, val, fr))
+    {
+        return rb_head(rb);
+    }
+    if (!victim)
+    {
+        victim = &cache->_slots[(hash + cache->misses % _RB_CACHE_WAYS) & cache->_mask];
+    }
+
+    victim->_node = fr;
+    victim->_hash = hash;
+
+    return fr;
+}
+
+struct rb_node *
+rb_find(const struct rb_tree *rb, const struct rb_node *val)
+{
+    struct rb_node *fr;
+
+    if (_RB_IMPL(rb)->_cache)
+    {
+        return impl_cache_find(rb, val);
+    }
+
+    fr = rb_lbnd(rb, val);
+
+    return fr == rb_head(rb) || rb_comp(rb, val, fr) ?
+        rb_head(rb) : fr;
+}
+
+void
+rb_set_cache(struct rb_tree *rb, struct rb_cache *cache,
+    struct rb_cache_slot *slots, size_t cap, rb_hash_f hash)
+{
+    struct _rb_impl *impl = _RB_IMPL(rb);
+
+#if defined _RB_DEBUG
+    assert((!cache || (cap && !(cap & (cap - 1)))) && "capacity is not a power of two");
+    assert((!cache || hash || impl->_ktype) && "no hash function");
+#endif
+
+    if ((impl->_cache = cache))
+    {
+        cache->_slots = slots;
+        cache->_mask = cap - 1;
+        cache->_hash = hash ? hash : typed_hash;
+        cache->hits = 0;
+        cache->misses = 0;
+
+        impl_cache_reset(cache);
+    }
+}
+
+void
+rb_set_prefix(struct rb_tree *rb, int pfx)
+{
+#if defined _RB_DEBUG
+    assert(!rb->size && !_RB_IMPL(rb)->_ndead && "tree is not empty");
+    assert(!(pfx && _RB_IMPL(rb)->_chain) && "not supported by chained trees");
+#endif
+
+    _RB_IMPL(rb)->_pfx = pfx;
+}
+
+void
+rb_set_chain(struct rb_tree *rb, int chain)
+{
+#if defined _RB_DEBUG
+    assert(!rb->size && !_RB_IMPL(rb)->_ndead && "tree is not empty");
+    assert(!chain || (_RB_IMPL(rb)->_multi && !_RB_IMPL(rb)->_pfx &&
+        !_RB_IMPL(rb)->_lazy && "chained tree must be multi, without prefix or lazy erase"));
+#endif
+
+    _RB_IMPL(rb)->_chain = chain;
+}
+
+uint64_t
+rb_prefix_str(const void *str, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)str;
+    uint64_t pfx = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(pfx); ++i)
+    {
+        pfx = pfx << 8 | (i < len ? s[i] : 0);
+    }
+
+    return pfx;
+}
+
+void
+rb_set_keycomp(struct rb_tree *rb, rb_keycomp_f kcomp)
+{
+    _RB_IMPL(rb)->_kcomp = kcomp;
+}
+
+struct rb_pair
+rb_eqrange_key(const struct rb_tree *rb, const void *key)
+{
+    struct rb_pair pr = impl_eqrange_key(_RB_IMPL(rb), key);
+
+    pr.first = node_live_next(_RB_IMPL(rb), pr.first);
+    pr.second = node_live_next(_RB_IMPL(rb), pr.second);
+
+    return pr;
+}
+
+struct rb_node *
+rb_lbnd_key(const struct rb_tree *rb, const void *key)
+{
+    return node_live_next(_RB_IMPL(rb), impl_lbnd_key(_RB_IMPL(rb), key));
+}
+
+struct rb_node *
+rb_ubnd_key(const struct rb_tree *rb, const void *key)
+{
+    return node_live_next(_RB_IMPL(rb), impl_ubnd_key(_RB_IMPL(rb), key));
+}
+
+struct rb_node *
+rb_find_key(const struct rb_tree *rb, const void *key)
+{
+    struct rb_node *fr = rb_lbnd_key(rb, key);
+
+    return fr == rb_head(rb) || impl_kcomp(_RB_IMPL(rb), fr, key) ?
+        rb_head(rb) : fr;
+}
+
+void
+rb_set_strkey(struct rb_tree *rb, rb_strkey_f skey)
+{
+    _RB_IMPL(rb)->_skey = skey;
+}
+
+struct rb_node *
+rb_lbnd_str(const struct rb_tree *rb, const void *key, size_t len)
+{
+    return node_live_next(_RB_IMPL(rb), impl_bnd_str(_RB_IMPL(rb), key, len, 0));
+}
+
+struct rb_node *
+rb_ubnd_str(const struct rb_tree *rb, const void *key, size_t len)
+{
+    return node_live_next(_RB_IMPL(rb), impl_bnd_str(_RB_IMPL(rb), key, len, 1));
+}
+
+struct rb_node *
+rb_find_str(const struct rb_tree *rb, const void *key, size_t len)
+{
+    struct rb_node *fr = rb_lbnd_str(rb, key, len);
+    size_t lcp = 0;
+
+    return fr == rb_head(rb) || impl_scomp(_RB_IMPL(rb), fr, key, len, &lcp) ?
+        rb_head(rb) : fr;
+}
+
+struct rb_node *
+rb_lbnd_from(const struct rb_tree *rb,
+    const struct rb_node *finger, const struct rb_node *val)
+{
+    const struct _rb_impl *impl = _RB_IMPL(rb);
+    struct rb_node *bound;
+    struct rb_node *sub;
+
+    if (finger->_chained == _RB_CHAIN_DUP)
+    {
+        finger = node_chain_key(finger);
+    }
+
+    sub = impl_climb(impl, finger, val, 0, &bound);
+
+    return node_live_next(impl, impl_lbnd_from(impl, sub, bound, val));
+}
+
+struct rb_node *
+rb_ubnd_from(const struct rb_tree *rb,
+    const struct rb_node *finger, const struct rb_node *val)
+{
+    const struct _rb_impl *impl = _RB_IMPL(rb);
+    struct rb_node *bound;
+    struct rb_node *sub;
+
+    if (finger->_chained == _RB_CHAIN_DUP)
+    {
+        finger = node_chain_key(finger);
+    }
+
+    sub = impl_climb(impl, finger, val, 1, &bound);
+
+    return node_live_next(impl, impl_ubnd_from(impl, sub, bound, val));
+}
+
+struct rb_node *
+rb_find_from(const struct rb_tree *rb,
+    const struct rb_node *finger, const struct rb_node *val)
+{
+    struct rb_node *fr = rb_lbnd_from(rb, finger, val);
+
+    return fr == rb_head(rb) || rb_comp(rb, val, fr) ?
+        rb_head(rb) : fr;
+}
+
+struct rb_node *
+rb_erase(struct rb_tree *rb, struct rb_node *node)
+{
+    struct _rb_impl *impl = _RB_IMPL(rb);
+
+#if defined _RB_DEBUG
+    assert(!node->_isdead && "erase operation on a tombstone");
+#endif
+
+    if (impl->_chain)
+    {
+        return impl_chain_erase(rb, node);
+    }
+    if (impl->_lazy)
+    {
+        if (impl->_cache)
+        {
+            impl_cache_drop(impl, node, 0);
+        }
+
+        node->_isdead = 1;
+        ++impl->_ndead;
+        --rb->size;
+
+        return node_live_next(impl, node_next(impl, node));
+    }
+
+    return node_live_next(impl, rb_erase_node(rb, node));
+}
+
+struct rb_node *
+rb_erase_range(struct rb_tree *rb,
+    struct rb_node *begin, struct rb_node *end)
+{
+    if (begin == rb_lmst(rb) && end == rb_head(rb))
+    {
+        rb_clear(rb);
+
+        return rb_lmst(rb);
+    }
+    else
+    {
+        while (begin != end)
+        {
+            begin = rb_erase(rb, begin);
+        }
+
+        return begin;
+    }
+}
+
+size_t
+rb_erase_rgcnt(struct rb_tree *rb,
+    struct rb_node *begin, struct rb_node *end)
+{
+    size_t dist = 0;
+
+    if (begin == rb_lmst(rb) && end == rb_head(rb))
+    {
+        dist = rb->size;
+
+        rb_clear(rb);
+    }
+    else
+    {
+        while (begin != end)
+        {
+            begin = rb_erase(rb, begin);
+            ++dist;
+        }
+    }
+
+    return dist;
+}
+
+void
+rb_set_lazy(struct rb_tree *rb, int lazy)
+{
+#if defined _RB_DEBUG
+    assert(!(lazy && _RB_IMPL(rb)->_chain) && "not supported by chained trees");
+#endif
+
+    _RB_IMPL(rb)->_lazy = lazy;
+}
+
+size_t
+rb_ndead(const struct rb_tree *rb)
+{
+    return _RB_IMPL(rb)->_ndead;
+}
+
+void
+rb_set_relaxed(struct rb_tree *rb, struct rb_node **log, size_t cap)
+{
+    struct _rb_impl *impl = _RB_IMPL(rb);
+
+    impl_relax_flush(impl, SIZE_MAX);
+
+    impl->_log = cap ? log : NULL;
+    impl->_clog = cap;
+}
+
+size_t
+rb_rebalance(struct rb_tree *rb, size_t budget)
+{
+    return impl_relax_flush(_RB_IMPL(rb), budget);
+}
+
+size_t
+rb_compact(struct rb_tree *rb, struct rb_node **list)
+{
+// rebuild when at least 1 / _RB_REBUILD_SHARE of the nodes are dead
+#define _RB_REBUILD_SHARE 8
+
+    struct _rb_impl *impl = _RB_IMPL(rb);
+    struct rb_node *node, *prev;
+
+    size_t dead = impl->_ndead;
+
+    *list = NULL;
+
+    if (!dead)
+    {
+        return 0;
+    }
+
+    impl_relax_flush(impl, SIZE_MAX);
+
+    if (dead * _RB_REBUILD_SHARE >= rb->size + dead)
+    {
+        struct rb_node *live = NULL;
+
+        for (node = _RB_IMPL_RMST(impl); !node->_isnil; node = prev)
+        {
+            prev = node_prev(impl, node);
+
+            if (node->_isdead)
+            {
+                node->_right = *list;
+                *list = node;
+            }
+            else
+            {
+                node->_right = live;
+                live = node;
+            }
+        }
+
+        impl_build(impl, live, rb->size);
+    }
+    else
+    {
+        struct rb_node **tail = list;
+
+        for (node = _RB_IMPL_LMST(impl); !node->_isnil; )
+        {
+            if (node->_isdead)
+            {
+                prev = node;
+                node = rb_erase_node(rb, node);
+                ++rb->size;
+
+                *tail = prev;
+                tail = &prev->_right;
+            }
+            else
+            {
+                node = node_next(impl, node);
+            }
+        }
+
+        *tail = NULL;
+    }
+
+    impl->_ndead = 0;
+
+    return dead;
+
+#undef _RB_REBUILD_SHARE
+}
+
+struct rb_node *
+rb_update(struct rb_tree *rb, struct rb_node *node, int *out)
+{
+    struct _rb_impl *impl = _RB_IMPL(rb);
+    struct rb_node *prev = node_prev(impl, node);
+    struct rb_node *next = node_next(impl, node);
+    struct rb_node *finger, *bound;
+
+#if defined _RB_DEBUG
+    assert(out && "not a legal, writable address");
+    assert(!node->_isdead && "update operation on a tombstone");
+    assert(!impl->_chain && "not supported by chained trees");
+#endif
+
+    *out = 1;
+
+    // the key has changed, so the slots of the old one are unknown
+    impl_cache_evict(impl->_cache, node);
+
+    if (impl->_multi ?
+        (prev->_isnil || !impl_comp(impl, node, prev)) &&
+        (next->_isnil || !impl_comp(impl, next, node)) :
+        (prev->_isnil || impl_comp(impl, prev, node)) &&
+        (next->_isnil || impl_comp(impl, node, next)))
+    {
+        return node;
+    }
+
+    // search again from the old neighbour on the side node moves to
+    finger = !next->_isnil && !impl_comp(impl, node, next) ? next : prev;
+
+    rb_erase_node(rb, node);
+    node_init(node, _RB_HEAD(rb));
+
+    return impl_insert_from(rb, node,
+        impl_climb(impl, finger, node, 1, &bound), 0, out);
+}
+
+size_t
+rb_merge(struct rb_tree *dst, struct rb_tree *src)
+{
+// use hinted insertion when src is this many times smaller than dst
+#define _RB_MERGE_RATIO 16
+
+    struct _rb_impl *impl = _RB_IMPL(dst);
+    struct rb_node *head = _RB_HEAD(dst);
+    struct rb_node *from = NULL, *into = NULL, *left = NULL;
+    struct rb_node *node, *prev;
+    struct rb_node **tail;
+
+    size_t nfrom = src->size, ninto = dst->size, nleft = 0;
+
+#if defined _RB_DEBUG
+    assert(!_RB_IMPL(dst)->_ndead && !_RB_IMPL(src)->_ndead && "compact before merge");
+    assert(!_RB_IMPL(dst)->_chain && !_RB_IMPL(src)->_chain && "not supported by chained trees");
+#endif
+
+    if (dst == src || !nfrom)
+    {
+        return 0;
+    }
+
+    impl_relax_flush(impl, SIZE_MAX);
+    impl_relax_flush(_RB_IMPL(src), SIZE_MAX);
+    impl_cache_reset(impl->_cache);
+    impl_cache_reset(_RB_IMPL(src)->_cache);
+
+    for (node = _RB_RMST(src); !node->_isnil; node = prev)
+    {
+        prev = node_prev(_RB_IMPL(src), node);
+        node->_right = from;
+        from = node;
+    }
+
+    rb_clear(src);
+
+    if (nfrom * _RB_MERGE_RATIO < ninto)
+    {
+        struct rb_node *hint = head;
+        int out;
+
+        for (tail = &left; from; from = prev)
+        {
+            prev = from->_right;
+            node_init(from, head);
+            node = impl_insert_hint(dst, from, hint, &out);
+
+            if (out)
+            {
+                hint = node;
+            }
+            else
+            {
+                *tail = from;
+                tail = &from->_right;
+                ++nleft;
+            }
+        }
+
+        *tail = NULL;
+    }
+    else
+    {
+        struct rb_node *merged = NULL, *last = NULL;
+        struct rb_node **ltail = &left;
+
+        for (node = _RB_RMST(dst); !node->_isnil; node = prev)
+        {
+            prev = node_prev(impl, node);
+            node->_right = into;
+            into = node;
+        }
+
+        // merge stably, src nodes go after their equivalents in dst
+        for (tail = &merged; from || into; )
+        {
+            if (into && (!from || !impl_comp(impl, from, into)))
+            {
+                node = into;
+                into = into->_right;
+            }
+            else
+            {
+                node = from;
+                from = from->_right;
+
+                if (!impl->_multi && last && !impl_comp(impl, last, node))
+                {
+                    *ltail = node;
+                    ltail = &node->_right;
+                    ++nleft;
+
+                    continue;
+                }
+            }
+
+            *tail = last = node;
+            tail = &node->_right;
+        }
+
+        *tail = NULL;
+        *ltail = NULL;
+
+        impl_build(impl, merged, ninto + nfrom - nleft);
+        dst->size = ninto + nfrom - nleft;
+    }
+
+    impl_build(_RB_IMPL(src), left, nleft);
+    src->size = nleft;
+
+    return nfrom - nleft;
+
+#undef _RB_MERGE_RATIO
+}
+
+size_t
+rb_extract_range(struct rb_tree *rb,
+    struct rb_node *begin, struct rb_node *end, struct rb_node **list)
+{
+    struct _rb_impl *impl = _RB_IMPL(rb);
+    struct rb_node *head = _RB_IMPL_HEAD(impl);
+    struct rb_node *root = head;
+    struct rb_node *mid;
+    struct rb_node *node, *prev;
+
+    size_t count = 0, dead = 0;
+    int whole = begin == _RB_IMPL_LMST(impl) && end == head;
+
+#if defined _RB_DEBUG
+    assert(!impl->_chain && "not supported by chained trees");
+#endif
+
+    *list = NULL;
+
+    if (begin == end)
+    {
+        return 0;
+    }
+
+    impl_relax_flush(impl, SIZE_MAX);
+    impl_cache_reset(impl->_cache);
+
+    if (whole)
+    {
+        mid = _RB_IMPL_ROOT(impl);
+    }
+    else
+    {
+        struct rb_node *left, *right;
+        size_t lh, mh, rh;
+
+        if (end == head)
+        {
+            impl_split(impl, begin, &root, &lh, &mid, &mh);
+        }
+        else
+        {
+            impl_split(impl, end, &left, &lh, &right, &rh);
+            impl_split(impl, begin, &left, &lh, &mid, &mh);
+
+            root = impl_join(impl, left, lh, end, right, rh, &mh);
+        }
+    }
+
+    // thread the nodes backwards, node_prev never reads _right of
+    // the nodes that are already threaded
+    for (node = mid->_isnil ? mid : node_max(mid); !node->_isnil; node = prev)
+    {
+        prev = node_prev(impl, node);
+        node->_right = *list;
+        *list = node;
+        ++count;
+        dead += node->_isdead;
+    }
+
+    if (whole)
+    {
+        rb_clear(rb);
+
+        return count;
+    }
+
+    begin->_right = *list;
+    *list = begin;
+    ++count;
+    dead += begin->_isdead;
+
+    _RB_IMPL_ROOT(impl) = root;
+    root->_parent = head;
+    _RB_IMPL_LMST(impl) = root->_isnil ? head : node_min(root);
+    _RB_IMPL_RMST(impl) = root->_isnil ? head : node_max(root);
+
+    rb->size -= count - dead;
+    impl->_ndead -= dead;
+
+    return count;
+}
+
+size_t
+rb_erase_val(struct rb_tree *rb, const struct rb_node *val)
+{
+    struct rb_pair pr = rb_eqrange(rb, val);
+
+    if (_RB_IMPL(rb)->_chain)
+    {
+        return impl_chain_erase_all(rb, pr.first, pr.second);
+    }
+
+    return rb_erase_rgcnt(rb, pr.first, pr.second);
+}
+
+size_t
+rb_erase_key(struct rb_tree *rb, const void *key)
+{
+    struct rb_pair pr = rb_eqrange_key(rb, key);
+
+    if (_RB_IMPL(rb)->_chain)
+    {
+        return impl_chain_erase_all(rb, pr.first, pr.second);
+    }
+
+    return rb_erase_rgcnt(rb, pr.first, pr.second);
+}
+
+size_t
+rb_dist(const struct rb_tree *rb,
+    const struct rb_node *begin, const struct rb_node *end)
+{
+    size_t dist = 0;
+
+    if (begin == rb_lmst(rb) && end == rb_head(rb))
+    {
+        dist = rb->size;
+    }
+    else
     {
         while (begin != end)
         {
-            begin = node_next(begin);
+            begin = _RB_IMPL(rb)->_chain ? rb_next(begin) :
+                node_live_next(_RB_IMPL(rb), node_next(_RB_IMPL(rb), begin));
             ++dist;
         }
     }
@@ -828,5 +2958,410 @@ rb_vcnt(const struct rb_tree *rb, const struct rb_node *val)
 {
     struct rb_pair pr = rb_eqrange(rb, val);
 
+    if (_RB_IMPL(rb)->_chain)
+    {
+        return pr.first == pr.second ? 0 : _RB_CNODE(pr.first)->_count;
+    }
+
+    return rb_dist(rb, pr.first, pr.second);
+}
+
+size_t
+rb_vcnt_key(const struct rb_tree *rb, const void *key)
+{
+    struct rb_pair pr = rb_eqrange_key(rb, key);
+
+    if (_RB_IMPL(rb)->_chain)
+    {
+        return pr.first == pr.second ? 0 : _RB_CNODE(pr.first)->_count;
+    }
+
     return rb_dist(rb, pr.first, pr.second);
 }
+
+void
+rb_relocate(struct rb_tree *rb, struct rb_node *old, struct rb_node *node)
+{
+    struct _rb_impl *impl = _RB_IMPL(rb);
+
+    if (old == node)
+    {
+        return;
+    }
+
+    impl_relax_flush(impl, SIZE_MAX);
+
+    if (impl->_cache)
+    {
+        struct rb_cache *cache = impl->_cache;
+        uint64_t hash = impl_cache_hash(impl, old);
+
+        for (size_t i = 0; i < _RB_CACHE_WAYS; ++i)
+        {
+            if (cache->_slots[(hash + i) & cache->_mask]._node == old)
+            {
+                cache->_slots[(hash + i) & cache->_mask]._node = node;
+            }
+        }
+    }
+
+    if (impl->_chain)
+    {
+        *_RB_CNODE(node) = *_RB_CNODE(old);
+    }
+    else
+    {
+        *node = *old;
+    }
+
+    if (node->_chained == _RB_CHAIN_DUP)
+    {
+        struct rb_node *prev = node->_left, *next = node->_right;
+
+        if (prev->_chained == _RB_CHAIN_KEY)
+        {
+            _RB_CNODE(prev)->_dups = node;
+        }
+        else
+        {
+            prev->_right = node;
+        }
+        if (next->_chained == _RB_CHAIN_KEY)
+        {
+            _RB_CNODE(next)->_dups->_parent = node;
+        }
+        else
+        {
+            next->_left = node;
+        }
+
+        return;
+    }
+
+    if (_RB_IMPL_ROOT(impl) == old)
+    {
+        _RB_IMPL_ROOT(impl) = node;
+    }
+    else if (node->_parent->_left == old)
+    {
+        node->_parent->_left = node;
+    }
+    else
+    {
+        node->_parent->_right = node;
+    }
+    if (!node->_left->_isnil)
+    {
+        node->_left->_parent = node;
+    }
+    if (!node->_right->_isnil)
+    {
+        node->_right->_parent = node;
+    }
+    if (_RB_IMPL_LMST(impl) == old)
+    {
+        _RB_IMPL_LMST(impl) = node;
+    }
+    if (_RB_IMPL_RMST(impl) == old)
+    {
+        _RB_IMPL_RMST(impl) = node;
+    }
+    if (node->_chained && _RB_CNODE(node)->_dups)
+    {
+        _RB_CNODE(node)->_dups->_left = node;
+        _RB_CNODE(node)->_dups->_parent->_right = node;
+    }
+}
+
+/*
+ * First node at depth d below node, from left to right, or NULL.
+ */
+static struct rb_node *
+node_level_first(struct rb_node *node, size_t d)
+{
+    struct rb_node *found;
+
+    if (!d)
+    {
+        return node;
+    }
+    if (!node->_left->_isnil && (found = node_level_first(node->_left, d - 1)))
+    {
+        return found;
+    }
+    if (!node->_right->_isnil)
+    {
+        return node_level_first(node->_right, d - 1);
+    }
+
+    return NULL;
+}
+
+/*
+ * Next node after cur at the same depth below root, or NULL.
+ */
+static struct rb_node *
+node_level_next(const struct rb_node *root, struct rb_node *cur)
+{
+    struct rb_node *found;
+    size_t up = 0;
+
+    for (; cur != root; cur = cur->_parent, ++up)
+    {
+        if (cur == cur->_parent->_left && !cur->_parent->_right->_isnil &&
+            (found = node_level_first(cur->_parent->_right, up)))
+        {
+            return found;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * vEB order of a subtree of nominal height h: its top h / 2 levels,
+ * then each subtree below them from left to right, all recursively.
+ * Push frames down to the first single node.
+ */
+static void
+defrag_push(struct rb_defrag_state *df, struct rb_node *root, size_t height)
+{
+    for (;;)
+    {
+        struct _rb_veb_frame *frame = &df->_stack[df->_depth++];
+
+        frame->_root = root;
+        frame->_cur = NULL;
+        frame->_height = height;
+
+        if (height == 1)
+        {
+            break;
+        }
+
+        height /= 2;
+    }
+
+    df->_next = root;
+}
+
+// pop the single node just moved, and find the next one
+static void
+defrag_pop(struct rb_defrag_state *df)
+{
+    --df->_depth;
+
+    while (df->_depth)
+    {
+        struct _rb_veb_frame *frame = &df->_stack[df->_depth - 1];
+        size_t top = frame->_height / 2;
+
+        frame->_cur = frame->_cur ? node_level_next(frame->_root, frame->_cur) :
+            node_level_first(frame->_root, top);
+
+        if (frame->_cur)
+        {
+            defrag_push(df, frame->_cur, frame->_height - top);
+
+            return;
+        }
+
+        --df->_depth;
+    }
+
+    df->_next = NULL;
+}
+
+void
+rb_defrag_init(struct rb_tree *rb, struct rb_defrag_state *df, int order,
+    rb_alloc_f alloc, rb_free_f release, void *args)
+{
+    const struct rb_node *root;
+
+    // the nodes move, so the log must not keep any of them
+    impl_relax_flush(_RB_IMPL(rb), SIZE_MAX);
+
+    root = _RB_ROOT(rb);
+
+    df->_alloc = alloc;
+    df->_free = release;
+    df->_args = args;
+    df->_order = order;
+    df->_next = NULL;
+    df->_dup = NULL;
+    df->_depth = 0;
+
+    if (root->_isnil)
+    {
+        return;
+    }
+    if (order == RB_DEFRAG_VEB)
+    {
+        // a red-black tree is at most twice as high as its black height
+        defrag_push(df, (struct rb_node *)root, 2 * node_bheight(root));
+    }
+    else
+    {
+        df->_next = _RB_LMST(rb);
+    }
+}
+
+int
+rb_defrag(struct rb_tree *rb, struct rb_defrag_state *df, size_t budget)
+{
+    struct _rb_impl *impl = _RB_IMPL(rb);
+    struct rb_node *old, *node;
+    size_t i;
+
+    for (; budget && (old = df->_dup ? df->_dup : df->_next); --budget)
+    {
+        if (!(node = df->_alloc(old, df->_args)))
+        {
+            return -1;
+        }
+
+        rb_relocate(rb, old, node);
+
+        if (df->_order != RB_DEFRAG_VEB)
+        {
+            df->_next = impl->_chain ? rb_next(node) : node_next(impl, node);
+            df->_next = df->_next->_isnil ? NULL : df->_next;
+        }
+        else if (df->_dup)
+        {
+            // the rest of a chain, right after its key
+            df->_dup = node->_right->_chained == _RB_CHAIN_DUP ? node->_right : NULL;
+        }
+        else
+        {
+            for (i = 0; i < df->_depth; ++i)
+            {
+                if (df->_stack[i]._root == old)
+                {
+                    df->_stack[i]._root = node;
+                }
+                if (df->_stack[i]._cur == old)
+                {
+                    df->_stack[i]._cur = node;
+                }
+            }
+
+            df->_dup = node->_chained ? _RB_CNODE(node)->_dups : NULL;
+
+            defrag_pop(df);
+        }
+
+        df->_free(old, df->_args);
+    }
+
+    return df->_dup || df->_next;
+}
+
+void
+rb_analyze(const struct rb_tree *rb, struct rb_report *report)
+{
+#define IS_BLACK(node) ((node)->_color == _RB_BLACK)
+
+    const struct rb_node *node = _RB_ROOT(rb);
+    const struct rb_node *prev = NULL;
+    const struct rb_node *parent;
+
+    size_t depth = 0, blacks = IS_BLACK(node), total = 0;
+    size_t count = 0, lines = 0, pages = 0;
+
+    memset(report, 0, sizeof(*report));
+
+    if (node->_isnil)
+    {
+        return;
+    }
+
+    for (;;)
+    {
+        for (; !node->_left->_isnil; ++depth)
+        {
+            node = node->_left;
+            blacks += IS_BLACK(node);
+        }
+
+        for (;;)
+        {
+            ++report->depth[depth < RB_DEPTH_MAX ? depth : RB_DEPTH_MAX - 1];
+            total += depth + 1;
+            report->ndead += node->_isdead;
+            ++count;
+
+            if (report->height < depth + 1)
+            {
+                report->height = depth + 1;
+            }
+            if (!IS_BLACK(node))
+            {
+                ++report->nred;
+            }
+            if (node->_left->_isnil || node->_right->_isnil)
+            {
+                report->bheight = blacks;
+            }
+            if (prev)
+            {
+                lines += (uintptr_t)prev / RB_CACHE_LINE ==
+                    (uintptr_t)node / RB_CACHE_LINE;
+                pages += (uintptr_t)prev / RB_PAGE_SIZE ==
+                    (uintptr_t)node / RB_PAGE_SIZE;
+            }
+            prev = node;
+
+            if (!node->_right->_isnil)
+            {
+                node = node->_right;
+                blacks += IS_BLACK(node);
+                ++depth;
+
+                break;
+            }
+
+            while (!(parent = node->_parent)->_isnil && node == parent->_right)
+            {
+                blacks -= IS_BLACK(node);
+                node = parent;
+                --depth;
+            }
+            if (parent->_isnil)
+            {
+                goto done;
+            }
+
+            blacks -= IS_BLACK(node);
+            node = parent;
+            --depth;
+        }
+    }
+
+done:
+    report->avgpath = (double)total / count;
+
+    if (count > 1)
+    {
+        report->linescore = (double)lines / (count - 1);
+        report->pagescore = (double)pages / (count - 1);
+    }
+
+#undef IS_BLACK
+}
+
+#if defined _RB_STATS
+void
+rb_get_stats(const struct rb_tree *rb, struct rb_stats *stats)
+{
+    *stats = _RB_IMPL(rb)->_stats;
+}
+
+void
+rb_reset_stats(struct rb_tree *rb)
+{
+    struct rb_stats zero = { 0 };
+
+    _RB_IMPL(rb)->_stats = zero;
+}
+#endif
@@ -24,6 +24,7 @@
 #define __RBTREE__
 
 #include <stddef.h>
+#include <stdint.h>
 
 /*
  * The _RB_DEBUG flag will enable extra operation checks, while
@@ -48,8 +49,51 @@ struct rb_node
     struct rb_node *_right;   // ptr to right child
     char            _color;   // the color
     char            _isnil;   // there are no NULL ptr, only nil node
+    char            _isdead;  // erased in lazy mode, but still linked
+    char            _chained; // key or duplicate of a chained tree
 };
 
+/*
+ * A node carrying an order-preserving 64-bit key prefix, for trees set
+ * with rb_set_prefix. Nodes whose prefixes differ are ordered by them
+ * alone, so most search steps stay within the node instead of calling
+ * the compare function, which is only used to break ties.
+ *
+ * prefix must be set before the node is inserted or used as a search
+ * value, and kept in sync with the key, e.g. before rb_update.
+ */
+struct rb_pnode
+{
+    struct rb_node  _node;  // the node itself, must come first
+    uint64_t        prefix; // public member, key prefix
+};
+
+/*
+ * A node of a chained tree, see rb_set_chain. Only the first node of
+ * each key is linked in the tree, with the count of its copies. The
+ * later ones hang off it on a ring threaded through _left/_right, in
+ * insertion order.
+ */
+struct rb_cnode
+{
+    struct rb_node  _node;  // the node itself, must come first
+    struct rb_node *_dups;  // first duplicate on the chain, or NULL
+    size_t          _count; // copies of the key, the node included
+};
+
+/*
+ * Built-in key types of rb_init_typed.
+ */
+#define RB_KEY_CUSTOM 0 // the compare function of rb_init
+#define RB_KEY_I64    1 // int64_t
+#define RB_KEY_U64    2 // uint64_t
+#define RB_KEY_DOUBLE 3 // double, without NaN
+#define RB_KEY_STR    4 // const char *, NUL-terminated, ordered as strcmp
+
+// offset of the key member from the node member of a struct type
+#define RB_KEY_OFFSET(type, node, key) \
+    ((ptrdiff_t)offsetof(type, key) - (ptrdiff_t)offsetof(type, node))
+
 #if !defined RB_CONV
 // the container access macro
 #define RB_CONV(type, ptr, name) \
@@ -64,12 +108,95 @@ struct rb_node
  */
 typedef int(*rb_compare_f)(const struct rb_node *, const struct rb_node *, void *);
 
+/*
+ * Three-way comparison of a node against a bare search key, for the
+ * rb_*_key lookups: negative if the node orders before the key, zero
+ * if equivalent, positive if after. It must agree with the compare
+ * function, and receives the same extra argument.
+ */
+typedef int(*rb_keycomp_f)(const struct rb_node *, const void *, void *);
+
+/*
+ * String key accessor, for the rb_*_str lookups: returns the key bytes
+ * of a node and stores their length in *len. The tree must be ordered
+ * by those bytes as memcmp does, a proper prefix coming first.
+ */
+typedef const void *(*rb_strkey_f)(const struct rb_node *, size_t *, void *);
+
+/*
+ * Key hash, for the lookup cache of rb_set_cache: equivalent nodes must
+ * hash the same. It receives the same extra argument as the compare
+ * function.
+ */
+typedef uint64_t(*rb_hash_f)(const struct rb_node *, void *);
+
+struct rb_cache_slot
+{
+    struct rb_node *_node; // cached node, or NULL
+    uint64_t        _hash; // hash of its key
+};
+
+/*
+ * Lookup cache of a tree, see rb_set_cache. The slots are supplied by
+ * the caller, and the counters can be read or reset at any time.
+ */
+struct rb_cache
+{
+    struct rb_cache_slot *_slots; // the table
+    size_t                _mask;  // number of slots - 1
+    rb_hash_f             _hash;  // key hash
+    size_t                hits;   // public member, lookups answered by the cache
+    size_t                misses; // public member, lookups that searched the tree
+};
+
+/*
+ * The _RB_STATS flag makes every tree count the work done by its
+ * operations, which can be read back through rb_get_stats. It changes
+ * the layout of rb_tree, so it must be defined for every translation
+ * unit that includes this header. Without it, the counters and the
+ * functions below do not exist at all.
+ *
+ * The counters are bumped with relaxed atomic adds, so concurrent
+ * lookups on the same tree do not race on them. rb_get_stats and
+ * rb_reset_stats must not run concurrently with other operations.
+ * rb_prev and rb_next take a node only, so they climb to the head to
+ * find the tree to count in, which makes them O(log n) in this mode.
+ */
+#if defined _RB_STATS
+struct rb_stats
+{
+    size_t comps;    // comparator calls
+    size_t rotls;    // left rotations
+    size_t rotrs;    // right rotations
+    size_t insfix;   // insert fixup-loop iterations
+    size_t erasefix; // erase fixup-loop iterations
+    size_t descents; // searches from the root
+    size_t depth;    // nodes visited by those searches
+    size_t climbs;   // parent climbs in prev/next
+};
+#endif
+
 struct _rb_impl
 {
-    struct rb_node _head;  // head node
-    rb_compare_f   _comp;  // user's compare function
-    void *         _args;  // user's extra argument
-    int            _multi; // multi or not
+    struct rb_node  _head;  // head node
+    rb_compare_f    _comp;  // user's compare function
+    void *          _args;  // user's extra argument
+    int             _multi; // multi or not
+    int             _lazy;  // lazy erase or not
+    size_t          _ndead; // tombstones left by lazy erase
+    rb_keycomp_f    _kcomp; // user's node vs key compare function
+    rb_strkey_f     _skey;  // user's string key accessor
+    int             _pfx;   // nodes are rb_pnode or not
+    int             _chain; // nodes are rb_cnode or not
+    int             _ktype; // built-in key type, or RB_KEY_CUSTOM
+    ptrdiff_t       _koff;  // offset of the built-in key from the node
+    struct rb_node **_log;  // red-red violations left by relaxed inserts
+    size_t          _nlog;  // number of logged violations
+    size_t          _clog;  // capacity of the log, see rb_set_relaxed
+    struct rb_cache *_cache; // lookup cache, or NULL
+#if defined _RB_STATS
+    struct rb_stats _stats; // operation counters
+#endif
 };
 
 struct rb_pair
@@ -77,12 +204,87 @@ struct rb_pair
     struct rb_node *first, *second;
 };
 
+#if !defined RB_DEPTH_MAX
+// depth histogram size of rb_report, deeper nodes share the last slot
+#define RB_DEPTH_MAX 128
+#endif
+
+#if !defined RB_CACHE_LINE
+#define RB_CACHE_LINE 64
+#endif
+
+#if !defined RB_PAGE_SIZE
+#define RB_PAGE_SIZE 4096
+#endif
+
+/*
+ * Shape and memory-locality report of a tree, see rb_analyze.
+ * Depths count links from the root, so the root is at depth 0.
+ */
+struct rb_report
+{
+    size_t height;              // nodes on the longest root-to-leaf path
+    size_t bheight;             // black nodes on a root-to-leaf path
+    size_t nred;                // number of red nodes
+    size_t depth[RB_DEPTH_MAX]; // number of nodes at each depth
+    size_t ndead;               // tombstones still linked
+    double avgpath;             // average nodes visited to find a node
+    double linescore;           // in-order neighbours sharing a cache line
+    double pagescore;           // in-order neighbours sharing a page
+};
+
+/*
+ * Allocator callbacks of rb_defrag. The first one returns new storage
+ * holding a copy of the payload of the node, or NULL on failure. The
+ * second one releases the node, which is no longer linked. Both get
+ * the extra argument of rb_defrag_init.
+ */
+typedef struct rb_node *(*rb_alloc_f)(const struct rb_node *, void *);
+typedef void(*rb_free_f)(struct rb_node *, void *);
+
+// defragment in order, for scans
+#define RB_DEFRAG_INORDER 0
+// defragment in van Emde Boas order, for searches
+#define RB_DEFRAG_VEB     1
+
+#if !defined RB_DEFRAG_STACK
+// vEB recursion frames, enough for any tree of 64-bit size
+#define RB_DEFRAG_STACK 16
+#endif
+
+struct _rb_veb_frame
+{
+    struct rb_node *_root; // subtree laid out by this frame
+    struct rb_node *_cur;  // its bottom subtree being laid out, or NULL
+    size_t          _height;
+};
+
+/*
+ * State of an incremental rb_defrag pass, owned by the caller.
+ */
+struct rb_defrag_state
+{
+    rb_alloc_f      _alloc;
+    rb_free_f       _free;
+    void *          _args;
+    int             _order;
+    struct rb_node *_next;  // next node to move, NULL when done
+    struct rb_node *_dup;   // next duplicate to move in vEB order
+    size_t          _depth; // vEB frames in use
+    struct _rb_veb_frame _stack[RB_DEFRAG_STACK];
+};
+
 struct rb_tree
 {
     struct _rb_impl _impl;
     size_t          size;  // public member, size of the tree
 };
 
+// node of a chained tree, linked in the tree
+#define _RB_CHAIN_KEY 1
+// node of a chained tree, on the chain of its key
+#define _RB_CHAIN_DUP 2
+
 // red node
 #define _RB_RED   0
 // black node
@@ -101,7 +303,7 @@ struct rb_tree
 #define _RB_RMST(p)         _RB_IMPL_RMST(_RB_IMPL(p))
 
 #define _RB_IMPL_HEAD_INIT(head) \
-    { head,head,head,_RB_BLACK,1 }
+    { head,head,head,_RB_BLACK,1,0,0 }
 
 #define _RB_IMPL_INIT(impl, multi, comp, args) \
     { _RB_IMPL_HEAD_INIT(_RB_IMPL_HEAD(impl)),comp,args,multi }
@@ -151,16 +353,57 @@ struct rb_node *rb_next(const struct rb_node *node);
 
 void rb_init(struct rb_tree *rb, int multi, rb_compare_f comp, void *args);
 
+/*
+ * Initialize a tree ordered by a built-in key type, found key_offset
+ * bytes from the rb_node, see RB_KEY_OFFSET. Comparisons are inlined
+ * into the searches instead of calling a compare function through a
+ * pointer. A matching compare function is installed all the same, as
+ * well as a key compare function taking a pointer to a key for the
+ * rb_*_key lookups, and for RB_KEY_STR a string key accessor for the
+ * rb_*_str lookups.
+ */
+void rb_init_typed(struct rb_tree *rb, int multi, int key_type, ptrdiff_t key_offset);
+
 void rb_clear(struct rb_tree *rb);
 
+/*
+ * Whether n1 orders strictly before n2 in the tree, i.e. the compare
+ * function, after the prefixes in prefix mode.
+ */
+int rb_comp(const struct rb_tree *rb, const struct rb_node *n1, const struct rb_node *n2);
+
 struct rb_pair rb_eqrange(const struct rb_tree *rb, const struct rb_node *val);
 
 struct rb_node *rb_insert(struct rb_tree *rb, struct rb_node *node, int *out);
+
+/*
+ * Link node as the left (left = 1) or right child of parent, which has
+ * no such child, or below the head of an empty tree, and rebalance. For
+ * callers that found the position with their own search, such as the
+ * containers of rbtree.hpp. The order is not checked.
+ */
+void rb_insert_at(struct rb_tree *rb, struct rb_node *node, struct rb_node *parent, int left);
+
 struct rb_node *rb_erase(struct rb_tree *rb, struct rb_node *node);
 struct rb_node *rb_erase_range(struct rb_tree *rb, struct rb_node *begin, struct rb_node *end);
 
+size_t rb_erase_rgcnt(struct rb_tree *rb, struct rb_node *begin, struct rb_node *end);
 size_t rb_erase_val(struct rb_tree *rb, const struct rb_node *val);
 
+/*
+ * Cut [begin, end) out of the tree in O(logn + k) and restore the
+ * red-black properties once, by splitting the tree at begin and end
+ * and joining the outer parts back together.
+ *
+ * The k removed nodes are returned in *list, in order, as a singly
+ * linked list threaded through their _right pointers and terminated
+ * by NULL. Their other links are unspecified. Returns k.
+ *
+ * Tombstones inside the range are removed and listed as well.
+ */
+size_t rb_extract_range(struct rb_tree *rb, struct rb_node *begin, struct rb_node *end,
+    struct rb_node **list);
+
 size_t rb_dist(const struct rb_tree *rb, const struct rb_node *begin, const struct rb_node *end);
 size_t rb_vcnt(const struct rb_tree *rb, const struct rb_node *val);
 
@@ -169,6 +412,205 @@ struct rb_node *rb_find(const struct rb_tree *rb, const struct rb_node *val);
 struct rb_node *rb_lbnd(const struct rb_tree *rb, const struct rb_node *val);
 struct rb_node *rb_ubnd(const struct rb_tree *rb, const struct rb_node *val);
 
+/*
+ * Prefix mode, see rb_pnode. Every node of the tree, and every node
+ * passed as a search value, must then be the _node of an rb_pnode.
+ * Set it while the tree is empty.
+ *
+ * rb_prefix_str returns the prefix of a string ordered as memcmp does,
+ * i.e. its first 8 bytes, big-endian, zero padded.
+ */
+void rb_set_prefix(struct rb_tree *rb, int pfx);
+
+uint64_t rb_prefix_str(const void *str, size_t len);
+
+/*
+ * Chained mode, for multi trees with many copies of few keys. Every
+ * node of the tree must then be the _node of an rb_cnode. Equivalent
+ * nodes share one place in the tree, so the height only depends on the
+ * number of distinct keys, and rb_vcnt and rb_erase_val take O(logn)
+ * whatever the number of copies. Iteration, bounds and rb_eqrange are
+ * unchanged, copies still coming in insertion order.
+ *
+ * rb_erase of the first or last copy of a key takes O(1) on top of the
+ * usual cost, and of a copy in the middle O(k) for k copies. Set it
+ * while the tree is empty. Chained mode excludes prefix mode and lazy
+ * erase, and trees in it can not be used with rb_insert_at, rb_update,
+ * rb_merge or rb_extract_range.
+ */
+void rb_set_chain(struct rb_tree *rb, int chain);
+
+/*
+ * Lookups by key. Same as their node counterparts, but val is any key
+ * understood by the node vs key compare function registered with
+ * rb_set_keycomp, so no node has to be built for a search.
+ */
+void rb_set_keycomp(struct rb_tree *rb, rb_keycomp_f kcomp);
+
+struct rb_pair rb_eqrange_key(const struct rb_tree *rb, const void *key);
+
+size_t rb_erase_key(struct rb_tree *rb, const void *key);
+size_t rb_vcnt_key(const struct rb_tree *rb, const void *key);
+
+struct rb_node *rb_find_key(const struct rb_tree *rb, const void *key);
+
+struct rb_node *rb_lbnd_key(const struct rb_tree *rb, const void *key);
+struct rb_node *rb_ubnd_key(const struct rb_tree *rb, const void *key);
+
+/*
+ * Lookup cache. With a cache set, rb_find first probes a few slots of
+ * an open-addressed table at the hash of val, and returns the node in
+ * O(1) when one of them holds a node equivalent to val. Otherwise it
+ * searches the tree and caches the node found. The other lookups do
+ * not use the cache. It pays off when a few keys take most lookups.
+ *
+ * cap is the number of slots, a power of two. hash may be NULL for the
+ * built-in key types of rb_init_typed. Erasing a node removes it from
+ * the cache and rb_relocate repoints it. rb_update removes the node by
+ * a scan of the table, as the hash of its old key is gone. rb_clear,
+ * merge and extract empty the cache. rb_find updates the cache and its
+ * counters, so concurrent lookups on a cached tree race. Setting a NULL
+ * cache turns it off.
+ */
+void rb_set_cache(struct rb_tree *rb, struct rb_cache *cache,
+    struct rb_cache_slot *slots, size_t cap, rb_hash_f hash);
+
+/*
+ * Lookups by string key, with the accessor registered by rb_set_strkey.
+ * While descending, the search keeps the common prefix lengths of key
+ * with the nearest nodes known to be before and after it. Every node
+ * below shares at least the shorter of the two with key, so each
+ * comparison resumes there, a word at a time. This pays off when keys
+ * share long prefixes, such as paths or URLs.
+ */
+void rb_set_strkey(struct rb_tree *rb, rb_strkey_f skey);
+
+struct rb_node *rb_find_str(const struct rb_tree *rb, const void *key, size_t len);
+
+struct rb_node *rb_lbnd_str(const struct rb_tree *rb, const void *key, size_t len);
+struct rb_node *rb_ubnd_str(const struct rb_tree *rb, const void *key, size_t len);
+
+/*
+ * Finger search. Same as rb_lbnd/rb_ubnd/rb_find, but the search climbs
+ * from finger, any node of the tree or the head, only as far as needed
+ * and then descends. It is O(log n) in the worst case, as a climb to
+ * a common ancestor may still reach the root. A sequence of lookups in
+ * sorted order, each from the previous result, costs O(log d) amortized
+ * per lookup for a rank distance d between neighbouring results.
+ */
+struct rb_node *rb_lbnd_from(const struct rb_tree *rb, const struct rb_node *finger,
+    const struct rb_node *val);
+struct rb_node *rb_ubnd_from(const struct rb_tree *rb, const struct rb_node *finger,
+    const struct rb_node *val);
+struct rb_node *rb_find_from(const struct rb_tree *rb, const struct rb_node *finger,
+    const struct rb_node *val);
+
+/*
+ * Reposition node after its key has been changed in place. Nothing is
+ * done when the node is still ordered between its neighbours. Otherwise
+ * it is erased and reinserted by a search that climbs from its old
+ * neighbour instead of descending from the root.
+ *
+ * Like rb_insert, *out is set to 0 when a unique tree already holds an
+ * equivalent node. That node is returned and node is left out of the
+ * tree. Otherwise node is returned.
+ */
+struct rb_node *rb_update(struct rb_tree *rb, struct rb_node *node, int *out);
+
+/*
+ * Move every node of src into dst without allocation, as std::set::merge
+ * does. In unique mode, nodes whose key is already in dst stay in src.
+ * When src is much smaller than dst, its nodes are inserted in order
+ * with a hint. Otherwise both trees are merged as sorted sequences and
+ * rebuilt in O(n + m). Returns the number of nodes moved.
+ *
+ * Both trees must use the same ordering and hold no tombstones.
+ */
+size_t rb_merge(struct rb_tree *dst, struct rb_tree *src);
+
+/*
+ * Lazy erase. While enabled, rb_erase and friends only mark the node
+ * as a tombstone and skip the rebalancing. Tombstones are invisible to
+ * every other operation, and size only counts live nodes. Tombstones
+ * are still linked, so their storage must not be reused until they are
+ * removed by rb_compact (or rb_clear).
+ *
+ * rb_compact removes every tombstone, either one by one or, when they
+ * make up a large share of the tree, by rebuilding the tree from the
+ * live nodes in O(n). The removed tombstones are returned in *list,
+ * threaded through their _right pointers. Returns their number.
+ */
+void rb_set_lazy(struct rb_tree *rb, int lazy);
+
+size_t rb_ndead(const struct rb_tree *rb);
+size_t rb_compact(struct rb_tree *rb, struct rb_node **list);
+
+/*
+ * Relaxed balance. While a log is set, an insert only links the new red
+ * node, and if its parent is red too, records the violation in the log
+ * instead of fixing it, so bursts of inserts skip the rotations. The
+ * order and the black heights stay valid, so every lookup and iteration
+ * remains correct. Only the height bound is loosened, by at most the
+ * log capacity, until the violations are fixed. When the log is full,
+ * an insert fixes its own violation.
+ *
+ * rb_rebalance fixes at most budget logged violations, the most recent
+ * first, and returns the number still pending. rb_rebalance(rb, SIZE_MAX)
+ * restores the red-black properties, e.g. once the tree goes quiet.
+ * Erase, merge, extract, compact and relocate fix everything pending
+ * before they start. Combine with rb_set_lazy to defer erases as well.
+ * rb_set_relaxed(rb, NULL, 0) fixes what is pending and turns it off.
+ * The log array belongs to the tree while it is set.
+ */
+void rb_set_relaxed(struct rb_tree *rb, struct rb_node **log, size_t cap);
+size_t rb_rebalance(struct rb_tree *rb, size_t budget);
+
+/*
+ * Move node old to the storage at node: its links are copied, and the
+ * links of its parent, children, chain neighbours and the head are set
+ * to node, in O(1). The payload is up to the caller, and old must stay
+ * untouched until rb_relocate returns.
+ *
+ * rb_defrag moves every node into storage from alloc, in order or in
+ * vEB order, so that the layout follows the allocation order, e.g. of
+ * a fresh arena. It works in slices of at most budget nodes, and the
+ * tree can be searched between slices but not modified. rb_defrag_init
+ * fixes what a relaxed tree has pending. Returns 1 if nodes are left,
+ * 0 when the pass is over, or -1 if alloc failed, in which case the
+ * next call retries the same node.
+ */
+void rb_relocate(struct rb_tree *rb, struct rb_node *old, struct rb_node *node);
+
+void rb_defrag_init(struct rb_tree *rb, struct rb_defrag_state *df, int order,
+    rb_alloc_f alloc, rb_free_f release, void *args);
+
+int rb_defrag(struct rb_tree *rb, struct rb_defrag_state *df, size_t budget);
+
+/*
+ * Compute the shape and locality report of the tree in a single
+ * in-order pass, without recursion or extra memory. linescore and
+ * pagescore are the fractions of in-order neighbours whose rb_node
+ * lie in the same RB_CACHE_LINE or RB_PAGE_SIZE block.
+ */
+void rb_analyze(const struct rb_tree *rb, struct rb_report *report);
+
+/*
+ * Internal, the builder of rb_build_parallel. The n sorted, unlinked
+ * nodes make a balanced tree cut at depth level into 1 << level
+ * subtrees, none empty as level is 0 or above the deepest level. With
+ * roots NULL, subtree part alone is linked and its root returned, so
+ * that the parts can be linked concurrently. Otherwise the nodes above
+ * the subtrees are linked to roots, the subtree roots in order, and the
+ * result becomes the content of rb, whose root is returned.
+ */
+struct rb_node *_rb_build(struct rb_tree *rb, struct rb_node **nodes, size_t n,
+    size_t level, size_t part, struct rb_node *const *roots);
+
+#if defined _RB_STATS
+void rb_get_stats(const struct rb_tree *rb, struct rb_stats *stats);
+void rb_reset_stats(struct rb_tree *rb);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,1567 @@
+/*
+ * Copyright (c) 2020 niedong
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __RBTREE_HPP__
+#define __RBTREE_HPP__
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "rbtree.h"
+
+/*
+ * STL-compatible containers over rbtree.h, for C++11 and later:
+ *
+ * rb::set, rb::multiset, rb::map, rb::multimap
+ *
+ * They follow the interface of their std counterparts, including
+ * node handles (extract/insert), emplace and heterogeneous lookup with
+ * a transparent comparator (e.g. std::less<>). Searches are done here,
+ * so the comparator is inlined instead of being called through the
+ * rb_compare_f pointer. The C library links, rebalances and iterates.
+ *
+ * The rb_tree lives in a separate allocation together with the
+ * comparator, so that moving a container never moves the head node.
+ * A moved-from container is left empty with a fresh tree.
+ *
+ * Lazy erase is not used by these containers, do not enable it on
+ * the underlying tree.
+ */
+
+namespace rb
+{
+
+namespace detail
+{
+
+// value storage next to the link, constructed by the container
+template<class Value>
+struct node
+{
+    rb_node m_Link;
+    typename std::aligned_storage<sizeof(Value), alignof(Value)>::type m_Storage;
+
+    Value *
+    valptr(void)
+    {
+        return reinterpret_cast<Value *>(&m_Storage);
+    }
+
+    static node *
+    convert(const rb_node *conv)
+    {
+        return RB_CONV(node, conv, m_Link);
+    }
+
+    static Value &
+    value(const rb_node *conv)
+    {
+        return *convert(conv)->valptr();
+    }
+};
+
+template<class Value, bool Const>
+class tree_iterator
+{
+    template<class, class, class, class, class, bool, bool>
+    friend class tree;
+    template<class, bool>
+    friend class tree_iterator;
+
+    rb_node *m_Node;
+public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef Value value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef typename std::conditional<Const, const Value *, Value *>::type pointer;
+    typedef typename std::conditional<Const, const Value &, Value &>::type reference;
+
+    tree_iterator()
+        : m_Node(nullptr)
+    {
+    }
+
+    explicit tree_iterator(const rb_node *node)
+        : m_Node(const_cast<rb_node *>(node))
+    {
+    }
+
+    // iterator to const_iterator
+    template<bool C, class = typename std::enable_if<Const && !C>::type>
+    tree_iterator(const tree_iterator<Value, C> &it)
+        : m_Node(it.m_Node)
+    {
+    }
+
+    reference
+    operator*() const
+    {
+        return node<Value>::value(m_Node);
+    }
+
+    pointer
+    operator->() const
+    {
+        return node<Value>::convert(m_Node)->valptr();
+    }
+
+    tree_iterator &
+    operator++()
+    {
+        m_Node = rb_next(m_Node);
+        return *this;
+    }
+
+    tree_iterator
+    operator++(int)
+    {
+        tree_iterator old(*this);
+        m_Node = rb_next(m_Node);
+        return old;
+    }
+
+    tree_iterator &
+    operator--()
+    {
+        m_Node = rb_prev(m_Node);
+        return *this;
+    }
+
+    tree_iterator
+    operator--(int)
+    {
+        tree_iterator old(*this);
+        m_Node = rb_prev(m_Node);
+        return old;
+    }
+
+    friend bool
+    operator==(const tree_iterator &lhs, const tree_iterator &rhs)
+    {
+        return lhs.m_Node == rhs.m_Node;
+    }
+
+    friend bool
+    operator!=(const tree_iterator &lhs, const tree_iterator &rhs)
+    {
+        return lhs.m_Node != rhs.m_Node;
+    }
+};
+
+/*
+ * Move-only owner of an extracted node. The value is destroyed and
+ * the node freed with the allocator of its container, unless it is
+ * handed back to a container through insert.
+ */
+template<class Value, class Alloc>
+class node_handle
+{
+    template<class, class, class, class, class, bool, bool>
+    friend class tree;
+
+    typedef node<Value> node_type;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<node_type> node_alloc;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<Value> value_alloc;
+
+    node_type *m_Ptr;
+    node_alloc m_Alloc;
+
+    node_handle(node_type *ptr, const node_alloc &alloc)
+        : m_Ptr(ptr), m_Alloc(alloc)
+    {
+    }
+
+    node_type *
+    release(void)
+    {
+        node_type *ptr = m_Ptr;
+        m_Ptr = nullptr;
+        return ptr;
+    }
+
+    void
+    reset(void)
+    {
+        if (m_Ptr)
+        {
+            value_alloc va(m_Alloc);
+
+            std::allocator_traits<value_alloc>::destroy(va, m_Ptr->valptr());
+            std::allocator_traits<node_alloc>::deallocate(m_Alloc, m_Ptr, 1);
+
+            m_Ptr = nullptr;
+        }
+    }
+public:
+    typedef Value value_type;
+    typedef Alloc allocator_type;
+
+    node_handle()
+        : m_Ptr(nullptr)
+    {
+    }
+
+    node_handle(node_handle &&other)
+        : m_Ptr(other.release()), m_Alloc(std::move(other.m_Alloc))
+    {
+    }
+
+    node_handle &
+    operator=(node_handle &&other)
+    {
+        if (this != &other)
+        {
+            reset();
+            m_Ptr = other.release();
+            m_Alloc = std::move(other.m_Alloc);
+        }
+
+        return *this;
+    }
+
+    node_handle(const node_handle &) = delete;
+    node_handle &operator=(const node_handle &) = delete;
+
+    ~node_handle()
+    {
+        reset();
+    }
+
+    bool
+    empty(void) const
+    {
+        return !m_Ptr;
+    }
+
+    explicit operator bool() const
+    {
+        return m_Ptr != nullptr;
+    }
+
+    allocator_type
+    get_allocator(void) const
+    {
+        return allocator_type(m_Alloc);
+    }
+
+    // set
+    value_type &
+    value(void) const
+    {
+        return *m_Ptr->valptr();
+    }
+
+    // map, the key may be changed before inserting it again
+    template<class V = Value>
+    typename std::remove_const<typename V::first_type>::type &
+    key(void) const
+    {
+        return const_cast<typename std::remove_const<typename V::first_type>::type &>(
+            m_Ptr->valptr()->first);
+    }
+
+    template<class V = Value>
+    typename V::second_type &
+    mapped(void) const
+    {
+        return m_Ptr->valptr()->second;
+    }
+
+    void
+    swap(node_handle &other)
+    {
+        std::swap(m_Ptr, other.m_Ptr);
+        std::swap(m_Alloc, other.m_Alloc);
+    }
+};
+
+template<class Iterator, class NodeType>
+struct insert_return
+{
+    Iterator position;
+    bool inserted;
+    NodeType node;
+};
+
+// K only delays the check to overload resolution
+template<class Compare, class K, class = void>
+struct is_transparent : std::false_type
+{
+};
+
+template<class Compare, class K>
+struct is_transparent<Compare, K, typename std::conditional<true, void,
+    typename Compare::is_transparent>::type> : std::true_type
+{
+};
+
+struct identity
+{
+    template<class T>
+    const T &
+    operator()(const T &val) const
+    {
+        return val;
+    }
+};
+
+struct select_first
+{
+    template<class P>
+    const typename P::first_type &
+    operator()(const P &val) const
+    {
+        return val.first;
+    }
+};
+
+/*
+ * The common part of the four containers. KeyOf extracts the key from
+ * a value, Multi allows equivalent keys and ConstIter makes iterator
+ * the same as const_iterator, as sets do.
+ */
+template<class Key, class Value, class KeyOf, class Compare, class Alloc, bool Multi, bool ConstIter>
+class tree
+{
+    template<class, class, class, class, class, bool, bool>
+    friend class tree;
+public:
+    typedef Key key_type;
+    typedef Value value_type;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef Compare key_compare;
+    typedef Alloc allocator_type;
+    typedef value_type &reference;
+    typedef const value_type &const_reference;
+    typedef typename std::allocator_traits<Alloc>::pointer pointer;
+    typedef typename std::allocator_traits<Alloc>::const_pointer const_pointer;
+    typedef tree_iterator<Value, ConstIter> iterator;
+    typedef tree_iterator<Value, true> const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+    typedef node_handle<Value, Alloc> node_type;
+    typedef detail::insert_return<iterator, node_type> insert_return_type;
+protected:
+    typedef detail::node<Value> node_t;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<node_t> node_alloc;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<Value> value_alloc;
+
+    // the tree with the comparator it calls back, never moved
+    struct header
+    {
+        rb_tree m_Tree;
+        Compare m_Comp;
+
+        header(const Compare &comp)
+            : m_Comp(comp)
+        {
+            rb_init(&m_Tree, Multi, compare, &m_Comp);
+        }
+    };
+
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<header> header_alloc;
+    typedef typename std::allocator_traits<node_alloc>::
+        propagate_on_container_move_assignment move_alloc;
+
+    // what a moved-from tree reads as, it has no header
+    struct empty_header
+    {
+        rb_tree m_Tree;
+
+        empty_header(void)
+        {
+            rb_init(&m_Tree, Multi, compare, nullptr);
+        }
+    };
+
+    // insert result, pair<iterator, bool> or iterator for multi
+    typedef typename std::conditional<Multi,
+        iterator, std::pair<iterator, bool>>::type emplace_return;
+
+    header *m_Hdr;
+    node_alloc m_Alloc;
+
+    static const Key &
+    key(const rb_node *node)
+    {
+        return KeyOf()(node_t::value(node));
+    }
+
+    // for the C functions that compare, e.g. rb_merge
+    static int
+    compare(const rb_node *n1, const rb_node *n2, void *args)
+    {
+        return (*static_cast<Compare *>(args))(key(n1), key(n2));
+    }
+
+    static rb_tree *
+    empty_tree(void)
+    {
+        static empty_header empty;
+
+        return &empty.m_Tree;
+    }
+
+    rb_tree *
+    tr(void) const
+    {
+        return m_Hdr ? &m_Hdr->m_Tree : empty_tree();
+    }
+
+    rb_node *
+    head(void) const
+    {
+        return _RB_HEAD(tr());
+    }
+
+    const Compare &
+    comp(void) const
+    {
+        return m_Hdr->m_Comp;
+    }
+
+    header *
+    new_header(const Compare &comp)
+    {
+        header_alloc ha(m_Alloc);
+        header *hdr = std::allocator_traits<header_alloc>::allocate(ha, 1);
+
+        try
+        {
+            ::new (static_cast<void *>(hdr)) header(comp);
+        }
+        catch (...)
+        {
+            std::allocator_traits<header_alloc>::deallocate(ha, hdr, 1);
+            throw;
+        }
+
+        return hdr;
+    }
+
+    void
+    delete_header(header *hdr)
+    {
+        header_alloc ha(m_Alloc);
+
+        hdr->~header();
+        std::allocator_traits<header_alloc>::deallocate(ha, hdr, 1);
+    }
+
+    // the comparator a moved-from tree starts over with
+    static Compare
+    fresh_comp(std::true_type)
+    {
+        return Compare();
+    }
+
+    static Compare
+    fresh_comp(std::false_type)
+    {
+        throw std::logic_error("rb::tree: moved-from tree without a default comparator");
+    }
+
+    // give a moved-from tree a header again, before it takes a node
+    void
+    own(void)
+    {
+        if (!m_Hdr)
+        {
+            m_Hdr = new_header(key_comp());
+        }
+    }
+
+    // free the nodes and the header, then take those of other
+    void
+    steal(tree &other) noexcept
+    {
+        destroy_all();
+
+        if (m_Hdr)
+        {
+            delete_header(m_Hdr);
+        }
+
+        m_Hdr = other.m_Hdr;
+        other.m_Hdr = nullptr;
+    }
+
+    void
+    move_assign(tree &other, std::true_type) noexcept
+    {
+        steal(other);
+        m_Alloc = other.m_Alloc;
+    }
+
+    // the nodes can only be taken if this allocator can free them
+    void
+    move_assign(tree &other, std::false_type)
+    {
+        if (m_Alloc == other.m_Alloc)
+        {
+            steal(other);
+            return;
+        }
+
+        tree copy(other.key_comp(), get_allocator());
+        rb_node *hd = other.head();
+
+        for (rb_node *node = _RB_LMST(other.tr()); node != hd; node = rb_next(node))
+        {
+            node_t *dst = copy.create_node(std::move(*node_t::convert(node)->valptr()));
+            rb_node *rmst = _RB_RMST(copy.tr());
+
+            rb_insert_at(copy.tr(), &dst->m_Link, rmst, rmst->_isnil);
+        }
+
+        std::swap(m_Hdr, copy.m_Hdr);
+        other.clear();
+    }
+
+    template<class... Args>
+    node_t *
+    create_node(Args&&... args)
+    {
+        own();
+
+        node_t *node = std::allocator_traits<node_alloc>::allocate(m_Alloc, 1);
+        value_alloc va(m_Alloc);
+
+        try
+        {
+            std::allocator_traits<value_alloc>::construct(va,
+                node->valptr(), std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            std::allocator_traits<node_alloc>::deallocate(m_Alloc, node, 1);
+            throw;
+        }
+
+        return node;
+    }
+
+    void
+    destroy_node(node_t *node)
+    {
+        value_alloc va(m_Alloc);
+
+        std::allocator_traits<value_alloc>::destroy(va, node->valptr());
+        std::allocator_traits<node_alloc>::deallocate(m_Alloc, node, 1);
+    }
+
+    /*
+     * Free every node in post-order. rb_next can not be used here,
+     * since it may climb through a node that is already freed.
+     */
+    void
+    destroy_all(void)
+    {
+        if (!m_Hdr)
+        {
+            return;
+        }
+
+        rb_node *hd = head();
+        rb_node *node = _RB_ROOT(tr());
+
+        while (!node->_isnil)
+        {
+            if (!node->_left->_isnil)
+            {
+                node = node->_left;
+            }
+            else if (!node->_right->_isnil)
+            {
+                node = node->_right;
+            }
+            else
+            {
+                rb_node *parent = node->_parent;
+
+                if (!parent->_isnil)
+                {
+                    (parent->_left == node ? parent->_left : parent->_right) = hd;
+                }
+
+                destroy_node(node_t::convert(node));
+                node = parent;
+            }
+        }
+
+        rb_clear(tr());
+    }
+
+    template<class K>
+    rb_node *
+    lower(const K &val) const
+    {
+        rb_node *res = head(), *node = _RB_ROOT(tr());
+
+        while (!node->_isnil)
+        {
+            if (comp()(key(node), val))
+            {
+                node = node->_right;
+            }
+            else
+            {
+                res = node;
+                node = node->_left;
+            }
+        }
+
+        return res;
+    }
+
+    template<class K>
+    rb_node *
+    upper(const K &val) const
+    {
+        rb_node *res = head(), *node = _RB_ROOT(tr());
+
+        while (!node->_isnil)
+        {
+            if (comp()(val, key(node)))
+            {
+                res = node;
+                node = node->_left;
+            }
+            else
+            {
+                node = node->_right;
+            }
+        }
+
+        return res;
+    }
+
+    // lower and upper bound, splitting at the first equivalent node
+    template<class K>
+    std::pair<rb_node *, rb_node *>
+    range(const K &val) const
+    {
+        rb_node *lo = head(), *hi = head(), *node = _RB_ROOT(tr());
+
+        while (!node->_isnil)
+        {
+            if (comp()(key(node), val))
+            {
+                node = node->_right;
+            }
+            else if (comp()(val, key(node)))
+            {
+                lo = hi = node;
+                node = node->_left;
+            }
+            else
+            {
+                rb_node *up = node->_right;
+
+                for (lo = node, node = node->_left; !node->_isnil; )
+                {
+                    if (comp()(key(node), val))
+                    {
+                        node = node->_right;
+                    }
+                    else
+                    {
+                        lo = node;
+                        node = node->_left;
+                    }
+                }
+                while (!up->_isnil)
+                {
+                    if (comp()(val, key(up)))
+                    {
+                        hi = up;
+                        up = up->_left;
+                    }
+                    else
+                    {
+                        up = up->_right;
+                    }
+                }
+
+                break;
+            }
+        }
+
+        return std::make_pair(lo, hi);
+    }
+
+    template<class K>
+    rb_node *
+    find_node(const K &val) const
+    {
+        rb_node *res = lower(val);
+
+        return res == head() || comp()(val, key(res)) ? head() : res;
+    }
+
+    /*
+     * Find where a value with key val goes, after its equivalents.
+     * For unique trees, returns the equivalent node if there is one
+     * and parent is left untouched.
+     */
+    rb_node *
+    position(const Key &val, rb_node **parent, int *left) const
+    {
+        rb_node *hd = head(), *pos = hd, *node = _RB_ROOT(tr());
+        int addleft = 1;
+
+        while (!node->_isnil)
+        {
+            pos = node;
+            addleft = comp()(val, key(node));
+            node = addleft ? node->_left : node->_right;
+        }
+
+        if (!Multi && pos != hd)
+        {
+            rb_node *prev = addleft ? (pos == _RB_LMST(tr()) ? hd : rb_prev(pos)) : pos;
+
+            if (prev != hd && !comp()(key(prev), val))
+            {
+                return prev;
+            }
+        }
+
+        *parent = pos;
+        *left = addleft;
+
+        return nullptr;
+    }
+
+    /*
+     * Position with a hint, O(1) when the value goes right before
+     * hint, as std::set does. Otherwise a full search. A nil hint is
+     * the end, also one taken before a moved-from tree got its header.
+     */
+    rb_node *
+    position(rb_node *hint, const Key &val, rb_node **parent, int *left) const
+    {
+        rb_node *hd = head();
+
+        if (hint->_isnil)
+        {
+            rb_node *rmst = _RB_RMST(tr());
+
+            if (rmst == hd || (Multi ? !comp()(val, key(rmst)) : comp()(key(rmst), val)))
+            {
+                *parent = rmst;
+                *left = rmst == hd;
+
+                return nullptr;
+            }
+        }
+        else if (Multi ? !comp()(key(hint), val) : comp()(val, key(hint)))
+        {
+            rb_node *prev = hint == _RB_LMST(tr()) ? hd : rb_prev(hint);
+
+            if (prev == hd || (Multi ? !comp()(val, key(prev)) : comp()(key(prev), val)))
+            {
+                // prev is the rightmost of hint's left subtree, if any
+                *parent = hint->_left->_isnil ? hint : prev;
+                *left = *parent == hint;
+
+                return nullptr;
+            }
+        }
+
+        return position(val, parent, left);
+    }
+
+    static emplace_return
+    make_return(rb_node *node, bool inserted, std::true_type)
+    {
+        (void)inserted;
+        return iterator(node);
+    }
+
+    static emplace_return
+    make_return(rb_node *node, bool inserted, std::false_type)
+    {
+        return std::pair<iterator, bool>(iterator(node), inserted);
+    }
+
+    static emplace_return
+    make_return(rb_node *node, bool inserted)
+    {
+        return make_return(node, inserted, std::integral_constant<bool, Multi>());
+    }
+
+    // link a constructed node, or free it if its key is taken
+    emplace_return
+    link_node(node_t *node)
+    {
+        rb_node *parent, *dup;
+        int left;
+
+        if ((dup = position(KeyOf()(*node->valptr()), &parent, &left)))
+        {
+            destroy_node(node);
+            return make_return(dup, false);
+        }
+
+        rb_insert_at(tr(), &node->m_Link, parent, left);
+
+        return make_return(&node->m_Link, true);
+    }
+
+    iterator
+    link_node(rb_node *hint, node_t *node)
+    {
+        rb_node *parent, *dup;
+        int left;
+
+        if ((dup = position(hint, KeyOf()(*node->valptr()), &parent, &left)))
+        {
+            destroy_node(node);
+            return iterator(dup);
+        }
+
+        rb_insert_at(tr(), &node->m_Link, parent, left);
+
+        return iterator(&node->m_Link);
+    }
+
+    // append values in order, for copies
+    template<class It>
+    void
+    append(It first, It last)
+    {
+        for (; first != last; ++first)
+        {
+            node_t *node = create_node(*first);
+            rb_node *rmst = _RB_RMST(tr());
+
+            rb_insert_at(tr(), &node->m_Link, rmst, rmst->_isnil);
+        }
+    }
+
+    // heterogeneous lookup, only with a transparent comparator
+    template<class K>
+    using transparent = typename std::enable_if<is_transparent<Compare, K>::value, int>::type;
+public:
+    tree()
+        : tree(Compare())
+    {
+    }
+
+    explicit tree(const Compare &comp, const Alloc &alloc = Alloc())
+        : m_Hdr(nullptr), m_Alloc(alloc)
+    {
+        m_Hdr = new_header(comp);
+    }
+
+    explicit tree(const Alloc &alloc)
+        : tree(Compare(), alloc)
+    {
+    }
+
+    template<class It>
+    tree(It first, It last, const Compare &comp = Compare(), const Alloc &alloc = Alloc())
+        : tree(comp, alloc)
+    {
+        insert(first, last);
+    }
+
+    tree(std::initializer_list<value_type> il,
+        const Compare &comp = Compare(), const Alloc &alloc = Alloc())
+        : tree(il.begin(), il.end(), comp, alloc)
+    {
+    }
+
+    tree(const tree &other)
+        : tree(other.key_comp(), std::allocator_traits<node_alloc>::
+            select_on_container_copy_construction(other.m_Alloc))
+    {
+        append(other.begin(), other.end());
+    }
+
+    /*
+     * Take the header of other, which is left empty and without one.
+     * It gets a new header on its first insertion.
+     */
+    tree(tree &&other) noexcept
+        : m_Hdr(other.m_Hdr), m_Alloc(other.m_Alloc)
+    {
+        other.m_Hdr = nullptr;
+    }
+
+    ~tree()
+    {
+        destroy_all();
+
+        if (m_Hdr)
+        {
+            delete_header(m_Hdr);
+        }
+    }
+
+    tree &
+    operator=(const tree &other)
+    {
+        if (this != &other)
+        {
+            tree copy(other);
+            swap(copy);
+        }
+
+        return *this;
+    }
+
+    /*
+     * Take the nodes of other if the allocator propagates or both are
+     * equal, otherwise move the values one by one.
+     */
+    tree &
+    operator=(tree &&other) noexcept(move_alloc::value)
+    {
+        if (this != &other)
+        {
+            move_assign(other, move_alloc());
+        }
+
+        return *this;
+    }
+
+    tree &
+    operator=(std::initializer_list<value_type> il)
+    {
+        clear();
+        insert(il);
+
+        return *this;
+    }
+
+    allocator_type
+    get_allocator(void) const
+    {
+        return allocator_type(m_Alloc);
+    }
+
+    key_compare
+    key_comp(void) const
+    {
+        return m_Hdr ? comp() : fresh_comp(std::is_default_constructible<Compare>());
+    }
+
+    // iterators
+
+    iterator begin(void) { return iterator(_RB_LMST(tr())); }
+    const_iterator begin(void) const { return const_iterator(_RB_LMST(tr())); }
+    const_iterator cbegin(void) const { return begin(); }
+    iterator end(void) { return iterator(head()); }
+    const_iterator end(void) const { return const_iterator(head()); }
+    const_iterator cend(void) const { return end(); }
+    reverse_iterator rbegin(void) { return reverse_iterator(end()); }
+    const_reverse_iterator rbegin(void) const { return const_reverse_iterator(end()); }
+    const_reverse_iterator crbegin(void) const { return rbegin(); }
+    reverse_iterator rend(void) { return reverse_iterator(begin()); }
+    const_reverse_iterator rend(void) const { return const_reverse_iterator(begin()); }
+    const_reverse_iterator crend(void) const { return rend(); }
+
+    // capacity
+
+    bool
+    empty(void) const
+    {
+        return !tr()->size;
+    }
+
+    size_type
+    size(void) const
+    {
+        return tr()->size;
+    }
+
+    size_type
+    max_size(void) const
+    {
+        return std::allocator_traits<node_alloc>::max_size(m_Alloc);
+    }
+
+    // modifiers
+
+    void
+    clear(void)
+    {
+        destroy_all();
+    }
+
+    template<class... Args>
+    emplace_return
+    emplace(Args&&... args)
+    {
+        return link_node(create_node(std::forward<Args>(args)...));
+    }
+
+    template<class... Args>
+    iterator
+    emplace_hint(const_iterator hint, Args&&... args)
+    {
+        return link_node(hint.m_Node, create_node(std::forward<Args>(args)...));
+    }
+
+    emplace_return
+    insert(const value_type &val)
+    {
+        return emplace(val);
+    }
+
+    emplace_return
+    insert(value_type &&val)
+    {
+        return emplace(std::move(val));
+    }
+
+    iterator
+    insert(const_iterator hint, const value_type &val)
+    {
+        return emplace_hint(hint, val);
+    }
+
+    iterator
+    insert(const_iterator hint, value_type &&val)
+    {
+        return emplace_hint(hint, std::move(val));
+    }
+
+    template<class It>
+    void
+    insert(It first, It last)
+    {
+        for (; first != last; ++first)
+        {
+            emplace_hint(cend(), *first);
+        }
+    }
+
+    void
+    insert(std::initializer_list<value_type> il)
+    {
+        insert(il.begin(), il.end());
+    }
+
+    /*
+     * Insert an extracted node. On failure (unique tree with the key
+     * present) the node is handed back in the result.
+     */
+    insert_return_type
+    insert(node_type &&nh)
+    {
+        insert_return_type res = { end(), false, node_type() };
+        rb_node *parent, *dup;
+        int left;
+
+        if (nh.empty())
+        {
+            return res;
+        }
+
+        own();
+
+        if ((dup = position(KeyOf()(nh.value()), &parent, &left)))
+        {
+            res.position = iterator(dup);
+            res.node = std::move(nh);
+
+            return res;
+        }
+
+        node_t *node = nh.release();
+
+        rb_insert_at(tr(), &node->m_Link, parent, left);
+
+        res.position = iterator(&node->m_Link);
+        res.inserted = true;
+
+        return res;
+    }
+
+    iterator
+    insert(const_iterator hint, node_type &&nh)
+    {
+        rb_node *parent, *dup;
+        int left;
+
+        if (nh.empty())
+        {
+            return end();
+        }
+
+        own();
+
+        if ((dup = position(hint.m_Node, KeyOf()(nh.value()), &parent, &left)))
+        {
+            return iterator(dup);
+        }
+
+        node_t *node = nh.release();
+
+        rb_insert_at(tr(), &node->m_Link, parent, left);
+
+        return iterator(&node->m_Link);
+    }
+
+    node_type
+    extract(const_iterator pos)
+    {
+        rb_erase(tr(), pos.m_Node);
+        return node_type(node_t::convert(pos.m_Node), m_Alloc);
+    }
+
+    node_type
+    extract(const key_type &val)
+    {
+        rb_node *node = find_node(val);
+
+        return node == head() ? node_type() : extract(const_iterator(node));
+    }
+
+    iterator
+    erase(const_iterator pos)
+    {
+        rb_node *next = rb_erase(tr(), pos.m_Node);
+
+        destroy_node(node_t::convert(pos.m_Node));
+
+        return iterator(next);
+    }
+
+    // also an exact match for iterator, which would be ambiguous otherwise
+    template<class It = iterator, class = typename std::enable_if<!ConstIter &&
+        std::is_same<It, iterator>::value>::type>
+    iterator
+    erase(iterator pos)
+    {
+        return erase(const_iterator(pos));
+    }
+
+    iterator
+    erase(const_iterator first, const_iterator last)
+    {
+        if (first == cbegin() && last == cend())
+        {
+            clear();
+            return end();
+        }
+
+        while (first != last)
+        {
+            first = erase(first);
+        }
+
+        return iterator(last.m_Node);
+    }
+
+    size_type
+    erase(const key_type &val)
+    {
+        if (!Multi)
+        {
+            rb_node *node = find_node(val);
+
+            if (node == head())
+            {
+                return 0;
+            }
+
+            erase(const_iterator(node));
+
+            return 1;
+        }
+
+        std::pair<rb_node *, rb_node *> pr = range(val);
+        size_type count = 0;
+
+        if (pr.first == _RB_LMST(tr()) && pr.second == head())
+        {
+            count = size();
+            clear();
+
+            return count;
+        }
+
+        for (; pr.first != pr.second; ++count)
+        {
+            pr.first = erase(const_iterator(pr.first)).m_Node;
+        }
+
+        return count;
+    }
+
+    void
+    swap(tree &other)
+    {
+        std::swap(m_Hdr, other.m_Hdr);
+        std::swap(m_Alloc, other.m_Alloc);
+    }
+
+    /*
+     * Move the nodes of other into this tree, no value is copied. In
+     * unique trees, values whose key is already present stay in other.
+     * Both trees must use equal allocators.
+     */
+    template<bool M, bool C>
+    void
+    merge(tree<Key, Value, KeyOf, Compare, Alloc, M, C> &other)
+    {
+        if (other.empty())
+        {
+            return;
+        }
+
+        own();
+        rb_merge(tr(), other.tr());
+    }
+
+    template<bool M, bool C>
+    void
+    merge(tree<Key, Value, KeyOf, Compare, Alloc, M, C> &&other)
+    {
+        merge(other);
+    }
+
+    // lookup
+
+    size_type
+    count(const key_type &val) const
+    {
+        std::pair<rb_node *, rb_node *> pr;
+
+        if (!Multi)
+        {
+            return find_node(val) != head();
+        }
+
+        pr = range(val);
+
+        return static_cast<size_type>(rb_dist(tr(), pr.first, pr.second));
+    }
+
+    template<class K, transparent<K> = 0>
+    size_type
+    count(const K &val) const
+    {
+        std::pair<rb_node *, rb_node *> pr = range(val);
+
+        return static_cast<size_type>(rb_dist(tr(), pr.first, pr.second));
+    }
+
+    iterator find(const key_type &val) { return iterator(find_node(val)); }
+    const_iterator find(const key_type &val) const { return const_iterator(find_node(val)); }
+
+    template<class K, transparent<K> = 0>
+    iterator find(const K &val) { return iterator(find_node(val)); }
+    template<class K, transparent<K> = 0>
+    const_iterator find(const K &val) const { return const_iterator(find_node(val)); }
+
+    bool
+    contains(const key_type &val) const
+    {
+        return find_node(val) != head();
+    }
+
+    template<class K, transparent<K> = 0>
+    bool
+    contains(const K &val) const
+    {
+        return find_node(val) != head();
+    }
+
+    iterator lower_bound(const key_type &val) { return iterator(lower(val)); }
+    const_iterator lower_bound(const key_type &val) const { return const_iterator(lower(val)); }
+    iterator upper_bound(const key_type &val) { return iterator(upper(val)); }
+    const_iterator upper_bound(const key_type &val) const { return const_iterator(upper(val)); }
+
+    template<class K, transparent<K> = 0>
+    iterator lower_bound(const K &val) { return iterator(lower(val)); }
+    template<class K, transparent<K> = 0>
+    const_iterator lower_bound(const K &val) const { return const_iterator(lower(val)); }
+    template<class K, transparent<K> = 0>
+    iterator upper_bound(const K &val) { return iterator(upper(val)); }
+    template<class K, transparent<K> = 0>
+    const_iterator upper_bound(const K &val) const { return const_iterator(upper(val)); }
+
+    std::pair<iterator, iterator>
+    equal_range(const key_type &val)
+    {
+        std::pair<rb_node *, rb_node *> pr = range(val);
+
+        return std::pair<iterator, iterator>(iterator(pr.first), iterator(pr.second));
+    }
+
+    std::pair<const_iterator, const_iterator>
+    equal_range(const key_type &val) const
+    {
+        std::pair<rb_node *, rb_node *> pr = range(val);
+
+        return std::pair<const_iterator, const_iterator>(
+            const_iterator(pr.first), const_iterator(pr.second));
+    }
+
+    template<class K, transparent<K> = 0>
+    std::pair<iterator, iterator>
+    equal_range(const K &val)
+    {
+        std::pair<rb_node *, rb_node *> pr = range(val);
+
+        return std::pair<iterator, iterator>(iterator(pr.first), iterator(pr.second));
+    }
+
+    template<class K, transparent<K> = 0>
+    std::pair<const_iterator, const_iterator>
+    equal_range(const K &val) const
+    {
+        std::pair<rb_node *, rb_node *> pr = range(val);
+
+        return std::pair<const_iterator, const_iterator>(
+            const_iterator(pr.first), const_iterator(pr.second));
+    }
+
+    // the underlying tree, e.g. for rb_analyze
+    const rb_tree *
+    native(void) const
+    {
+        return tr();
+    }
+
+    friend bool
+    operator==(const tree &lhs, const tree &rhs)
+    {
+        return lhs.size() == rhs.size() && std::equal(lhs.begin(), lhs.end(), rhs.begin());
+    }
+
+    friend bool
+    operator!=(const tree &lhs, const tree &rhs)
+    {
+        return !(lhs == rhs);
+    }
+
+    friend bool
+    operator<(const tree &lhs, const tree &rhs)
+    {
+        return std::lexicographical_compare(lhs.begin(), lhs.end(), rhs.begin(), rhs.end());
+    }
+
+    friend void
+    swap(tree &lhs, tree &rhs)
+    {
+        lhs.swap(rhs);
+    }
+};
+
+template<class Key, class T, class Compare, class Alloc, bool Multi>
+class map_base
+    : public tree<Key, std::pair<const Key, T>, select_first, Compare, Alloc, Multi, false>
+{
+    typedef tree<Key, std::pair<const Key, T>, select_first, Compare, Alloc, Multi, false> base;
+public:
+    typedef T mapped_type;
+
+    class value_compare
+    {
+        friend class map_base;
+    protected:
+        Compare m_Comp;
+
+        value_compare(const Compare &comp)
+            : m_Comp(comp)
+        {
+        }
+    public:
+        bool
+        operator()(const typename base::value_type &lhs,
+            const typename base::value_type &rhs) const
+        {
+            return m_Comp(lhs.first, rhs.first);
+        }
+    };
+
+    using base::base;
+    using base::operator=;
+
+    map_base() = default;
+
+    value_compare
+    value_comp(void) const
+    {
+        return value_compare(this->key_comp());
+    }
+};
+
+} // namespace detail
+
+template<class Key, class Compare = std::less<Key>, class Alloc = std::allocator<Key>>
+class set : public detail::tree<Key, Key, detail::identity, Compare, Alloc, false, true>
+{
+    typedef detail::tree<Key, Key, detail::identity, Compare, Alloc, false, true> base;
+public:
+    typedef Compare value_compare;
+
+    using base::base;
+    using base::operator=;
+
+    set() = default;
+
+    value_compare
+    value_comp(void) const
+    {
+        return this->key_comp();
+    }
+};
+
+template<class Key, class Compare = std::less<Key>, class Alloc = std::allocator<Key>>
+class multiset : public detail::tree<Key, Key, detail::identity, Compare, Alloc, true, true>
+{
+    typedef detail::tree<Key, Key, detail::identity, Compare, Alloc, true, true> base;
+public:
+    typedef Compare value_compare;
+
+    using base::base;
+    using base::operator=;
+
+    multiset() = default;
+
+    value_compare
+    value_comp(void) const
+    {
+        return this->key_comp();
+    }
+};
+
+template<class Key, class T, class Compare = std::less<Key>,
+    class Alloc = std::allocator<std::pair<const Key, T>>>
+class map : public detail::map_base<Key, T, Compare, Alloc, false>
+{
+    typedef detail::map_base<Key, T, Compare, Alloc, false> base;
+public:
+    using base::base;
+    using base::operator=;
+
+    map() = default;
+
+    T &
+    operator[](const Key &key)
+    {
+        return try_emplace(key).first->second;
+    }
+
+    T &
+    operator[](Key &&key)
+    {
+        return try_emplace(std::move(key)).first->second;
+    }
+
+    T &
+    at(const Key &key)
+    {
+        typename base::iterator it = this->find(key);
+
+        if (it == this->end())
+        {
+            throw std::out_of_range("rb::map::at");
+        }
+
+        return it->second;
+    }
+
+    const T &
+    at(const Key &key) const
+    {
+        typename base::const_iterator it = this->find(key);
+
+        if (it == this->end())
+        {
+            throw std::out_of_range("rb::map::at");
+        }
+
+        return it->second;
+    }
+
+    // construct the mapped value only if the key is absent
+    template<class K, class... Args>
+    std::pair<typename base::iterator, bool>
+    try_emplace(K &&key, Args&&... args)
+    {
+        rb_node *parent, *dup;
+        int left;
+
+        this->own();
+
+        if ((dup = this->position(key, &parent, &left)))
+        {
+            return std::make_pair(typename base::iterator(dup), false);
+        }
+
+        typename base::node_t *node = this->create_node(std::piecewise_construct,
+            std::forward_as_tuple(std::forward<K>(key)),
+            std::forward_as_tuple(std::forward<Args>(args)...));
+
+        rb_insert_at(this->tr(), &node->m_Link, parent, left);
+
+        return std::make_pair(typename base::iterator(&node->m_Link), true);
+    }
+
+    template<class M>
+    std::pair<typename base::iterator, bool>
+    insert_or_assign(const Key &key, M &&obj)
+    {
+        std::pair<typename base::iterator, bool> res = try_emplace(key, std::forward<M>(obj));
+
+        if (!res.second)
+        {
+            res.first->second = std::forward<M>(obj);
+        }
+
+        return res;
+    }
+};
+
+template<class Key, class T, class Compare = std::less<Key>,
+    class Alloc = std::allocator<std::pair<const Key, T>>>
+class multimap : public detail::map_base<Key, T, Compare, Alloc, true>
+{
+    typedef detail::map_base<Key, T, Compare, Alloc, true> base;
+public:
+    using base::base;
+    using base::operator=;
+
+    multimap() = default;
+};
+
+} // namespace rb
+
+#endif // __RBTREE_HPP__
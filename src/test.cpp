@@ -24,9 +24,13 @@
 #include <chrono>
 #include <random>
 #include <thread>
+#include <mutex>
 #include <sstream>
 #include <functional>
+#include <memory>
+#include <limits>
 #include <exception>
+#include <algorithm>
 
 #include <vector>
 #include <array>
@@ -35,409 +39,3656 @@
 #include <set>
 
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
 #include <ctime>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+
+#if defined __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #include "rbtree.h"
+#include "rbtree.hpp"
+#include "rbidx.h"
+#include "rbfile.h"
+#include "rbpar.h"
+#include "rbsmall.h"
+#if defined __linux__
+#include "rbfc.h"
+#endif
 
 #define ARRSZ(arr) (sizeof(arr) / sizeof(*(arr)))
 
-class Timer
+/*
+ * Hardware performance counters of the calling thread. The counters
+ * are opened on start() and closed on stop(), so that they can follow
+ * a benchmark phase running on any thread. Counters that cannot be
+ * opened (non-Linux system, no PMU, restrictive perf_event_paranoid)
+ * are simply reported as unavailable.
+ */
+class Counter
 {
-protected:
-    std::chrono::high_resolution_clock::time_point m_Start, m_Stop;
-    std::chrono::duration<double> m_Duration;
 public:
-    void
-    start(void)
+    enum
     {
-        m_Start = std::chrono::high_resolution_clock::now();
-    }
+        CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES,
+        BRANCH_MISSES, DTLB_MISSES, COUNT
+    };
+protected:
+    int m_Fd[COUNT];
+    double m_Value[COUNT];
+    int m_Error;
 
-    void
-    stop(void)
+#if defined __linux__
+    static int
+    open_event(uint32_t type, uint64_t config)
     {
-        m_Stop = std::chrono::high_resolution_clock::now();
+        perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+            PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
     }
 
-    double
-    time(void)
+    static uint64_t
+    cache_event(uint64_t cache)
     {
-        m_Duration = m_Stop - m_Start;
-        return m_Duration.count();
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
     }
-};
-
-template<class T>
-class Ordered
-{
+#endif
 public:
-    T m_Hold;
-    rb_node m_Node;
-
-    Ordered()
+    Counter()
+        : m_Error(0)
     {
+        for (int i = 0; i < COUNT; ++i)
+        {
+            m_Fd[i] = -1;
+            m_Value[i] = 0;
+        }
     }
 
-    Ordered(const T& val)
-        : m_Hold(val)
+    ~Counter()
     {
+        close_all();
     }
 
-    Ordered(T&& val)
-        : m_Hold(std::move(val))
+    void
+    start(void)
     {
-    }
+        close_all();
+#if defined __linux__
+        static const uint32_t type[COUNT] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+        };
+        static const uint64_t config[COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            cache_event(PERF_COUNT_HW_CACHE_L1D), PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES, cache_event(PERF_COUNT_HW_CACHE_DTLB)
+        };
 
-    static T &
-    convert(const rb_node *conv)
-    {
-        return RB_CONV(Ordered, conv, m_Node)->m_Hold;
+        for (int i = 0; i < COUNT; ++i)
+        {
+            if ((m_Fd[i] = open_event(type[i], config[i])) < 0)
+            {
+                m_Error = errno;
+            }
+        }
+        for (int i = 0; i < COUNT; ++i)
+        {
+            if (m_Fd[i] >= 0)
+            {
+                ioctl(m_Fd[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(m_Fd[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#else
+        m_Error = ENOSYS;
+#endif
     }
-};
-
-template<class T>
-static int
-cmpf(const rb_node *n1, const rb_node *n2, void *args)
-{
-    return Ordered<T>::convert(n1) < Ordered<T>::convert(n2);
-}
-
-template<class T>
-static T
-get_sample(void)
-{
-    static std::default_random_engine e(static_cast<unsigned int>(time(NULL)));
-    static std::uniform_int_distribution<T> gen;
-    return gen(e);
-}
 
-template<class T, class ST, int multi>
-class Suit
-{
-protected:
-    ST m_STL;
-    rb_tree m_RBT;
-    
-    std::vector<T> m_Samples;
-    std::vector<Ordered<T>> m_Ordered;
+    void
+    stop(void)
+    {
+#if defined __linux__
+        for (int i = 0; i < COUNT; ++i)
+        {
+            if (m_Fd[i] >= 0)
+            {
+                ioctl(m_Fd[i], PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+        for (int i = 0; i < COUNT; ++i)
+        {
+            // value, time enabled, time running
+            uint64_t buf[3];
 
-    Timer m_Timer_stl, m_Timer_rbt;
+            if (m_Fd[i] >= 0 && read(m_Fd[i], buf, sizeof(buf)) == sizeof(buf)
+                && buf[2])
+            {
+                // scale up if the kernel had to multiplex the counter
+                m_Value[i] = static_cast<double>(buf[0]) * buf[1] / buf[2];
+            }
+            else if (m_Fd[i] >= 0)
+            {
+                close(m_Fd[i]);
+                m_Fd[i] = -1;
+            }
+        }
+#endif
+    }
 
     void
-    init_sample(const size_t ss)
+    close_all(void)
     {
-        for (size_t i = 0; i < ss; ++i)
+        for (int i = 0; i < COUNT; ++i)
         {
-            m_Samples.push_back(get_sample<T>());
-            m_Ordered.push_back(Ordered<T>(m_Samples[i]));
+#if defined __linux__
+            if (m_Fd[i] >= 0)
+            {
+                close(m_Fd[i]);
+            }
+#endif
+            m_Fd[i] = -1;
+            m_Value[i] = 0;
         }
     }
 
-    void
-    stl_insert(void)
+    int
+    available(int i) const
     {
-        m_Timer_stl.start();
+        return m_Fd[i] >= 0;
+    }
 
-        for (const auto &samples : m_Samples)
+    int
+    any_available(void) const
+    {
+        for (int i = 0; i < COUNT; ++i)
         {
-            m_STL.insert(samples);
+            if (available(i))
+            {
+                return 1;
+            }
         }
 
-        m_Timer_stl.stop();
+        return 0;
+    }
+
+    double
+    value(int i) const
+    {
+        return m_Value[i];
+    }
+
+    const char *
+    error(void) const
+    {
+        return strerror(m_Error);
     }
 
     void
-    stl_erase(void)
+    warn_once(void) const
     {
-        m_Timer_stl.start();
+        static int warned = 0;
 
-        for (const auto &samples : m_Samples)
+        if (!warned)
         {
-            m_STL.erase(samples);
+            warned = 1;
+            printf("  Hardware counters unavailable: %s\n", error());
         }
+    }
 
-        m_Timer_stl.stop();
+    static const char *
+    name(int i)
+    {
+        static const char *names[COUNT] = {
+            "cycles", "instr", "L1d-miss", "LLC-miss", "br-miss", "dTLB-miss"
+        };
+
+        return names[i];
     }
 
     void
-    rbt_insert(void)
+    report(const char *prefix, size_t ops) const
     {
-        m_Timer_rbt.start();
-
-        int succ;
+        printf("  %s/op:", prefix);
 
-        for (auto &ordered : m_Ordered)
+        for (int i = 0; i < COUNT; ++i)
         {
-            rb_insert(&m_RBT, &ordered.m_Node, &succ);
+            if (available(i))
+            {
+                printf(" %s %.2lf", name(i), ops ? value(i) / ops : 0.0);
+            }
+            else
+            {
+                printf(" %s n/a", name(i));
+            }
         }
 
-        m_Timer_rbt.stop();
+        printf("\n");
     }
+};
 
+class Timer
+{
+protected:
+    std::chrono::high_resolution_clock::time_point m_Start, m_Stop;
+    std::chrono::duration<double> m_Duration;
+    Counter m_Counter;
+public:
     void
-    rbt_erase(void)
+    start(void)
     {
-        m_Timer_rbt.start();
-
-        for (const auto &samples : m_Samples)
-        {
-            Ordered<T> val(samples);
+        m_Counter.start();
+        m_Start = std::chrono::high_resolution_clock::now();
+    }
 
-            rb_erase_val(&m_RBT, &val.m_Node);
-        }
+    void
+    stop(void)
+    {
+        m_Stop = std::chrono::high_resolution_clock::now();
+        m_Counter.stop();
+    }
 
-        m_Timer_rbt.stop();
+    const Counter &
+    counter(void) const
+    {
+        return m_Counter;
     }
 
-    void
-    tst_insert(void)
+    double
+    time(void)
     {
-        std::cout << "<insert|insert> Multi: " << multi
-            << ". Sample size: " << sample_size() << std::endl;
+        m_Duration = m_Stop - m_Start;
+        return m_Duration.count();
+    }
+};
 
-        static const std::function<void()> insert_func[] = {
-            [&] { stl_insert(); }, [&] { rbt_insert(); }
-        };
+/*
+ * HDR-style latency histogram. Values below 2 * SUB are recorded
+ * exactly, larger ones in log-linear buckets with SUB sub-buckets
+ * per power of two, i.e. within 1 / SUB relative error.
+ */
+class Histogram
+{
+protected:
+    static constexpr int SUB_BITS = 6;
+    static constexpr uint64_t SUB = 1 << SUB_BITS;
 
-        std::array<std::thread, ARRSZ(insert_func)> thr;
+    std::vector<uint64_t> m_Count;
+    uint64_t m_Total, m_Max;
 
-        for (size_t i = 0; i < thr.size(); ++i)
-        {
-            thr[i] = std::thread(insert_func[i]);
-        }
+    static int
+    msb(uint64_t v)
+    {
+        int r = 0;
 
-        for (auto &th : thr)
+        while (v >>= 1)
         {
-            th.join();
+            ++r;
         }
 
-        finish(validate());
+        return r;
     }
 
-    void
-    tst_erase(void)
+    static size_t
+    index(uint64_t v)
     {
-        std::cout << "<erase|erase_val> Multi: " << multi
-            << ". Current size: " << m_STL.size() << std::endl;
+        if (v < 2 * SUB)
+        {
+            return static_cast<size_t>(v);
+        }
 
-        static const std::function<void()> erase_func[] = {
-            [&] { stl_erase(); }, [&] { rbt_erase(); }
-        };
+        int shift = msb(v) - SUB_BITS;
 
-        std::array<std::thread, ARRSZ(erase_func)> thr;
+        return static_cast<size_t>(shift * SUB + (v >> shift));
+    }
 
-        for (size_t i = 0; i < thr.size(); ++i)
+    static uint64_t
+    value(size_t idx)
+    {
+        if (idx < 2 * SUB)
         {
-            thr[i] = std::thread(erase_func[i]);
+            return idx;
         }
 
-        for (auto &th : thr)
-        {
-            th.join();
-        }
+        int shift = static_cast<int>(idx / SUB) - 1;
 
-        finish(validate());
+        return (idx - shift * SUB) << shift;
+    }
+public:
+    Histogram()
+        : m_Count(index(~0ull) + 1), m_Total(0), m_Max(0)
+    {
     }
 
     void
-    tst_eqrange(void) const
+    record(uint64_t v)
     {
-        for (const auto &samples : m_Samples)
-        {
-            Ordered<T> val(samples);
+        ++m_Count[index(v)];
+        ++m_Total;
 
-            const auto &stl_pr = m_STL.equal_range(samples);
-            rb_pair rbt_pr = rb_eqrange(&m_RBT, &val.m_Node);
-            
-            if (!validate(stl_pr.first, stl_pr.second,
-                rbt_pr.first, rbt_pr.second))
-            {
-                throw std::runtime_error("<equal_range|eqrange> failed");
-            }
+        if (v > m_Max)
+        {
+            m_Max = v;
         }
     }
 
-    void
-    tst_count(void) const
+    uint64_t
+    percentile(double p) const
     {
-        for (const auto &samples : m_Samples)
-        {
-            Ordered<T> val(samples);
+        uint64_t rank = static_cast<uint64_t>(std::ceil(p / 100 * m_Total));
+        uint64_t seen = 0;
 
-            if (!(m_STL.count(samples) == rb_vcnt(&m_RBT, &val.m_Node)))
+        for (size_t i = 0; i < m_Count.size(); ++i)
+        {
+            if ((seen += m_Count[i]) >= rank && seen)
             {
-                throw std::runtime_error("<count|vcnt> failed");
+                return std::min(value(i), m_Max);
             }
         }
+
+        return m_Max;
+    }
+
+    uint64_t
+    max(void) const
+    {
+        return m_Max;
     }
+};
 
+/*
+ * Running mean and standard deviation of repeated trials, with the
+ * half-width of the two-sided 95% confidence interval of the mean.
+ */
+class Summary
+{
+protected:
+    std::vector<double> m_Value;
+public:
     void
-    tst_bound(void) const
+    add(double v)
     {
-        for (const auto &samples : m_Samples)
-        {
-            Ordered<T> val(samples);
+        m_Value.push_back(v);
+    }
 
-            if (!validate(m_STL.lower_bound(samples), m_STL.upper_bound(samples),
-                rb_lbnd(&m_RBT, &val.m_Node), rb_ubnd(&m_RBT, &val.m_Node)))
-            {
-                throw std::runtime_error("<lower_bound|lbnd>, <upper_bound|ubnd> failed");
-            }
-        }
+    size_t
+    count(void) const
+    {
+        return m_Value.size();
     }
 
-    void
-    tst_find(void) const
+    double
+    mean(void) const
     {
-        for (const auto &samples : m_Samples)
-        {
-            Ordered<T> val(samples);
+        double sum = 0;
 
-            if ((m_STL.find(samples) == m_STL.end() &&
-                rb_find(&m_RBT, &val.m_Node) != rb_head(&m_RBT)) ||
-                (*m_STL.find(samples) != Ordered<T>::convert(&val.m_Node)))
-            {
-                throw std::runtime_error("<find|find> failed");
-            }
+        for (double v : m_Value)
+        {
+            sum += v;
         }
+
+        return m_Value.empty() ? 0 : sum / m_Value.size();
     }
 
-    void
-    tst_clear(void)
+    double
+    stddev(void) const
     {
-        m_STL.clear();
-        rb_clear(&m_RBT);
+        double m = mean(), sum = 0;
 
-        if (!validate())
+        for (double v : m_Value)
         {
-            throw std::runtime_error("<clear|clear> failed");
+            sum += (v - m) * (v - m);
         }
+
+        return m_Value.size() < 2 ? 0 : std::sqrt(sum / (m_Value.size() - 1));
     }
 
-    void
-    get_stl_content(typename ST::const_iterator stl_begin,
-        typename ST::const_iterator stl_end,
-        std::stringstream &content) const
+    static double
+    t95(size_t df)
     {
-        content << std::distance(stl_begin, stl_end);
+        static const double table[] = {
+            12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+            2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101,
+            2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052,
+            2.048, 2.045, 2.042
+        };
 
-        for (auto &it = stl_begin; it != stl_end; ++it)
-        {
-            content << *it;
-        }
+        return df == 0 ? 0 : df <= ARRSZ(table) ? table[df - 1] : 1.960;
     }
 
-    void
-    get_rbt_content(const rb_node *rbt_begin, const rb_node *rbt_end,
-        std::stringstream &content) const
+    double
+    ci95(void) const
     {
-        content << rb_dist(&m_RBT, rbt_begin, rbt_end);
+        return m_Value.size() < 2 ? 0 :
+            t95(m_Value.size() - 1) * stddev() / std::sqrt(m_Value.size());
+    }
 
-        for (const rb_node *it = rbt_begin; it != rbt_end; it = rb_next(it))
+    const std::vector<double> &
+    values(void) const
+    {
+        return m_Value;
+    }
+};
+
+/*
+ * Named benchmark metrics, each the values of repeated trials. They are
+ * saved as JSON with one metric per line, which is all that load has
+ * to parse, and compared with Welch's t-test.
+ */
+class Bench
+{
+protected:
+    struct Metric
+    {
+        std::string m_Name;
+        bool m_Lower; // lower is better, e.g. latency
+        Summary m_Summary;
+    };
+
+    std::vector<Metric> m_Metric;
+    unsigned int m_Seed = 0;
+    size_t m_Size = 0;
+
+    const Metric *
+    find(const std::string &name) const
+    {
+        for (const auto &metric : m_Metric)
         {
-            content << Ordered<T>::convert(it);
+            if (metric.m_Name == name)
+            {
+                return &metric;
+            }
         }
+
+        return NULL;
+    }
+public:
+    void
+    add(const std::string &name, bool lower, const Summary &summary)
+    {
+        m_Metric.push_back(Metric{ name, lower, summary });
     }
 
     int
-    validate(typename ST::const_iterator stl_begin,
-        typename ST::const_iterator stl_end,
-        const rb_node *rbt_begin,
-        const rb_node *rbt_end) const
+    save(const char *path, unsigned int seed, size_t size) const
     {
-        std::stringstream stl_con;
-        std::stringstream rbt_con;
+        FILE *fp = fopen(path, "w");
 
-        get_stl_content(stl_begin, stl_end, stl_con);
-        get_rbt_content(rbt_begin, rbt_end, rbt_con);
+        if (!fp)
+        {
+            perror(path);
 
-        return stl_con.str() == rbt_con.str();
+            return 1;
+        }
+
+        fprintf(fp, "{\n  \"seed\": %u,\n  \"size\": %zu,\n  \"metrics\": {\n", seed, size);
+
+        for (size_t i = 0; i < m_Metric.size(); ++i)
+        {
+            const Metric &metric = m_Metric[i];
+
+            fprintf(fp, "    \"%s\": { \"better\": \"%s\", \"samples\": [",
+                metric.m_Name.c_str(), metric.m_Lower ? "lower" : "higher");
+
+            for (size_t j = 0; j < metric.m_Summary.count(); ++j)
+            {
+                fprintf(fp, "%s%.6g", j ? ", " : "", metric.m_Summary.values()[j]);
+            }
+
+            fprintf(fp, "] }%s\n", i + 1 < m_Metric.size() ? "," : "");
+        }
+
+        fprintf(fp, "  }\n}\n");
+
+        return fclose(fp) ? (perror(path), 1) : 0;
     }
 
     int
-    validate(void) const
+    load(const char *path)
     {
-        return validate(m_STL.cbegin(), m_STL.cend(),
-            rb_lmst(&m_RBT), rb_head(&m_RBT));
+        FILE *fp = fopen(path, "r");
+        char line[4096];
+
+        if (!fp)
+        {
+            perror(path);
+
+            return 1;
+        }
+
+        while (fgets(line, sizeof(line), fp))
+        {
+            const char *name = strchr(line, '"');
+            const char *samples = strstr(line, "\"samples\"");
+
+            if (sscanf(line, " \"seed\": %u", &m_Seed) == 1 ||
+                sscanf(line, " \"size\": %zu", &m_Size) == 1)
+            {
+                continue;
+            }
+            if (!name || !samples || !(samples = strchr(samples, '[')))
+            {
+                continue;
+            }
+
+            Metric metric;
+            char *end;
+
+            metric.m_Name.assign(name + 1, strchr(name + 1, '"'));
+            metric.m_Lower = strstr(line, "\"lower\"") != NULL;
+
+            for (double v = strtod(++samples, &end); end != samples; v = strtod(samples, &end))
+            {
+                metric.m_Summary.add(v);
+                samples = end + strspn(end, ", ");
+            }
+
+            m_Metric.push_back(metric);
+        }
+
+        fclose(fp);
+
+        return 0;
     }
 
-    int
-    finish(int succ)
+    /*
+     * A metric regresses when its mean is worse than the baseline by
+     * more than threshold percent, and the difference is significant
+     * at 95% by Welch's t-test. Returns the number of regressions, or
+     * -1 if the runs used a different seed or sample size.
+     */
+    static int
+    compare(const Bench &base, const Bench &cur, double threshold)
     {
-        static const char *result_str[] = { "failed", "success" };
+        int regressions = 0;
 
-        printf("  STL: %lfs, rb: %lfs. Status: %s\n",
-            m_Timer_stl.time(), m_Timer_rbt.time(), result_str[succ]);
+        if (base.m_Seed != cur.m_Seed || base.m_Size != cur.m_Size)
+        {
+            printf("  Seed %u, size %zu against seed %u, size %zu. Status: failed\n",
+                cur.m_Seed, cur.m_Size, base.m_Seed, base.m_Size);
 
-        return succ;
+            return -1;
+        }
+
+        for (const auto &metric : cur.m_Metric)
+        {
+            const Metric *prev = base.find(metric.m_Name);
+
+            if (!prev || prev->m_Summary.count() < 2 || metric.m_Summary.count() < 2)
+            {
+                printf("  %-24s no baseline\n", metric.m_Name.c_str());
+
+                continue;
+            }
+
+            const Summary &b = prev->m_Summary, &c = metric.m_Summary;
+            double vb = b.stddev() * b.stddev() / b.count();
+            double vc = c.stddev() * c.stddev() / c.count();
+            double diff = c.mean() - b.mean();
+            double change = b.mean() ? 100 * diff / b.mean() : 0;
+            double t = vb + vc ? diff / std::sqrt(vb + vc) : diff ? HUGE_VAL : 0;
+            double df = vb + vc ? (vb + vc) * (vb + vc) /
+                (vb * vb / (b.count() - 1) + vc * vc / (c.count() - 1)) : 1;
+            bool significant = std::fabs(t) > Summary::t95(static_cast<size_t>(df < 1 ? 1 : df));
+            bool worse = metric.m_Lower ? change > threshold : -change > threshold;
+
+            regressions += significant && worse;
+
+            printf("  %-24s %12.3lf -> %12.3lf (%+7.2lf%%, t %+.2lf)%s\n",
+                metric.m_Name.c_str(), b.mean(), c.mean(), change, t,
+                significant && worse ? " REGRESSION" : significant ? " changed" : "");
+        }
+
+        return regressions;
     }
+};
+
+/*
+ * Pin the calling thread to one CPU, so that repeated trials are not
+ * disturbed by migrations. Returns 0 when pinning is not supported.
+ */
+static int
+pin_cpu(int cpu)
+{
+#if defined __linux__
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    return 0;
+#endif
+}
+
+template<class T>
+class Ordered
+{
 public:
-    Suit()
+    T m_Hold;
+    rb_node m_Node;
+
+    Ordered()
     {
-        rb_init(&m_RBT, multi, cmpf<T>, NULL);
     }
 
-    Suit(const size_t size)
+    Ordered(const T& val)
+        : m_Hold(val)
     {
-        rb_init(&m_RBT, multi, cmpf<T>, NULL);
+    }
 
-        m_Samples.reserve(size);
-        m_Ordered.reserve(size);
+    Ordered(T&& val)
+        : m_Hold(std::move(val))
+    {
+    }
 
-        init_sample(size);
+    static T &
+    convert(const rb_node *conv)
+    {
+        return RB_CONV(Ordered, conv, m_Node)->m_Hold;
     }
+};
 
-    size_t
-    sample_size(void) const
+template<class T>
+static int
+cmpf(const rb_node *n1, const rb_node *n2, void *args)
+{
+    return Ordered<T>::convert(n1) < Ordered<T>::convert(n2);
+}
+
+template<class T>
+static int
+kcmpf(const rb_node *node, const void *key, void *args)
+{
+    const T &lhs = Ordered<T>::convert(node), &rhs = *static_cast<const T *>(key);
+
+    return lhs < rhs ? -1 : rhs < lhs;
+}
+
+/*
+ * Check the links, the red-black properties and the size of a tree.
+ * Tombstones of lazy erase are part of the structure, so the walk
+ * follows the raw links instead of rb_next.
+ */
+static int
+rb_verify(const rb_tree *rb)
+{
+    const rb_node *head = rb_head(rb);
+    const rb_node *root = head->_parent;
+
+    size_t count = 0, dead = 0, bheight = 0;
+
+    if (root->_isnil)
     {
-        return m_Samples.size();
+        return !rb->size && head->_left == head && head->_right == head;
+    }
+    if (root->_color != _RB_BLACK || root->_parent != head)
+    {
+        return 0;
     }
 
-    int
-    run(void)
+    for (const rb_node *it = head->_left; it != head; )
     {
-        static const std::function<void()> op_func[] = {
-            [&] { tst_eqrange(); }, [&] { tst_count(); },
-            [&] { tst_bound(); }, [&] { tst_find(); }
-        };
+        ++count;
+        dead += it->_isdead;
 
-        try
+        // a chain is a ring back to its key, holding the count of copies
+        if (it->_chained == _RB_CHAIN_KEY)
         {
-            tst_insert();
+            const rb_cnode *key = reinterpret_cast<const rb_cnode *>(it);
+            const rb_node *prev = it;
+            size_t copies = 1;
 
-            std::array<std::thread, ARRSZ(op_func)> thr;
+            for (const rb_node *dup = key->_dups; dup && dup != it; dup = dup->_right)
+            {
+                if (dup->_chained != _RB_CHAIN_DUP || dup->_left != prev || ++copies > key->_count)
+                {
+                    return 0;
+                }
 
-            for (size_t i = 0; i < thr.size(); ++i)
+                prev = dup;
+            }
+            if (copies != key->_count || (key->_dups && key->_dups->_parent != prev))
             {
-                thr[i] = std::thread(op_func[i]);
+                return 0;
             }
 
-            for (auto &th : thr)
+            count += copies - 1;
+        }
+
+        if ((!it->_left->_isnil && it->_left->_parent != it) ||
+            (!it->_right->_isnil && it->_right->_parent != it))
+        {
+            return 0;
+        }
+        if (it->_color == _RB_RED &&
+            (it->_left->_color == _RB_RED || it->_right->_color == _RB_RED))
+        {
+            return 0;
+        }
+        if (it->_left->_isnil || it->_right->_isnil)
+        {
+            size_t blacks = 0;
+
+            for (const rb_node *up = it; !up->_isnil; up = up->_parent)
             {
-                th.join();
+                blacks += up->_color == _RB_BLACK;
             }
-            
-            tst_erase();
-            
-            tst_clear();
+            if (bheight && blacks != bheight)
+            {
+                return 0;
+            }
+
+            bheight = blacks;
         }
-        catch (const std::exception &e)
+        if (count > rb->size + rb_ndead(rb))
         {
-            std::cout << e.what() << std::endl;
+            return 0;
+        }
 
-            return 1;
+        if (!it->_right->_isnil)
+        {
+            for (it = it->_right; !it->_left->_isnil; it = it->_left)
+            {
+            }
         }
+        else
+        {
+            while (!it->_parent->_isnil && it == it->_parent->_right)
+            {
+                it = it->_parent;
+            }
 
-        return 0;
+            it = it->_parent;
+        }
     }
-};
 
-int main(int argc, char **argv)
+    return count == rb->size + dead && dead == rb_ndead(rb) &&
+        head->_left->_left->_isnil && head->_right->_right->_isnil;
+}
+
+// seed of get_sample, fixed by --bench so that runs can be reproduced
+static unsigned int sample_seed = static_cast<unsigned int>(time(NULL));
+
+template<class T>
+static T
+get_sample(void)
 {
-    static constexpr size_t tstc = 1 << 20;
+    static std::default_random_engine e(sample_seed);
+    static std::uniform_int_distribution<T> gen;
+    return gen(e);
+}
 
-    Suit<size_t, std::set<size_t>, 0> s1(tstc);
-    Suit<size_t, std::multiset<size_t>, 1> s2(tstc);
+template<class T, class ST, int multi>
+class Suit
+{
+protected:
+    ST m_STL;
+    rb_tree m_RBT;
+    
+    std::vector<T> m_Samples;
+    std::vector<Ordered<T>> m_Ordered;
+    std::vector<Ordered<T>> m_Extra;
+
+    Timer m_Timer_stl, m_Timer_rbt;
+
+    void
+    init_sample(const size_t ss)
+    {
+        for (size_t i = 0; i < ss; ++i)
+        {
+            m_Samples.push_back(get_sample<T>());
+            m_Ordered.push_back(Ordered<T>(m_Samples[i]));
+        }
+    }
+
+    void
+    stl_insert(void)
+    {
+        m_Timer_stl.start();
+
+        for (const auto &samples : m_Samples)
+        {
+            m_STL.insert(samples);
+        }
+
+        m_Timer_stl.stop();
+    }
+
+    void
+    stl_erase(void)
+    {
+        m_Timer_stl.start();
+
+        for (const auto &samples : m_Samples)
+        {
+            m_STL.erase(samples);
+        }
+
+        m_Timer_stl.stop();
+    }
+
+    void
+    rbt_insert(void)
+    {
+        m_Timer_rbt.start();
+
+        int succ;
+
+        for (auto &ordered : m_Ordered)
+        {
+            rb_insert(&m_RBT, &ordered.m_Node, &succ);
+        }
+
+        m_Timer_rbt.stop();
+    }
+
+    void
+    rbt_erase(void)
+    {
+        m_Timer_rbt.start();
+
+        for (const auto &samples : m_Samples)
+        {
+            Ordered<T> val(samples);
+
+            rb_erase_val(&m_RBT, &val.m_Node);
+        }
+
+        m_Timer_rbt.stop();
+    }
+
+    void
+    tst_insert(void)
+    {
+        std::cout << "<insert|insert> Multi: " << multi
+            << ". Sample size: " << sample_size() << std::endl;
+
+        static const std::function<void()> insert_func[] = {
+            [&] { stl_insert(); }, [&] { rbt_insert(); }
+        };
+
+        std::array<std::thread, ARRSZ(insert_func)> thr;
+
+        for (size_t i = 0; i < thr.size(); ++i)
+        {
+            thr[i] = std::thread(insert_func[i]);
+        }
+
+        for (auto &th : thr)
+        {
+            th.join();
+        }
+
+        finish(validate());
+    }
+
+    void
+    tst_erase(void)
+    {
+        std::cout << "<erase|erase_val> Multi: " << multi
+            << ". Current size: " << m_STL.size() << std::endl;
+
+        static const std::function<void()> erase_func[] = {
+            [&] { stl_erase(); }, [&] { rbt_erase(); }
+        };
+
+        std::array<std::thread, ARRSZ(erase_func)> thr;
+
+        for (size_t i = 0; i < thr.size(); ++i)
+        {
+            thr[i] = std::thread(erase_func[i]);
+        }
+
+        for (auto &th : thr)
+        {
+            th.join();
+        }
+
+        finish(validate());
+    }
+
+    /*
+     * Time rb_erase_key against rb_erase_val on the same samples. The
+     * erased nodes are put back after each pass.
+     */
+    void
+    tst_erase_key(void)
+    {
+        std::vector<T> keys(m_Samples);
+        std::vector<rb_node *> erased;
+        Timer tm_val, tm_key;
+        size_t size = m_RBT.size;
+        int succ = 1, out;
+
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        for (const auto &key : keys)
+        {
+            rb_pair pr = rb_eqrange_key(&m_RBT, &key);
+
+            for (rb_node *node = pr.first; node != pr.second; node = rb_next(node))
+            {
+                erased.push_back(node);
+            }
+        }
+
+        std::cout << "<erase_val|erase_key> Multi: " << multi
+            << ". Erased nodes: " << erased.size() << std::endl;
+
+        auto restore = [&] {
+            succ = succ && m_RBT.size == size - erased.size();
+
+            for (rb_node *node : erased)
+            {
+                rb_insert(&m_RBT, node, &out);
+            }
+        };
+
+        tm_val.start();
+
+        for (const auto &samples : m_Samples)
+        {
+            Ordered<T> val(samples);
+
+            rb_erase_val(&m_RBT, &val.m_Node);
+        }
+
+        tm_val.stop();
+        restore();
+        tm_key.start();
+
+        for (const auto &samples : m_Samples)
+        {
+            rb_erase_key(&m_RBT, &samples);
+        }
+
+        tm_key.stop();
+        restore();
+
+        succ = succ && validate() && rb_verify(&m_RBT);
+
+        printf("  rb erase_val: %lfs, rb erase_key: %lfs. Status: %s\n",
+            tm_val.time(), tm_key.time(), succ ? "success" : "failed");
+
+        if (!succ)
+        {
+            throw std::runtime_error("<erase_val|erase_key> failed");
+        }
+    }
+
+    void
+    tst_eqrange(void) const
+    {
+        for (const auto &samples : m_Samples)
+        {
+            Ordered<T> val(samples);
+
+            const auto &stl_pr = m_STL.equal_range(samples);
+            rb_pair rbt_pr = rb_eqrange(&m_RBT, &val.m_Node);
+            rb_pair key_pr = rb_eqrange_key(&m_RBT, &samples);
+            
+            if (!validate(stl_pr.first, stl_pr.second,
+                rbt_pr.first, rbt_pr.second) ||
+                key_pr.first != rbt_pr.first || key_pr.second != rbt_pr.second)
+            {
+                throw std::runtime_error("<equal_range|eqrange> failed");
+            }
+        }
+    }
+
+    void
+    tst_count(void) const
+    {
+        for (const auto &samples : m_Samples)
+        {
+            Ordered<T> val(samples);
+
+            if (!(m_STL.count(samples) == rb_vcnt(&m_RBT, &val.m_Node)) ||
+                !(m_STL.count(samples) == rb_vcnt_key(&m_RBT, &samples)))
+            {
+                throw std::runtime_error("<count|vcnt> failed");
+            }
+        }
+    }
+
+    void
+    tst_bound(void) const
+    {
+        for (const auto &samples : m_Samples)
+        {
+            Ordered<T> val(samples);
+
+            if (!validate(m_STL.lower_bound(samples), m_STL.upper_bound(samples),
+                rb_lbnd(&m_RBT, &val.m_Node), rb_ubnd(&m_RBT, &val.m_Node)) ||
+                rb_lbnd_key(&m_RBT, &samples) != rb_lbnd(&m_RBT, &val.m_Node) ||
+                rb_ubnd_key(&m_RBT, &samples) != rb_ubnd(&m_RBT, &val.m_Node))
+            {
+                throw std::runtime_error("<lower_bound|lbnd>, <upper_bound|ubnd> failed");
+            }
+        }
+    }
+
+    void
+    tst_find(void) const
+    {
+        for (const auto &samples : m_Samples)
+        {
+            Ordered<T> val(samples);
+
+            if ((m_STL.find(samples) == m_STL.end() &&
+                rb_find(&m_RBT, &val.m_Node) != rb_head(&m_RBT)) ||
+                rb_find_key(&m_RBT, &samples) != rb_find(&m_RBT, &val.m_Node) ||
+                (*m_STL.find(samples) != Ordered<T>::convert(&val.m_Node)))
+            {
+                throw std::runtime_error("<find|find> failed");
+            }
+        }
+    }
+
+    void
+    tst_analyze(void) const
+    {
+        rb_report rep;
+        size_t count = 0;
+        size_t limit = 0;
+
+        rb_analyze(&m_RBT, &rep);
+
+        for (size_t i = 0; i < ARRSZ(rep.depth); ++i)
+        {
+            count += rep.depth[i];
+        }
+        for (size_t n = m_RBT.size + 1; n > 1; n >>= 1)
+        {
+            limit += 2;
+        }
+
+        if (count != m_RBT.size + rep.ndead || rep.height > limit + 2 ||
+            rep.nred >= m_RBT.size || rep.avgpath > rep.height)
+        {
+            throw std::runtime_error("<analyze> failed");
+        }
+
+        printf("  Height: %zu, black height: %zu, red: %zu, avg path: %.2lf, "
+            "line: %.3lf, page: %.3lf\n", rep.height, rep.bheight, rep.nred,
+            rep.avgpath, rep.linescore, rep.pagescore);
+    }
+
+    void
+    tst_extract(void)
+    {
+        const size_t ss = sample_size();
+
+        if (!ss)
+        {
+            return;
+        }
+
+        T lo = std::min(m_Samples[ss / 3], m_Samples[ss / 2]);
+        T hi = std::max(m_Samples[ss / 3], m_Samples[ss / 2]);
+
+        // [lo, hi), [lo, end), [begin, hi) and [begin, end)
+        for (int rg = 0; rg < 4; ++rg)
+        {
+            Ordered<T> vlo(lo), vhi(hi);
+
+            auto stl_begin = rg & 2 ? m_STL.begin() : m_STL.lower_bound(lo);
+            auto stl_end = rg & 1 ? m_STL.end() : m_STL.lower_bound(hi);
+
+            rb_node *rbt_begin = rg & 2 ? rb_lmst(&m_RBT) : rb_lbnd(&m_RBT, &vlo.m_Node);
+            rb_node *rbt_end = rg & 1 ? rb_head(&m_RBT) : rb_lbnd(&m_RBT, &vhi.m_Node);
+
+            std::vector<T> keys(stl_begin, stl_end);
+            rb_node *list, *next;
+
+            m_STL.erase(stl_begin, stl_end);
+
+            size_t cnt = rb_extract_range(&m_RBT, rbt_begin, rbt_end, &list);
+            size_t idx = 0;
+
+            for (rb_node *it = list; it; it = it->_right, ++idx)
+            {
+                if (idx >= keys.size() || Ordered<T>::convert(it) != keys[idx])
+                {
+                    throw std::runtime_error("<erase|extract_range> wrong list");
+                }
+            }
+            if (cnt != keys.size() || idx != cnt || !validate() || !rb_verify(&m_RBT))
+            {
+                throw std::runtime_error("<erase|extract_range> failed");
+            }
+
+            for (rb_node *it = list; it; it = next)
+            {
+                int succ;
+
+                next = it->_right;
+                rb_insert(&m_RBT, it, &succ);
+            }
+
+            m_STL.insert(keys.begin(), keys.end());
+
+            if (!validate() || !rb_verify(&m_RBT))
+            {
+                throw std::runtime_error("<insert|insert> after extract_range failed");
+            }
+        }
+    }
+
+    void
+    tst_lazy(void)
+    {
+        const size_t ss = sample_size();
+        rb_node *list;
+
+        rb_set_lazy(&m_RBT, 1);
+
+        // enough tombstones for a rebuild first, then a few for a sweep
+        for (size_t step : { 2, 61 })
+        {
+            for (size_t i = 0; i < ss; i += step)
+            {
+                Ordered<T> val(m_Samples[i]);
+
+                if (m_STL.erase(m_Samples[i]) != rb_erase_val(&m_RBT, &val.m_Node))
+                {
+                    throw std::runtime_error("<erase|lazy erase_val> failed");
+                }
+            }
+
+            // reinsert some keys over their tombstones
+            for (size_t i = 0; i < ss; i += 4 * step)
+            {
+                int succ;
+
+                m_Extra.push_back(Ordered<T>(m_Samples[i]));
+                rb_insert(&m_RBT, &m_Extra.back().m_Node, &succ);
+                m_STL.insert(m_Samples[i]);
+            }
+
+            for (const auto &samples : m_Samples)
+            {
+                Ordered<T> val(samples);
+
+                auto stl_lb = m_STL.lower_bound(samples);
+                rb_node *rbt_lb = rb_lbnd(&m_RBT, &val.m_Node);
+
+                if ((m_STL.find(samples) == m_STL.end()) !=
+                    (rb_find(&m_RBT, &val.m_Node) == rb_head(&m_RBT)) ||
+                    (stl_lb == m_STL.end()) != (rbt_lb == rb_head(&m_RBT)) ||
+                    (stl_lb != m_STL.end() && *stl_lb != Ordered<T>::convert(rbt_lb)) ||
+                    m_STL.count(samples) != rb_vcnt(&m_RBT, &val.m_Node))
+                {
+                    throw std::runtime_error("<find|lazy find> failed");
+                }
+            }
+
+            size_t dead = rb_ndead(&m_RBT);
+            size_t cnt = 0;
+
+            if (!validate() || !rb_verify(&m_RBT) || !dead)
+            {
+                throw std::runtime_error("<erase|lazy erase> failed");
+            }
+
+            if (rb_compact(&m_RBT, &list) != dead)
+            {
+                throw std::runtime_error("<compact> wrong count");
+            }
+            for (rb_node *it = list; it; it = it->_right)
+            {
+                cnt += it->_isdead;
+            }
+            if (cnt != dead || rb_ndead(&m_RBT) || !validate() || !rb_verify(&m_RBT))
+            {
+                throw std::runtime_error("<compact> failed");
+            }
+        }
+
+        rb_set_lazy(&m_RBT, 0);
+    }
+
+    void
+    tst_merge(void)
+    {
+        const size_t ss = sample_size();
+
+        // a small source takes the hinted insertion, a large one the
+        // linear merge
+        for (size_t step : { 64, 2 })
+        {
+            rb_tree src;
+            ST stl_src;
+            size_t idx = 0;
+            int succ;
+
+            rb_init(&src, multi, cmpf<T>, NULL);
+
+            for (rb_node *it = rb_lmst(&m_RBT); it != rb_head(&m_RBT); ++idx)
+            {
+                if (idx % step)
+                {
+                    it = rb_next(it);
+                    continue;
+                }
+
+                rb_node *next = rb_erase(&m_RBT, it);
+
+                m_STL.erase(m_STL.find(Ordered<T>::convert(it)));
+                stl_src.insert(Ordered<T>::convert(it));
+                rb_insert(&src, it, &succ);
+
+                it = next;
+            }
+            for (size_t i = 0; i < ss; i += 4 * step)
+            {
+                m_Extra.push_back(Ordered<T>(m_Samples[i]));
+                rb_insert(&src, &m_Extra.back().m_Node, &succ);
+
+                if (succ)
+                {
+                    stl_src.insert(m_Samples[i]);
+                }
+            }
+
+            size_t moved = 0;
+
+            for (auto it = stl_src.begin(); it != stl_src.end(); )
+            {
+                if (multi || !m_STL.count(*it))
+                {
+                    m_STL.insert(*it);
+                    it = stl_src.erase(it);
+                    ++moved;
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+
+            std::stringstream stl_con, rbt_con;
+
+            if (rb_merge(&m_RBT, &src) != moved || !validate() ||
+                !rb_verify(&m_RBT) || !rb_verify(&src))
+            {
+                throw std::runtime_error("<merge|merge> failed");
+            }
+
+            get_stl_content(stl_src.cbegin(), stl_src.cend(), stl_con);
+            rbt_con << src.size;
+
+            for (rb_node *it = rb_lmst(&src); it != rb_head(&src); it = rb_next(it))
+            {
+                rbt_con << Ordered<T>::convert(it);
+            }
+            if (stl_con.str() != rbt_con.str())
+            {
+                throw std::runtime_error("<merge|merge> wrong leftover");
+            }
+        }
+    }
+
+    /*
+     * Benchmark small key changes: STL and rb_tree erase + insert
+     * against rb_update. Most changes keep the node between its
+     * neighbours.
+     */
+    void
+    tst_update(void)
+    {
+        std::vector<rb_node *> nodes;
+        Timer tm_update;
+        int succ;
+
+        const T delta = std::numeric_limits<T>::max() / (4 * (m_RBT.size + 1));
+
+        for (rb_node *it = rb_lmst(&m_RBT); it != rb_head(&m_RBT); it = rb_next(it))
+        {
+            nodes.push_back(it);
+        }
+
+        std::cout << "<erase+insert|erase+insert, update> Multi: " << multi
+            << ". Current size: " << m_STL.size() << std::endl;
+
+        m_Timer_stl.start();
+
+        for (rb_node *node : nodes)
+        {
+            const T &key = Ordered<T>::convert(node);
+
+            m_STL.erase(m_STL.find(key));
+            m_STL.insert(key + delta);
+        }
+
+        m_Timer_stl.stop();
+        m_Timer_rbt.start();
+
+        for (rb_node *node : nodes)
+        {
+            rb_erase(&m_RBT, node);
+            Ordered<T>::convert(node) += delta;
+            rb_insert(&m_RBT, node, &succ);
+
+            if (!succ)
+            {
+                throw std::runtime_error("<erase+insert> key collision");
+            }
+        }
+
+        m_Timer_rbt.stop();
+
+        int succ_ei = validate();
+
+        for (rb_node *node : nodes)
+        {
+            const T &key = Ordered<T>::convert(node);
+
+            m_STL.erase(m_STL.find(key));
+            m_STL.insert(key - delta);
+        }
+
+        tm_update.start();
+
+        for (rb_node *node : nodes)
+        {
+            Ordered<T>::convert(node) -= delta;
+            rb_update(&m_RBT, node, &succ);
+
+            if (!succ)
+            {
+                throw std::runtime_error("<update> key collision");
+            }
+        }
+
+        tm_update.stop();
+
+        int succ_up = validate() && rb_verify(&m_RBT);
+
+        printf("  STL: %lfs, rb: %lfs, rb update: %lfs. Status: %s\n",
+            m_Timer_stl.time(), m_Timer_rbt.time(), tm_update.time(),
+            succ_ei && succ_up ? "success" : "failed");
+
+        report(m_Timer_stl.counter(), tm_update.counter());
+
+        if (!succ_ei || !succ_up)
+        {
+            throw std::runtime_error("<erase+insert|update> failed");
+        }
+    }
+
+    /*
+     * Benchmark a correlated lookup stream: keys in ascending order,
+     * each jittered by a few ranks. rb_lbnd_from starts from the
+     * previous result. rb_ubnd_from and rb_find_from are checked on
+     * the same stream, from the head and from the rightmost node.
+     */
+    void
+    tst_finger(void)
+    {
+        std::vector<T> keys(m_STL.begin(), m_STL.end());
+        std::vector<Ordered<T>> probes;
+        std::default_random_engine e(1);
+        std::uniform_int_distribution<int> jitter(-8, 8);
+        Timer tm_finger;
+
+        if (keys.empty())
+        {
+            return;
+        }
+
+        probes.reserve(keys.size());
+
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            long j = static_cast<long>(i) + jitter(e);
+
+            j = std::max(0l, std::min(j, static_cast<long>(keys.size()) - 1));
+            probes.push_back(Ordered<T>(keys[j]));
+        }
+
+        std::vector<typename ST::const_iterator> stl_res(probes.size());
+        std::vector<rb_node *> rbt_res(probes.size()), fgr_res(probes.size());
+
+        std::cout << "<lower_bound|lbnd, lbnd_from> Multi: " << multi
+            << ". Correlated lookups: " << probes.size() << std::endl;
+
+        m_Timer_stl.start();
+
+        for (size_t i = 0; i < probes.size(); ++i)
+        {
+            stl_res[i] = m_STL.lower_bound(probes[i].m_Hold);
+        }
+
+        m_Timer_stl.stop();
+        m_Timer_rbt.start();
+
+        for (size_t i = 0; i < probes.size(); ++i)
+        {
+            rbt_res[i] = rb_lbnd(&m_RBT, &probes[i].m_Node);
+        }
+
+        m_Timer_rbt.stop();
+        tm_finger.start();
+
+        const rb_node *finger = rb_head(&m_RBT);
+
+        for (size_t i = 0; i < probes.size(); ++i)
+        {
+            finger = fgr_res[i] = rb_lbnd_from(&m_RBT, finger, &probes[i].m_Node);
+        }
+
+        tm_finger.stop();
+
+        int succ = 1;
+
+        for (size_t i = 0; i < probes.size() && succ; ++i)
+        {
+            succ = rbt_res[i] == fgr_res[i] && *stl_res[i] == Ordered<T>::convert(rbt_res[i]);
+        }
+
+        // the other finger searches on the same probes, from either end
+        for (const rb_node *start : { rb_head(&m_RBT), rb_rmst(&m_RBT) })
+        {
+            const rb_node *ubnd = start, *find = start;
+
+            for (size_t i = 0; i < probes.size() && succ; ++i)
+            {
+                ubnd = rb_ubnd_from(&m_RBT, ubnd, &probes[i].m_Node);
+                find = rb_find_from(&m_RBT, find, &probes[i].m_Node);
+
+                succ = ubnd == rb_ubnd(&m_RBT, &probes[i].m_Node) &&
+                    find == rb_find(&m_RBT, &probes[i].m_Node);
+            }
+        }
+
+        printf("  STL: %lfs, rb: %lfs, rb finger: %lfs. Status: %s\n",
+            m_Timer_stl.time(), m_Timer_rbt.time(), tm_finger.time(),
+            succ ? "success" : "failed");
+
+        report(m_Timer_stl.counter(), tm_finger.counter());
+
+        if (!succ)
+        {
+            throw std::runtime_error("<lower_bound|lbnd_from> failed");
+        }
+    }
+
+    /*
+     * Benchmark rb::set/rb::multiset against the STL container, with
+     * the same samples on fresh containers of both.
+     */
+    void
+    tst_cpp(void)
+    {
+        typedef typename std::conditional<multi,
+            rb::multiset<T>, rb::set<T>>::type RT;
+
+        ST stl;
+        RT rbt;
+        size_t stl_hit = 0, rbt_hit = 0;
+
+        std::cout << "<insert, find, erase|rb::" << (multi ? "multiset" : "set")
+            << "> Multi: " << multi << ". Sample size: " << sample_size() << std::endl;
+
+        m_Timer_stl.start();
+
+        for (const auto &samples : m_Samples)
+        {
+            stl.insert(samples);
+        }
+        for (const auto &samples : m_Samples)
+        {
+            stl_hit += stl.find(samples) != stl.end();
+        }
+
+        m_Timer_stl.stop();
+        m_Timer_rbt.start();
+
+        for (const auto &samples : m_Samples)
+        {
+            rbt.insert(samples);
+        }
+        for (const auto &samples : m_Samples)
+        {
+            rbt_hit += rbt.find(samples) != rbt.end();
+        }
+
+        m_Timer_rbt.stop();
+
+        int succ = stl_hit == rbt_hit && stl.size() == rbt.size() &&
+            std::equal(stl.begin(), stl.end(), rbt.begin()) && rb_verify(rbt.native());
+
+        m_Timer_stl.start();
+
+        for (const auto &samples : m_Samples)
+        {
+            stl.erase(samples);
+        }
+
+        m_Timer_stl.stop();
+        m_Timer_rbt.start();
+
+        for (const auto &samples : m_Samples)
+        {
+            rbt.erase(samples);
+        }
+
+        m_Timer_rbt.stop();
+
+        if (!finish(succ && stl.empty() && rbt.empty()))
+        {
+            throw std::runtime_error("<rb::set> failed");
+        }
+    }
+
+    void
+    tst_clear(void)
+    {
+        m_STL.clear();
+        rb_clear(&m_RBT);
+
+        if (!validate())
+        {
+            throw std::runtime_error("<clear|clear> failed");
+        }
+    }
+
+    void
+    get_stl_content(typename ST::const_iterator stl_begin,
+        typename ST::const_iterator stl_end,
+        std::stringstream &content) const
+    {
+        content << std::distance(stl_begin, stl_end);
+
+        for (auto &it = stl_begin; it != stl_end; ++it)
+        {
+            content << *it;
+        }
+    }
+
+    void
+    get_rbt_content(const rb_node *rbt_begin, const rb_node *rbt_end,
+        std::stringstream &content) const
+    {
+        content << rb_dist(&m_RBT, rbt_begin, rbt_end);
+
+        for (const rb_node *it = rbt_begin; it != rbt_end; it = rb_next(it))
+        {
+            content << Ordered<T>::convert(it);
+        }
+    }
+
+    int
+    validate(typename ST::const_iterator stl_begin,
+        typename ST::const_iterator stl_end,
+        const rb_node *rbt_begin,
+        const rb_node *rbt_end) const
+    {
+        std::stringstream stl_con;
+        std::stringstream rbt_con;
+
+        get_stl_content(stl_begin, stl_end, stl_con);
+        get_rbt_content(rbt_begin, rbt_end, rbt_con);
+
+        return stl_con.str() == rbt_con.str();
+    }
+
+    int
+    validate(void) const
+    {
+        return validate(m_STL.cbegin(), m_STL.cend(),
+            rb_lmst(&m_RBT), rb_head(&m_RBT));
+    }
+
+    void
+    report(const Counter &stl, const Counter &rbt) const
+    {
+        if (stl.any_available() || rbt.any_available())
+        {
+            stl.report("STL", sample_size());
+            rbt.report("rb", sample_size());
+        }
+        else
+        {
+            rbt.warn_once();
+        }
+    }
+
+    void
+    report_stats(void)
+    {
+#if defined _RB_STATS
+        rb_stats st;
+        double ops = sample_size() ? static_cast<double>(sample_size()) : 1;
+
+        rb_get_stats(&m_RBT, &st);
+        rb_reset_stats(&m_RBT);
+
+        printf("  rb stats/op: comps %.2lf rotl %.2lf rotr %.2lf insfix %.2lf "
+            "erasefix %.2lf depth %.2lf climbs %.2lf\n",
+            st.comps / ops, st.rotls / ops, st.rotrs / ops, st.insfix / ops,
+            st.erasefix / ops, st.descents ? st.depth / (double)st.descents : 0.0,
+            st.climbs / ops);
+#endif
+    }
+
+    int
+    finish(int succ)
+    {
+        static const char *result_str[] = { "failed", "success" };
+
+        printf("  STL: %lfs, rb: %lfs. Status: %s\n",
+            m_Timer_stl.time(), m_Timer_rbt.time(), result_str[succ]);
+
+        report(m_Timer_stl.counter(), m_Timer_rbt.counter());
+        report_stats();
+
+        return succ;
+    }
+public:
+    Suit()
+    {
+        rb_init(&m_RBT, multi, cmpf<T>, NULL);
+        rb_set_keycomp(&m_RBT, kcmpf<T>);
+    }
+
+    Suit(const size_t size)
+    {
+        rb_init(&m_RBT, multi, cmpf<T>, NULL);
+        rb_set_keycomp(&m_RBT, kcmpf<T>);
+
+        m_Samples.reserve(size);
+        m_Ordered.reserve(size);
+        m_Extra.reserve(size);
+
+        init_sample(size);
+    }
+
+    size_t
+    sample_size(void) const
+    {
+        return m_Samples.size();
+    }
+
+    /*
+     * Per-operation latency benchmark. STL and rb_tree run one after
+     * another on a pinned CPU. The first trial only warms up caches
+     * and the allocator, the others are summarized, and added to
+     * bench for rb_tree when given.
+     */
+    int
+    latency(size_t trials, Bench *bench = NULL)
+    {
+        enum { INSERT, FIND, ERASE, NOPS };
+        enum { P50, P99, P999, MAX, MOPS, NSTATS };
+
+        static const char *op_str[NOPS] = { "insert", "find", "erase" };
+        static const char *lib_str[2] = { "STL", "rb" };
+        static const double pct[MAX] = { 50, 99, 99.9 };
+
+        Summary summary[2][NOPS][NSTATS];
+        volatile size_t sink = 0;
+        int succ;
+
+        int pinned = pin_cpu(0);
+
+        std::cout << "<latency> Multi: " << multi << ". Sample size: "
+            << sample_size() << ". Trials: " << trials << " (+1 warm-up). Pinned: "
+            << (pinned ? "cpu 0" : "no") << std::endl;
+
+        for (size_t trial = 0; trial <= trials; ++trial)
+        {
+            for (int lib = 0; lib < 2; ++lib)
+            {
+                Histogram hist[NOPS];
+                double secs[NOPS];
+
+                for (int op = 0; op < NOPS; ++op)
+                {
+                    auto begin = std::chrono::steady_clock::now();
+
+                    for (size_t i = 0; i < sample_size(); ++i)
+                    {
+                        auto start = std::chrono::steady_clock::now();
+
+                        if (lib == 0)
+                        {
+                            if (op == INSERT)
+                            {
+                                m_STL.insert(m_Samples[i]);
+                            }
+                            else if (op == FIND)
+                            {
+                                sink += m_STL.find(m_Samples[i]) != m_STL.end();
+                            }
+                            else
+                            {
+                                m_STL.erase(m_Samples[i]);
+                            }
+                        }
+                        else
+                        {
+                            Ordered<T> val(m_Samples[i]);
+
+                            if (op == INSERT)
+                            {
+                                rb_insert(&m_RBT, &m_Ordered[i].m_Node, &succ);
+                            }
+                            else if (op == FIND)
+                            {
+                                sink += rb_find(&m_RBT, &val.m_Node) != rb_head(&m_RBT);
+                            }
+                            else
+                            {
+                                rb_erase_val(&m_RBT, &val.m_Node);
+                            }
+                        }
+
+                        auto stop = std::chrono::steady_clock::now();
+
+                        hist[op].record(static_cast<uint64_t>(
+                            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                stop - start).count()));
+                    }
+
+                    secs[op] = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - begin).count();
+                }
+
+                if (!validate())
+                {
+                    std::cout << "  " << lib_str[lib] << " not empty after erase" << std::endl;
+
+                    return 1;
+                }
+
+                for (int op = 0; op < NOPS && trial; ++op)
+                {
+                    for (int st = 0; st < MAX; ++st)
+                    {
+                        summary[lib][op][st].add(static_cast<double>(hist[op].percentile(pct[st])));
+                    }
+
+                    summary[lib][op][MAX].add(static_cast<double>(hist[op].max()));
+                    summary[lib][op][MOPS].add(sample_size() / secs[op] / 1e6);
+                }
+            }
+        }
+
+        for (int op = 0; op < NOPS; ++op)
+        {
+            for (int lib = 0; lib < 2; ++lib)
+            {
+                const Summary *sm = summary[lib][op];
+
+                printf("  %-6s %-3s: p50 %.0lf+-%.0lfns, p99 %.0lf+-%.0lfns, "
+                    "p99.9 %.0lf+-%.0lfns, max %.0lf+-%.0lfns, %.3lf+-%.3lf Mops/s\n",
+                    op_str[op], lib_str[lib],
+                    sm[P50].mean(), sm[P50].ci95(), sm[P99].mean(), sm[P99].ci95(),
+                    sm[P999].mean(), sm[P999].ci95(), sm[MAX].mean(), sm[MAX].ci95(),
+                    sm[MOPS].mean(), sm[MOPS].ci95());
+            }
+
+            // max is left out, it mostly measures interrupts
+            for (int st = 0; st < NSTATS && bench; st += st == P999 ? 2 : 1)
+            {
+                static const char *stat_str[NSTATS] = { "p50", "p99", "p99.9", "max", "mops" };
+
+                bench->add(std::string(multi ? "multiset." : "set.") + op_str[op] + "." +
+                    stat_str[st], st != MOPS, summary[1][op][st]);
+            }
+        }
+
+        return 0;
+    }
+
+    int
+    run(void)
+    {
+        static const std::function<void()> op_func[] = {
+            [&] { tst_eqrange(); }, [&] { tst_count(); },
+            [&] { tst_bound(); }, [&] { tst_find(); }
+        };
+
+        try
+        {
+            tst_insert();
+
+            tst_analyze();
+
+            std::array<std::thread, ARRSZ(op_func)> thr;
+
+            for (size_t i = 0; i < thr.size(); ++i)
+            {
+                thr[i] = std::thread(op_func[i]);
+            }
+
+            for (auto &th : thr)
+            {
+                th.join();
+            }
+
+            tst_extract();
+
+            tst_lazy();
+
+            tst_merge();
+
+            tst_update();
+
+            tst_finger();
+
+            tst_cpp();
+
+            tst_erase_key();
+
+            tst_erase();
+            
+            tst_clear();
+        }
+        catch (const std::exception &e)
+        {
+            std::cout << e.what() << std::endl;
+
+            return 1;
+        }
+
+        return 0;
+    }
+};
+
+// transparent comparator, std::less<> needs C++14
+struct StrLess
+{
+    typedef void is_transparent;
+
+    bool operator()(const std::string &a, const std::string &b) const { return a < b; }
+    bool operator()(const std::string &a, const char *b) const { return a < b; }
+    bool operator()(const char *a, const std::string &b) const { return a < b; }
+};
+
+/*
+ * Check the parts of rbtree.hpp that the benchmarks do not use: maps,
+ * hints, node handles, heterogeneous lookup, merge, copy and move.
+ */
+static int
+tst_containers(void)
+{
+    std::cout << "<rb::set, rb::map> Interface" << std::endl;
+
+    rb::map<std::string, int, StrLess> map;
+    rb::multimap<int, std::string> mmap;
+    rb::multiset<int> mset = { 5, 1, 3, 3, 9 };
+    rb::set<int> set;
+    int succ = 1;
+
+    for (int i = 0; i < 64; ++i)
+    {
+        map[std::to_string(i)] = i;
+        mmap.emplace(i % 4, std::to_string(i));
+        set.emplace_hint(set.end(), i * 2);
+    }
+
+    // heterogeneous lookup, no std::string is built
+    succ &= map.find("42")->second == 42 && map.count("x") == 0 && map.contains("7");
+    succ &= !map.try_emplace("42", -1).second && map.at("42") == 42;
+    succ &= map.insert_or_assign("42", 7).first->second == 7;
+    succ &= mmap.count(1) == 16 && mmap.equal_range(3).first->second == "3";
+    succ &= mset.count(3) == 2 && *mset.begin() == 1 && *mset.rbegin() == 9;
+    succ &= *set.insert(set.find(10), 9) == 9 && !set.insert(10).second;
+
+    // node handles move nodes without copying the value
+    auto nh = map.extract("42");
+    const std::string *key = &nh.key();
+
+    nh.key() = "x";
+    succ &= !map.contains("42") && map.insert(std::move(nh)).inserted && &map.find("x")->first == key;
+
+    auto nh2 = set.extract(10);
+    nh2.value() = 9;
+    auto ret = set.insert(std::move(nh2));
+    succ &= !ret.inserted && !ret.node.empty() && *ret.position == 9;
+
+    // merge leaves the duplicate in the source
+    rb::set<int> other = { 1, 2, 3 };
+    set.merge(other);
+    succ &= other.size() == 1 && *other.begin() == 2 && set.contains(1) && set.contains(3);
+
+    rb::map<std::string, int, StrLess> copy(map), moved(std::move(copy));
+    succ &= copy.empty() && moved == map && moved.size() == 64;
+    copy = moved;
+    succ &= copy == map;
+
+    // moves take the header, the source gets a new one when it is filled
+    static_assert(std::is_nothrow_move_constructible<rb::set<int>>::value &&
+        std::is_nothrow_move_assignable<rb::map<std::string, int, StrLess>>::value, "move");
+    copy = std::move(moved);
+    succ &= moved.empty() && moved.begin() == moved.end() && copy == map;
+    moved.emplace_hint(moved.end(), "1", 1);
+    succ &= moved.try_emplace("0", 0).second && moved.size() == 2 && rb_verify(moved.native());
+
+    for (auto it = set.begin(); it != set.end(); )
+    {
+        it = *it % 3 ? set.erase(it) : std::next(it);
+    }
+    succ &= std::all_of(set.begin(), set.end(), [](int v) { return v % 3 == 0; });
+    succ &= rb_verify(map.native()) && rb_verify(mmap.native()) && rb_verify(set.native());
+
+    printf("  Status: %s\n", succ ? "success" : "failed");
+
+    return !succ;
+}
+
+static const void *
+skeyf(const rb_node *node, size_t *len, void *args)
+{
+    const std::string &key = Ordered<std::string>::convert(node);
+
+    *len = key.size();
+    return key.data();
+}
+
+/*
+ * Benchmark string lookups on keys with a long shared prefix, through
+ * the comparator with a node built per lookup and through rb_find_str.
+ */
+static int
+tst_strkey(size_t size)
+{
+    std::vector<Ordered<std::string>> nodes;
+    std::vector<std::string> probes;
+    std::default_random_engine e(1);
+    rb_tree tr;
+    Timer tm_node, tm_str;
+    size_t hit_node = 0, hit_str = 0;
+    int succ = 1;
+
+    rb_init(&tr, 0, cmpf<std::string>, NULL);
+    rb_set_strkey(&tr, skeyf);
+
+    nodes.reserve(size);
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        std::string id = std::to_string(e());
+
+        nodes.push_back(Ordered<std::string>(
+            "https://example.com/static/assets/images/thumbnails/" + id));
+        probes.push_back(nodes.back().m_Hold + (i % 4 ? "" : "/"));
+    }
+    for (auto &node : nodes)
+    {
+        rb_insert(&tr, &node.m_Node, &succ);
+    }
+
+    std::cout << "<find|find_str> Shared prefix: " << nodes[0].m_Hold.rfind('/') + 1
+        << ". Size: " << tr.size << std::endl;
+
+    tm_node.start();
+
+    for (const auto &probe : probes)
+    {
+        Ordered<std::string> val(probe);
+
+        hit_node += rb_find(&tr, &val.m_Node) != rb_head(&tr);
+    }
+
+    tm_node.stop();
+    tm_str.start();
+
+    for (const auto &probe : probes)
+    {
+        hit_str += rb_find_str(&tr, probe.data(), probe.size()) != rb_head(&tr);
+    }
+
+    tm_str.stop();
+
+    for (size_t i = 0; i < probes.size() && succ; i += 7)
+    {
+        Ordered<std::string> val(probes[i]);
+
+        succ = rb_lbnd_str(&tr, probes[i].data(), probes[i].size()) == rb_lbnd(&tr, &val.m_Node) &&
+            rb_ubnd_str(&tr, probes[i].data(), probes[i].size()) == rb_ubnd(&tr, &val.m_Node);
+    }
+
+    succ &= hit_node == hit_str;
+
+    printf("  rb: %lfs, rb str: %lfs. Status: %s\n",
+        tm_node.time(), tm_str.time(), succ ? "success" : "failed");
+
+    return !succ;
+}
+
+struct Prefixed
+{
+    std::string m_Hold;
+    rb_pnode m_Node;
+
+    Prefixed(const std::string &val)
+        : m_Hold(val)
+    {
+        m_Node.prefix = rb_prefix_str(val.data(), val.size());
+    }
+
+    static const std::string &
+    convert(const rb_node *conv)
+    {
+        return RB_CONV(Prefixed, conv, m_Node._node)->m_Hold;
+    }
+};
+
+static int
+pcmpf(const rb_node *n1, const rb_node *n2, void *args)
+{
+    return Prefixed::convert(n1) < Prefixed::convert(n2);
+}
+
+/*
+ * Benchmark string lookups with and without an inline key prefix. The
+ * probes are prebuilt, so only the searches are timed.
+ */
+static int
+tst_prefix(size_t size)
+{
+    std::vector<Ordered<std::string>> nodes, nprobes;
+    std::vector<Prefixed> pnodes, pprobes;
+    std::default_random_engine e(2);
+    rb_tree tr, ptr;
+    Timer tm_node, tm_pfx;
+    int succ = 1;
+
+    rb_init(&tr, 0, cmpf<std::string>, NULL);
+    rb_init(&ptr, 0, pcmpf, NULL);
+    rb_set_prefix(&ptr, 1);
+
+    nodes.reserve(size), nprobes.reserve(size);
+    pnodes.reserve(size), pprobes.reserve(size);
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        std::string key = std::to_string(e()) + std::to_string(e());
+
+        nodes.push_back(Ordered<std::string>(key));
+        pnodes.push_back(Prefixed(key));
+    }
+    for (size_t i = 0; i < size; ++i)
+    {
+        rb_insert(&tr, &nodes[i].m_Node, &succ);
+        rb_insert(&ptr, &pnodes[i].m_Node._node, &succ);
+
+        nprobes.push_back(nodes[(i * 7919) % size].m_Hold);
+        pprobes.push_back(Prefixed(nprobes.back().m_Hold));
+    }
+
+    std::cout << "<find|find prefixed> Size: " << tr.size << std::endl;
+
+    std::vector<rb_node *> nres(size), pres(size);
+
+    tm_node.start();
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        nres[i] = rb_find(&tr, &nprobes[i].m_Node);
+    }
+
+    tm_node.stop();
+    tm_pfx.start();
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        pres[i] = rb_find(&ptr, &pprobes[i].m_Node._node);
+    }
+
+    tm_pfx.stop();
+
+    succ = tr.size == ptr.size && rb_verify(&ptr);
+
+    for (size_t i = 0; i < size && succ; ++i)
+    {
+        succ = nres[i] != rb_head(&tr) && pres[i] != rb_head(&ptr) &&
+            Ordered<std::string>::convert(nres[i]) == Prefixed::convert(pres[i]);
+    }
+
+    printf("  rb: %lfs, rb prefixed: %lfs. Status: %s\n",
+        tm_node.time(), tm_pfx.time(), succ ? "success" : "failed");
+
+    return !succ;
+}
+
+static int
+icmpf(uint32_t a, uint32_t b, void *args)
+{
+    const uint32_t *keys = static_cast<const uint32_t *>(args);
+
+    return keys[a] < keys[b];
+}
+
+/*
+ * Check the links, colours and black heights of an index tree, the
+ * same way as rb_verify.
+ */
+static int
+rbi_verify(const rbi_tree *rb)
+{
+    const uint32_t black = 0x80000000;
+    size_t count = 0, bheight = 0;
+
+    if (rb->_root == RBI_NIL)
+    {
+        return !rb->size && rb->_lmst == RBI_NIL && rb->_rmst == RBI_NIL;
+    }
+    if (!(rb->_base[rb->_root]._parent & black))
+    {
+        return 0;
+    }
+
+    for (uint32_t it = rbi_lmst(rb); it != RBI_NIL; it = rbi_next(rb, it), ++count)
+    {
+        const rbi_node &node = rb->_base[it];
+
+        for (uint32_t child : { node._left, node._right })
+        {
+            if (child != RBI_NIL && ((rb->_base[child]._parent & ~black) != it ||
+                (!(node._parent & black) && !(rb->_base[child]._parent & black))))
+            {
+                return 0;
+            }
+        }
+        if (node._left == RBI_NIL || node._right == RBI_NIL)
+        {
+            size_t blacks = 0;
+
+            for (uint32_t up = it; up != RBI_NIL; up = rb->_base[up]._parent & ~black)
+            {
+                blacks += !!(rb->_base[up]._parent & black);
+            }
+            if (bheight && blacks != bheight)
+            {
+                return 0;
+            }
+
+            bheight = blacks;
+        }
+        if (count > rb->size)
+        {
+            return 0;
+        }
+    }
+
+    return count == rb->size && rbi_prev(rb, RBI_NIL) == rb->_rmst;
+}
+
+/*
+ * Benchmark the index tree against rb_tree and the STL container on
+ * 32-bit keys, and check its results against the latter.
+ */
+template<class ST, int multi>
+static int
+tst_index(size_t size)
+{
+    std::vector<uint32_t> keys(size + 1);
+    std::vector<rbi_node> nodes(size + 1);
+    std::vector<Ordered<uint32_t>> ordered;
+    std::default_random_engine e(3);
+    std::uniform_int_distribution<uint32_t> gen(0, static_cast<uint32_t>(size));
+    ST stl;
+    rbi_tree ri;
+    rb_tree rt;
+    Timer tm_stl, tm_rbt, tm_rbi;
+    int succ = 1;
+
+    // the last slot is the search probe
+    const uint32_t probe = static_cast<uint32_t>(size);
+
+    rbi_init(&ri, nodes.data(), multi, icmpf, keys.data());
+    rb_init(&rt, multi, cmpf<uint32_t>, NULL);
+
+    ordered.reserve(size);
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        keys[i] = gen(e);
+        ordered.push_back(Ordered<uint32_t>(keys[i]));
+    }
+
+    std::cout << "<insert, find|rbi> Multi: " << multi << ". Sample size: " << size
+        << ". Node size: " << sizeof(rbi_node) << " vs " << sizeof(rb_node) << std::endl;
+
+    size_t hit_stl = 0, hit_rbt = 0, hit_rbi = 0;
+
+    tm_stl.start();
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        stl.insert(keys[i]);
+    }
+    for (size_t i = 0; i < size; ++i)
+    {
+        hit_stl += stl.find(keys[i] / 2) != stl.end();
+    }
+
+    tm_stl.stop();
+    tm_rbt.start();
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        rb_insert(&rt, &ordered[i].m_Node, &succ);
+    }
+    for (size_t i = 0; i < size; ++i)
+    {
+        Ordered<uint32_t> val(keys[i] / 2);
+
+        hit_rbt += rb_find(&rt, &val.m_Node) != rb_head(&rt);
+    }
+
+    tm_rbt.stop();
+    tm_rbi.start();
+
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        rbi_insert(&ri, i, &succ);
+    }
+    for (size_t i = 0; i < size; ++i)
+    {
+        keys[probe] = keys[i] / 2;
+        hit_rbi += rbi_find(&ri, probe) != RBI_NIL;
+    }
+
+    tm_rbi.stop();
+
+    succ = hit_stl == hit_rbt && hit_stl == hit_rbi && ri.size == stl.size() && rbi_verify(&ri);
+
+    // erase every other key, then compare bounds and the order
+    for (uint32_t i = 0; i < size && succ; i += 2)
+    {
+        keys[probe] = keys[i];
+
+        uint32_t it = rbi_find(&ri, probe);
+
+        if (it != RBI_NIL)
+        {
+            stl.erase(stl.find(keys[i]));
+            rbi_erase(&ri, it);
+        }
+    }
+    for (uint32_t i = 1; i < size && succ; i += 97)
+    {
+        keys[probe] = keys[i] + 1;
+
+        auto lo = stl.lower_bound(keys[probe]), hi = stl.upper_bound(keys[probe]);
+        uint32_t rlo = rbi_lbnd(&ri, probe), rhi = rbi_ubnd(&ri, probe);
+
+        succ = (lo == stl.end() ? rlo == RBI_NIL : rlo != RBI_NIL && keys[rlo] == *lo) &&
+            (hi == stl.end() ? rhi == RBI_NIL : rhi != RBI_NIL && keys[rhi] == *hi);
+    }
+
+    uint32_t it = rbi_lmst(&ri);
+
+    for (auto key = stl.begin(); key != stl.end() && succ; ++key, it = rbi_next(&ri, it))
+    {
+        succ = it != RBI_NIL && keys[it] == *key;
+    }
+
+    succ = succ && it == RBI_NIL && ri.size == stl.size() && rbi_verify(&ri);
+
+    printf("  STL: %lfs, rb: %lfs, rbi: %lfs. Status: %s\n",
+        tm_stl.time(), tm_rbt.time(), tm_rbi.time(), succ ? "success" : "failed");
+
+    return !succ;
+}
+
+#if defined __linux__
+struct Record
+{
+    uint64_t m_Key;
+    uint64_t m_Val;
+};
+
+static int
+rcmpf(const void *a, const void *b, void *args)
+{
+    return static_cast<const Record *>(a)->m_Key < static_cast<const Record *>(b)->m_Key;
+}
+
+/*
+ * Restart benchmark: build a file tree, close it, then compare the time
+ * to reopen it with the time to rebuild an rb_tree from its records.
+ */
+static int
+tst_file(size_t size)
+{
+    char path[] = "/tmp/stl_rb.XXXXXX";
+    std::multiset<uint64_t> stl;
+    std::vector<Ordered<uint64_t>> nodes;
+    std::default_random_engine e(4);
+    rbf_tree rf;
+    rb_tree rt;
+    Timer tm_open, tm_rebuild;
+    int fd = mkstemp(path), succ = 1, out;
+
+    if (fd < 0 || close(fd) || rbf_open(&rf, path, sizeof(Record), 1, rcmpf, NULL))
+    {
+        std::cout << "<rbf> " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    for (size_t i = 0; i < size && succ; ++i)
+    {
+        Record rec = { e() % size, i };
+
+        succ = rbf_insert(&rf, &rec, &out) != RBI_NIL;
+        stl.insert(rec.m_Key);
+    }
+    for (uint64_t key = 0; key < size && succ; key += 3)
+    {
+        Record rec = { key, 0 };
+        uint32_t it = rbf_find(&rf, &rec);
+
+        if (it != RBI_NIL)
+        {
+            rbf_erase(&rf, it);
+            stl.erase(stl.find(key));
+        }
+    }
+
+    succ = succ && !rbf_sync(&rf) && !rbf_close(&rf);
+
+    std::cout << "<restart|rbf_open> Size: " << stl.size() << std::endl;
+
+    tm_open.start();
+    succ = succ && !rbf_open(&rf, path, sizeof(Record), 1, rcmpf, NULL);
+    tm_open.stop();
+
+    if (succ)
+    {
+        nodes.reserve(rbf_size(&rf));
+        rb_init(&rt, 1, cmpf<uint64_t>, NULL);
+
+        tm_rebuild.start();
+
+        for (uint32_t it = rbf_lmst(&rf); it != RBI_NIL; it = rbf_next(&rf, it))
+        {
+            nodes.push_back(Ordered<uint64_t>(static_cast<Record *>(rbf_rec(&rf, it))->m_Key));
+            rb_insert(&rt, &nodes.back().m_Node, &out);
+        }
+
+        tm_rebuild.stop();
+
+        // the reopened tree, and a tree grown again after the reopen
+        Record rec = { size, 0 };
+
+        succ = rbf_insert(&rf, &rec, &out) != RBI_NIL;
+        stl.insert(rec.m_Key);
+
+        uint32_t it = rbf_lmst(&rf);
+
+        for (auto key = stl.begin(); key != stl.end() && succ; ++key, it = rbf_next(&rf, it))
+        {
+            succ = it != RBI_NIL && static_cast<Record *>(rbf_rec(&rf, it))->m_Key == *key;
+        }
+        for (uint64_t key = 1; key < size && succ; key += 101)
+        {
+            Record rec = { key, 0 };
+            uint32_t lo = rbf_lbnd(&rf, &rec);
+            auto slo = stl.lower_bound(key);
+
+            succ = slo == stl.end() ? lo == RBI_NIL :
+                lo != RBI_NIL && static_cast<Record *>(rbf_rec(&rf, lo))->m_Key == *slo;
+        }
+
+        succ = succ && it == RBI_NIL && rbf_size(&rf) == stl.size() && !rbf_close(&rf);
+
+        // closed without rbf_sync after a change, so it may be damaged
+        succ = succ && rbf_open(&rf, path, sizeof(Record), 1, rcmpf, NULL) && errno == EINVAL;
+    }
+
+    unlink(path);
+
+    printf("  open: %lfs, rebuild: %lfs. Status: %s\n",
+        tm_open.time(), tm_rebuild.time(), succ ? "success" : "failed");
+
+    return !succ;
+}
+#endif
+
+#if defined __linux__
+/*
+ * Write-heavy shared tree: each thread inserts, erases and finds random
+ * keys (2:1:1) through a mutex, a reader-writer lock (finds shared) or
+ * flat combining. Returns Mops/s, or a negative value if the tree is
+ * broken afterwards.
+ */
+static double
+bench_combining(int mode, size_t nthreads, size_t ops)
+{
+    enum { MUTEX, RWLOCK, COMBINING };
+
+    std::vector<Ordered<uint64_t>> nodes(nthreads * ops);
+    std::vector<std::thread> thr;
+    std::vector<size_t> erased(nthreads);
+    std::mutex mtx;
+    pthread_rwlock_t rwl = PTHREAD_RWLOCK_INITIALIZER;
+    rbfc_tree fc;
+    rb_tree tr;
+    size_t inserted = 0;
+
+    rb_init(&tr, 1, cmpf<uint64_t>, NULL);
+
+    if (mode == COMBINING && rbfc_init(&fc, &tr, nthreads))
+    {
+        return -1;
+    }
+
+    auto worker = [&](size_t id)
+    {
+        std::default_random_engine e(static_cast<unsigned int>(id + 1));
+        Ordered<uint64_t> *mine = &nodes[id * ops];
+        int out;
+
+        for (size_t i = 0; i < ops; ++i)
+        {
+            Ordered<uint64_t> val(e() % (ops * 4));
+            rb_node *node = &mine[i].m_Node;
+
+            mine[i].m_Hold = val.m_Hold;
+
+            if (i % 4 < 2)
+            {
+                if (mode == COMBINING)
+                {
+                    rbfc_insert(&fc, id, node, &out);
+                }
+                else if (mode == MUTEX)
+                {
+                    std::lock_guard<std::mutex> guard(mtx);
+
+                    rb_insert(&tr, node, &out);
+                }
+                else
+                {
+                    pthread_rwlock_wrlock(&rwl);
+                    rb_insert(&tr, node, &out);
+                    pthread_rwlock_unlock(&rwl);
+                }
+            }
+            else if (i % 4 == 2)
+            {
+                if (mode == COMBINING)
+                {
+                    erased[id] += rbfc_erase_val(&fc, id, &val.m_Node);
+                }
+                else if (mode == MUTEX)
+                {
+                    std::lock_guard<std::mutex> guard(mtx);
+
+                    erased[id] += rb_erase_val(&tr, &val.m_Node);
+                }
+                else
+                {
+                    pthread_rwlock_wrlock(&rwl);
+                    erased[id] += rb_erase_val(&tr, &val.m_Node);
+                    pthread_rwlock_unlock(&rwl);
+                }
+            }
+            else
+            {
+                volatile rb_node *res;
+
+                if (mode == COMBINING)
+                {
+                    res = rbfc_find(&fc, id, &val.m_Node);
+                }
+                else if (mode == MUTEX)
+                {
+                    std::lock_guard<std::mutex> guard(mtx);
+
+                    res = rb_find(&tr, &val.m_Node);
+                }
+                else
+                {
+                    pthread_rwlock_rdlock(&rwl);
+                    res = rb_find(&tr, &val.m_Node);
+                    pthread_rwlock_unlock(&rwl);
+                }
+
+                (void)res;
+            }
+        }
+    };
+
+    auto begin = std::chrono::steady_clock::now();
+
+    for (size_t id = 0; id < nthreads; ++id)
+    {
+        thr.push_back(std::thread(worker, id));
+    }
+    for (auto &th : thr)
+    {
+        th.join();
+    }
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    if (mode == COMBINING)
+    {
+        rbfc_destroy(&fc);
+    }
+
+    for (size_t id = 0; id < nthreads; ++id)
+    {
+        inserted += (ops + 2) / 4 + (ops + 3) / 4;
+        inserted -= erased[id];
+    }
+
+    return tr.size == inserted && rb_verify(&tr) ? nthreads * ops / secs / 1e6 : -1;
+}
+
+/*
+ * Compare the three front-ends from 1 to max_threads threads.
+ */
+static int
+tst_combining(size_t ops, size_t max_threads)
+{
+    static const char *mode_str[] = { "mutex", "rwlock", "combining" };
+    int succ = 1;
+
+    std::cout << "<mutex, rwlock|combining> Ops per thread: " << ops << std::endl;
+
+    for (size_t n = 1; n <= max_threads; n *= 2)
+    {
+        printf("  threads %-3zu:", n);
+
+        for (int mode = 0; mode < 3; ++mode)
+        {
+            double mops = bench_combining(mode, n, ops);
+
+            succ &= mops >= 0;
+            printf(" %s %.3lf Mops/s%s", mode_str[mode], mops, mode < 2 ? "," : "\n");
+        }
+    }
+
+    printf("  Status: %s\n", succ ? "success" : "failed");
+
+    return !succ;
+}
+#endif
+
+/*
+ * Random inserts and erases on many small containers whose sizes swing
+ * around RBS_SMALL, checked against the STL container, then lookups in
+ * small containers timed against plain trees.
+ */
+template<class ST, int multi>
+static int
+tst_small(size_t ninst, size_t size)
+{
+    std::vector<std::vector<Ordered<size_t>>> nodes(ninst);
+    std::vector<rbs_tree> smalls(ninst);
+    std::vector<rb_tree> trees(ninst);
+    std::vector<ST> stls(ninst);
+    std::default_random_engine e(7);
+    Timer tm_tree, tm_small;
+    size_t found_tree = 0, found_small = 0;
+    int succ = 1, out;
+
+    for (size_t k = 0; k < ninst; ++k)
+    {
+        nodes[k].resize(9 * RBS_SMALL);
+
+        rbs_init(&smalls[k], multi, cmpf<size_t>, NULL);
+        rb_init(&trees[k], multi, cmpf<size_t>, NULL);
+    }
+
+    std::cout << "<find|find small> Multi: " << multi << ", Instances: " << ninst <<
+        ", Size: " << size << std::endl;
+
+    // grow past RBS_SMALL, shrink below RBS_SMALL / 2 and grow again
+    for (size_t k = 0; k < ninst && succ; ++k)
+    {
+        rbs_tree &sm = smalls[k];
+        ST &stl = stls[k];
+
+        for (size_t i = 0; i < nodes[k].size() && succ; ++i)
+        {
+            Ordered<size_t> &node = nodes[k][i];
+            bool grow = i < 3 * RBS_SMALL || i >= 7 * RBS_SMALL || i % 8 == 0;
+
+            if (grow)
+            {
+                node.m_Hold = e() % (4 * RBS_SMALL);
+
+                rb_node *res = rbs_insert(&sm, &node.m_Node, &out);
+                bool fresh = multi || !stl.count(node.m_Hold);
+
+                stl.insert(node.m_Hold);
+
+                succ = out == fresh && (out ? res == &node.m_Node :
+                    Ordered<size_t>::convert(res) == node.m_Hold);
+            }
+            else if (i % 4 == 1)
+            {
+                Ordered<size_t> val(e() % (4 * RBS_SMALL));
+
+                succ = rbs_erase_val(&sm, &val.m_Node) == stl.erase(val.m_Hold);
+            }
+            else
+            {
+                rb_node *it = rbs_lmst(&sm);
+
+                for (size_t n = e() % (sm.size + 1); n && it != rbs_head(&sm); --n)
+                {
+                    it = rbs_next(&sm, it);
+                }
+                if (it != rbs_head(&sm))
+                {
+                    rb_node *next = rbs_next(&sm, it);
+                    auto pos = stl.find(Ordered<size_t>::convert(it));
+
+                    stl.erase(pos);
+                    succ = rbs_erase(&sm, it) == next;
+                }
+            }
+
+            auto fwd = stl.begin();
+
+            for (rb_node *it = rbs_lmst(&sm); it != rbs_head(&sm) && succ; it = rbs_next(&sm, it))
+            {
+                succ = fwd != stl.end() && Ordered<size_t>::convert(it) == *fwd++;
+            }
+
+            auto bwd = stl.rbegin();
+
+            for (rb_node *it = rbs_rmst(&sm); it != rbs_head(&sm) && succ; it = rbs_prev(&sm, it))
+            {
+                succ = bwd != stl.rend() && Ordered<size_t>::convert(it) == *bwd++;
+            }
+
+            succ = succ && fwd == stl.end() && bwd == stl.rend() && sm.size == stl.size();
+
+            for (size_t key = 0; key < 4 * RBS_SMALL && succ; key += 5)
+            {
+                Ordered<size_t> val(key);
+                rb_pair pr = rbs_eqrange(&sm, &val.m_Node);
+                size_t cnt = 0;
+
+                for (; pr.first != pr.second; pr.first = rbs_next(&sm, pr.first))
+                {
+                    ++cnt;
+                }
+
+                succ = cnt == stl.count(key) &&
+                    (rbs_find(&sm, &val.m_Node) != rbs_head(&sm)) == !!cnt;
+            }
+        }
+
+        rbs_clear(&sm);
+        stl.clear();
+    }
+
+    // lookups in containers of the given size
+    for (size_t k = 0; k < ninst; ++k)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            nodes[k][i].m_Hold = e() % (2 * size);
+            nodes[k][size + i].m_Hold = nodes[k][i].m_Hold;
+
+            rbs_insert(&smalls[k], &nodes[k][i].m_Node, &out);
+            rb_insert(&trees[k], &nodes[k][size + i].m_Node, &out);
+        }
+    }
+
+    tm_tree.start();
+
+    for (size_t i = 0; i < 2 * size; ++i)
+    {
+        for (size_t k = 0; k < ninst; ++k)
+        {
+            Ordered<size_t> val(i);
+
+            found_tree += rb_find(&trees[k], &val.m_Node) != rb_head(&trees[k]);
+        }
+    }
+
+    tm_tree.stop();
+    tm_small.start();
+
+    for (size_t i = 0; i < 2 * size; ++i)
+    {
+        for (size_t k = 0; k < ninst; ++k)
+        {
+            Ordered<size_t> val(i);
+
+            found_small += rbs_find(&smalls[k], &val.m_Node) != rbs_head(&smalls[k]);
+        }
+    }
+
+    tm_small.stop();
+
+    succ = succ && found_tree == found_small;
+
+    printf("  rb: %lfs, rbs: %lfs. Status: %s\n",
+        tm_tree.time(), tm_small.time(), succ ? "success" : "failed");
+
+    return !succ;
+}
+
+struct Typed
+{
+    int64_t m_I64;
+    uint64_t m_U64;
+    double m_Double;
+    const char *m_Str;
+    rb_node m_Node[5];
+};
+
+static int
+typedcmpf(const rb_node *n1, const rb_node *n2, void *)
+{
+    return RB_CONV(Typed, n1, m_Node[4])->m_U64 < RB_CONV(Typed, n2, m_Node[4])->m_U64;
+}
+
+/*
+ * One tree per built-in key type over the same records, checked against
+ * the STL container, and lookups on the unsigned keys timed against a
+ * tree of the same records with a compare function.
+ */
+static int
+tst_typed(size_t size)
+{
+    static const int types[4] = { RB_KEY_I64, RB_KEY_U64, RB_KEY_DOUBLE, RB_KEY_STR };
+    static const ptrdiff_t offs[4] = {
+        RB_KEY_OFFSET(Typed, m_Node[0], m_I64), RB_KEY_OFFSET(Typed, m_Node[1], m_U64),
+        RB_KEY_OFFSET(Typed, m_Node[2], m_Double), RB_KEY_OFFSET(Typed, m_Node[3], m_Str)
+    };
+
+    std::vector<Typed> recs(size);
+    std::vector<std::string> strs(size);
+    std::set<int64_t> stl;
+    std::default_random_engine e(8);
+    rb_tree trees[4], tr;
+    Timer tm_comp, tm_typed;
+    size_t found_comp = 0, found_typed = 0;
+    int succ = 1, out;
+
+    for (int t = 0; t < 4; ++t)
+    {
+        rb_init_typed(&trees[t], 0, types[t], offs[t]);
+    }
+
+    rb_init(&tr, 0, typedcmpf, NULL);
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        int64_t key = static_cast<int64_t>(e() % (4 * size)) - static_cast<int64_t>(2 * size);
+        char buf[32];
+
+        // zero padded so that strcmp agrees with the numeric order
+        snprintf(buf, sizeof(buf), "%020lld", static_cast<long long>(key + (1ll << 62)));
+        strs[i] = buf;
+
+        recs[i].m_I64 = key;
+        recs[i].m_U64 = static_cast<uint64_t>(key + (1ll << 62));
+        recs[i].m_Double = static_cast<double>(key) / 4;
+        recs[i].m_Str = strs[i].c_str();
+
+        for (int t = 0; t < 4; ++t)
+        {
+            rb_insert(&trees[t], &recs[i].m_Node[t], &out);
+        }
+
+        rb_insert(&tr, &recs[i].m_Node[4], &out);
+        stl.insert(key);
+    }
+
+    std::cout << "<find|find typed> Size: " << stl.size() << std::endl;
+
+    // all four orders are the same
+    for (int t = 0; t < 4 && succ; ++t)
+    {
+        auto it = stl.begin();
+
+        for (rb_node *node = rb_lmst(&trees[t]); node != rb_head(&trees[t]) && succ;
+            node = rb_next(node), ++it)
+        {
+            succ = RB_CONV(Typed, node - t, m_Node[0])->m_I64 == *it;
+        }
+
+        succ = succ && trees[t].size == stl.size() && rb_verify(&trees[t]);
+    }
+    for (size_t i = 0; i < size && succ; i += 17)
+    {
+        int64_t i64 = recs[i].m_I64 + 1;
+        uint64_t u64 = recs[i].m_U64;
+        double dbl = recs[i].m_Double;
+        const char *str = recs[i].m_Str;
+
+        succ = (rb_find_key(&trees[0], &i64) != rb_head(&trees[0])) == !!stl.count(i64) &&
+            rb_find_key(&trees[1], &u64) != rb_head(&trees[1]) &&
+            rb_find_key(&trees[2], &dbl) != rb_head(&trees[2]) &&
+            rb_find_key(&trees[3], &str) != rb_head(&trees[3]) &&
+            rb_find_str(&trees[3], str, strlen(str)) != rb_head(&trees[3]);
+    }
+
+    tm_comp.start();
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        found_comp += rb_find(&tr, &recs[(i * 7919) % size].m_Node[4]) != rb_head(&tr);
+    }
+
+    tm_comp.stop();
+    tm_typed.start();
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        found_typed += rb_find(&trees[1], &recs[(i * 7919) % size].m_Node[1]) != rb_head(&trees[1]);
+    }
+
+    tm_typed.stop();
+
+    succ = succ && found_comp == size && found_typed == size;
+
+    printf("  rb: %lfs, rb typed: %lfs. Status: %s\n",
+        tm_comp.time(), tm_typed.time(), succ ? "success" : "failed");
+
+    return !succ;
+}
+
+/*
+ * Insert a burst of random keys into a relaxed tree, checking lookups
+ * and order while violations are pending, then rebalance in slices.
+ * Then an ascending burst, the worst case, mixed with erases. Time the
+ * burst against a strict tree.
+ */
+static int
+tst_relaxed(size_t size, size_t cap)
+{
+    std::vector<Ordered<size_t>> nodes(size), snodes(size), asc(size / 4);
+    std::vector<rb_node *> log(cap);
+    std::set<size_t> stl;
+    std::default_random_engine e(9);
+    rb_tree tr, str;
+    Timer tm_strict, tm_relaxed, tm_rebalance;
+    size_t pending;
+    int succ = 1, out;
+
+    rb_init(&tr, 0, cmpf<size_t>, NULL);
+    rb_init(&str, 0, cmpf<size_t>, NULL);
+    rb_set_relaxed(&tr, log.data(), cap);
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        nodes[i].m_Hold = snodes[i].m_Hold = e() % (size * 4);
+    }
+
+    tm_strict.start();
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        rb_insert(&str, &snodes[i].m_Node, &out);
+    }
+
+    tm_strict.stop();
+    tm_relaxed.start();
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        rb_insert(&tr, &nodes[i].m_Node, &out);
+    }
+
+    tm_relaxed.stop();
+
+    std::cout << "<insert|insert relaxed> Size: " << tr.size << std::endl;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        stl.insert(nodes[i].m_Hold);
+    }
+
+    auto ordered = [&]() {
+        auto it = stl.begin();
+        rb_node *node = rb_lmst(&tr);
+
+        for (; node != rb_head(&tr) && it != stl.end(); node = rb_next(node), ++it)
+        {
+            if (Ordered<size_t>::convert(node) != *it)
+            {
+                return false;
+            }
+        }
+
+        return node == rb_head(&tr) && it == stl.end() && tr.size == stl.size();
+    };
+
+    pending = rb_rebalance(&tr, 0);
+    succ = pending && ordered();
+
+    tm_rebalance.start();
+
+    while (succ && (pending = rb_rebalance(&tr, 256)))
+    {
+        for (size_t i = pending % 97; i < size && succ; i += 997)
+        {
+            succ = rb_find(&tr, &snodes[i].m_Node) != rb_head(&tr);
+        }
+    }
+
+    tm_rebalance.stop();
+
+    succ = succ && rb_verify(&tr) && ordered();
+
+    // an ascending burst grows a run of red nodes on the right spine
+    for (size_t i = 0; i < asc.size() && succ; ++i)
+    {
+        asc[i].m_Hold = size * 4 + i;
+        rb_insert(&tr, &asc[i].m_Node, &out);
+        stl.insert(asc[i].m_Hold);
+
+        if (i % 64 == 63)
+        {
+            rb_erase(&tr, &asc[i - 32].m_Node);
+            stl.erase(asc[i - 32].m_Hold);
+
+            succ = !rb_rebalance(&tr, 0) && rb_verify(&tr);
+        }
+    }
+
+    succ = succ && ordered() && !rb_rebalance(&tr, SIZE_MAX) && rb_verify(&tr) && ordered();
+
+    rb_set_relaxed(&tr, NULL, 0);
+
+    printf("  rb: %lfs, rb relaxed: %lfs (rebalance %lfs). Status: %s\n",
+        tm_strict.time(), tm_relaxed.time(), tm_rebalance.time(), succ ? "success" : "failed");
+
+    return !succ;
+}
+
+static uint64_t
+hashf(const rb_node *node, void *)
+{
+    return Ordered<size_t>::convert(node);
+}
+
+/*
+ * Zipf-skewed lookups, with and without the lookup cache, checking that
+ * both find the same nodes. Then check that erase, relocate and clear
+ * drop what they should, and a multi tree of built-in keys with lazy
+ * erase.
+ */
+static int
+tst_cache(size_t size, size_t lookups, size_t cap, double skew)
+{
+    std::vector<Ordered<size_t>> nodes(size), hot(16);
+    std::vector<rb_cache_slot> slots(cap), tslots(64);
+    std::vector<double> cdf(size);
+    std::vector<size_t> rank(size), order(lookups);
+    std::vector<rb_node *> found(lookups);
+    std::default_random_engine e(10);
+    std::uniform_real_distribution<double> unif(0, 1);
+    rb_tree tr, ttr;
+    rb_cache cache, tcache;
+    Timer tm_plain, tm_cache;
+    double sum = 0;
+    int succ = 1, out;
+
+    rb_init(&tr, 0, cmpf<size_t>, NULL);
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        nodes[i].m_Hold = i * 2654435761u;
+        rb_insert(&tr, &nodes[i].m_Node, &out);
+    }
+
+    // the nodes in random order are the ranks, of weight 1 / rank^skew
+    for (size_t i = 0; i < size; ++i)
+    {
+        rank[i] = i;
+        cdf[i] = sum += 1 / pow(static_cast<double>(i + 1), skew);
+    }
+
+    std::shuffle(rank.begin(), rank.end(), e);
+
+    for (size_t i = 0; i < lookups; ++i)
+    {
+        size_t r = std::lower_bound(cdf.begin(), cdf.end(), unif(e) * sum) - cdf.begin();
+
+        order[i] = rank[std::min(r, size - 1)];
+    }
+
+    std::cout << "<find|find cached> Size: " << tr.size << ", lookups: " << lookups << std::endl;
+
+    tm_plain.start();
+
+    for (size_t i = 0; i < lookups; ++i)
+    {
+        found[i] = rb_find(&tr, &nodes[order[i]].m_Node);
+    }
+
+    tm_plain.stop();
+
+    rb_set_cache(&tr, &cache, slots.data(), cap, hashf);
+
+    tm_cache.start();
+
+    for (size_t i = 0; i < lookups; ++i)
+    {
+        succ &= rb_find(&tr, &nodes[order[i]].m_Node) == found[i];
+    }
+
+    tm_cache.stop();
+
+    succ = succ && cache.hits + cache.misses == lookups;
+
+    printf("  rb: %lfs, rb cached: %lfs (hit rate %.3lf). Status: %s\n",
+        tm_plain.time(), tm_cache.time(), static_cast<double>(cache.hits) / lookups,
+        succ ? "success" : "failed");
+
+    // the hottest nodes are cached, so erase and relocate must reach the slots
+    for (size_t i = 0; i < hot.size() && succ; ++i)
+    {
+        Ordered<size_t> &node = nodes[rank[i]];
+
+        hot[i].m_Hold = node.m_Hold;
+        rb_erase(&tr, &node.m_Node);
+
+        succ = rb_find(&tr, &node.m_Node) == rb_head(&tr);
+
+        rb_insert(&tr, &node.m_Node, &out);
+        rb_find(&tr, &node.m_Node);
+        rb_relocate(&tr, &node.m_Node, &hot[i].m_Node);
+
+        // the old storage must not be reached any more
+        node.m_Hold = ~node.m_Hold;
+
+        succ = succ && rb_find(&tr, &hot[i].m_Node) == &hot[i].m_Node;
+    }
+
+    // an update in place must not leave the node under its old key
+    {
+        Ordered<size_t> &node = nodes[rank[hot.size()]];
+        size_t key = node.m_Hold;
+
+        rb_find(&tr, &node.m_Node);
+        node.m_Hold = key + 1;
+        rb_update(&tr, &node.m_Node, &out);
+
+        // while the other cached nodes stay cached
+        size_t hits = cache.hits;
+
+        succ = succ && rb_find(&tr, &hot[0].m_Node) == &hot[0].m_Node && cache.hits == hits + 1;
+        succ = succ && rb_find(&tr, &node.m_Node) == &node.m_Node;
+
+        rb_erase(&tr, &node.m_Node);
+        node.m_Hold = key;
+
+        succ = succ && rb_find(&tr, &node.m_Node) == rb_head(&tr);
+    }
+
+    rb_clear(&tr);
+
+    succ = succ && rb_find(&tr, &nodes[0].m_Node) == rb_head(&tr);
+
+    rb_set_cache(&tr, NULL, NULL, 0, NULL);
+
+    rb_init_typed(&ttr, 1, RB_KEY_U64, RB_KEY_OFFSET(Ordered<size_t>, m_Node, m_Hold));
+    rb_set_lazy(&ttr, 1);
+    rb_set_cache(&ttr, &tcache, tslots.data(), tslots.size(), NULL);
+
+    for (size_t i = 0; i < hot.size(); ++i)
+    {
+        hot[i].m_Hold = i / 4;
+        rb_insert(&ttr, &hot[i].m_Node, &out);
+    }
+    for (size_t i = 0; i < hot.size() && succ; ++i)
+    {
+        // the first of equal nodes, while the earlier ones are erased
+        succ = rb_find(&ttr, &hot[i].m_Node) == &hot[i].m_Node &&
+            rb_find(&ttr, &hot[i].m_Node) == &hot[i].m_Node;
+
+        rb_erase(&ttr, &hot[i].m_Node);
+    }
+
+    succ = succ && tcache.hits == hot.size() && !ttr.size;
+
+    return !succ;
+}
+
+struct Arena
+{
+    std::vector<Ordered<size_t>> m_Nodes;
+    size_t m_Used, m_Freed;
+};
+
+static rb_node *
+arena_alloc(const rb_node *node, void *args)
+{
+    Arena &arena = *static_cast<Arena *>(args);
+    Ordered<size_t> &moved = arena.m_Nodes[arena.m_Used++];
+
+    moved.m_Hold = Ordered<size_t>::convert(node);
+
+    return &moved.m_Node;
+}
+
+static void
+arena_free(rb_node *node, void *args)
+{
+    ++static_cast<Arena *>(args)->m_Freed;
+}
+
+/*
+ * Scatter the nodes of a tree over the heap, then defragment it into
+ * an arena in order, in slices with lookups in between, and then in
+ * vEB order into another one. Time a full scan before and after.
+ */
+static int
+tst_defrag(size_t size)
+{
+    std::vector<std::unique_ptr<Ordered<size_t>>> nodes, fillers;
+    std::vector<size_t> keys;
+    std::default_random_engine e(6);
+    Arena inorder, veb;
+    rb_tree tr;
+    rb_defrag_state df;
+    rb_report before, after;
+    Timer tm_before, tm_after;
+    size_t sum_before = 0, sum_after = 0;
+    int succ = 1, res;
+
+    rb_init(&tr, 0, cmpf<size_t>, NULL);
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        nodes.emplace_back(new Ordered<size_t>(e()));
+        fillers.emplace_back(new Ordered<size_t>(0));
+
+        rb_insert(&tr, &nodes.back()->m_Node, &succ);
+    }
+
+    // free every other block, so that the layout is not in order
+    fillers.clear();
+    keys.reserve(tr.size);
+
+    for (rb_node *it = rb_lmst(&tr); it != rb_head(&tr); it = rb_next(it))
+    {
+        keys.push_back(Ordered<size_t>::convert(it));
+    }
+
+    rb_analyze(&tr, &before);
+
+    std::cout << "<scan|scan defragmented> Size: " << tr.size << std::endl;
+
+    tm_before.start();
+
+    for (rb_node *it = rb_lmst(&tr); it != rb_head(&tr); it = rb_next(it))
+    {
+        sum_before += Ordered<size_t>::convert(it);
+    }
+
+    tm_before.stop();
+
+    inorder.m_Nodes.resize(tr.size), inorder.m_Used = inorder.m_Freed = 0;
+    veb.m_Nodes.resize(tr.size), veb.m_Used = veb.m_Freed = 0;
+
+    rb_defrag_init(&tr, &df, RB_DEFRAG_INORDER, arena_alloc, arena_free, &inorder);
+
+    for (size_t i = 0; (res = rb_defrag(&tr, &df, 64)) > 0 && succ; ++i)
+    {
+        Ordered<size_t> val(keys[i * 7919 % keys.size()]);
+
+        succ = rb_find(&tr, &val.m_Node) != rb_head(&tr);
+    }
+
+    nodes.clear();
+    rb_analyze(&tr, &after);
+
+    tm_after.start();
+
+    for (rb_node *it = rb_lmst(&tr); it != rb_head(&tr); it = rb_next(it))
+    {
+        sum_after += Ordered<size_t>::convert(it);
+    }
+
+    tm_after.stop();
+
+    succ = succ && !res && inorder.m_Freed == keys.size() && sum_before == sum_after &&
+        rb_verify(&tr) && after.linescore > before.linescore;
+
+    rb_defrag_init(&tr, &df, RB_DEFRAG_VEB, arena_alloc, arena_free, &veb);
+
+    while ((res = rb_defrag(&tr, &df, 64)) > 0)
+    {
+    }
+
+    size_t i = 0;
+
+    for (rb_node *it = rb_lmst(&tr); it != rb_head(&tr) && succ; it = rb_next(it), ++i)
+    {
+        succ = Ordered<size_t>::convert(it) == keys[i];
+    }
+
+    succ = succ && !res && i == keys.size() && veb.m_Freed == keys.size() &&
+        rb_head(&tr)->_parent == &veb.m_Nodes[0].m_Node && rb_verify(&tr);
+
+    printf("  rb: %lfs (line score %.3lf), rb defragmented: %lfs (line score %.3lf). Status: %s\n",
+        tm_before.time(), before.linescore, tm_after.time(), after.linescore,
+        succ ? "success" : "failed");
+
+    return !succ;
+}
+
+class Chained
+{
+public:
+    rb_cnode m_Node;
+    size_t m_Hold;
+    size_t m_Seq;
+
+    static const Chained &
+    convert(const rb_node *conv)
+    {
+        return *RB_CONV(Chained, conv, m_Node._node);
+    }
+};
+
+static int
+chcmpf(const rb_node *n1, const rb_node *n2, void *args)
+{
+    return Chained::convert(n1).m_Hold < Chained::convert(n2).m_Hold;
+}
+
+/*
+ * Check a chained tree with many copies of few keys against the STL
+ * container, which keeps copies in insertion order as well, and time
+ * counting the copies against a plain multi tree.
+ */
+static int
+tst_chain(size_t size, size_t nkeys)
+{
+    std::vector<Chained> nodes(size);
+    std::vector<Ordered<size_t>> pnodes(size);
+    std::vector<rb_node *> log(nkeys);
+    std::multimap<size_t, size_t> stl;
+    std::default_random_engine e(5);
+    rb_tree tr, ptr;
+    Timer tm_plain, tm_chain;
+    size_t pcnt = 0, ccnt = 0;
+    int succ = 1;
+
+    rb_init(&tr, 1, chcmpf, NULL);
+    rb_init(&ptr, 1, cmpf<size_t>, NULL);
+    rb_set_chain(&tr, 1);
+
+    // keys are left unbalanced until the first erase
+    rb_set_relaxed(&tr, log.data(), log.size());
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        nodes[i].m_Hold = pnodes[i].m_Hold = e() % nkeys;
+        nodes[i].m_Seq = i;
+
+        rb_insert(&tr, &nodes[i].m_Node._node, &succ);
+        rb_insert(&ptr, &pnodes[i].m_Node, &succ);
+        stl.insert(std::make_pair(nodes[i].m_Hold, i));
+    }
+
+    std::cout << "<vcnt|vcnt chained> Size: " << size << ", Keys: " << nkeys << std::endl;
+
+    tm_plain.start();
+
+    for (size_t i = 0; i < nkeys; ++i)
+    {
+        pcnt += rb_vcnt(&ptr, &pnodes[i].m_Node);
+    }
+
+    tm_plain.stop();
+    tm_chain.start();
+
+    for (size_t i = 0; i < nkeys; ++i)
+    {
+        ccnt += rb_vcnt(&tr, &nodes[i].m_Node._node);
+    }
+
+    tm_chain.stop();
+
+    succ = pcnt == ccnt && rb_rebalance(&tr, 0);
+
+    // single copies from anywhere in the chains, then whole keys
+    for (size_t i = 0; i < size && succ; i += 5)
+    {
+        rb_node *node = &nodes[i].m_Node._node, *next = rb_next(node);
+        auto pr = stl.equal_range(nodes[i].m_Hold);
+
+        while (pr.first->second != i)
+        {
+            ++pr.first;
+        }
+
+        stl.erase(pr.first);
+        succ = rb_erase(&tr, node) == next;
+    }
+    for (size_t key = 0; key < nkeys && succ; key += 7)
+    {
+        Chained val;
+
+        val.m_Hold = key;
+        succ = rb_erase_val(&tr, &val.m_Node._node) == stl.erase(key);
+    }
+
+    succ = succ && tr.size == stl.size() && rb_verify(&tr);
+
+    auto fwd = stl.begin();
+
+    for (rb_node *it = rb_lmst(&tr); it != rb_head(&tr) && succ; it = rb_next(it), ++fwd)
+    {
+        succ = Chained::convert(it).m_Seq == fwd->second;
+    }
+
+    auto bwd = stl.rbegin();
+
+    for (rb_node *it = rb_rmst(&tr); it != rb_head(&tr) && succ; it = rb_prev(it), ++bwd)
+    {
+        succ = Chained::convert(it).m_Seq == bwd->second;
+    }
+    for (size_t key = 0; key < nkeys && succ; ++key)
+    {
+        Chained val;
+
+        val.m_Hold = key;
+
+        rb_pair pr = rb_eqrange(&tr, &val.m_Node._node);
+
+        succ = rb_vcnt(&tr, &val.m_Node._node) == stl.count(key) &&
+            rb_dist(&tr, pr.first, pr.second) == stl.count(key);
+    }
+
+    printf("  rb vcnt: %lfs, rb chained vcnt: %lfs. Status: %s\n",
+        tm_plain.time(), tm_chain.time(), succ ? "success" : "failed");
+
+    return !succ;
+}
+
+/*
+ * Build a tree from shuffled nodes with rb_build_parallel and with
+ * successive rb_insert calls, and check that both keep the same nodes
+ * in the same order.
+ */
+template<int multi>
+static int
+tst_parallel(size_t size, size_t nthreads)
+{
+    std::vector<Ordered<size_t>> snodes(size), pnodes(size);
+    std::vector<rb_node *> ptrs(size);
+    std::default_random_engine e(3);
+    rb_tree str, ptr;
+    Timer tm_serial, tm_par;
+    size_t linked;
+    int succ = 1;
+
+    rb_init(&str, multi, cmpf<size_t>, NULL);
+    rb_init(&ptr, multi, cmpf<size_t>, NULL);
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        snodes[i].m_Hold = pnodes[i].m_Hold = e() % (size / 2);
+        ptrs[i] = &pnodes[i].m_Node;
+    }
+
+    std::cout << "<insert|build parallel> Multi: " << multi << ", Size: " << size <<
+        ", Threads: " << nthreads << std::endl;
+
+    tm_serial.start();
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        rb_insert(&str, &snodes[i].m_Node, &succ);
+    }
+
+    tm_serial.stop();
+    tm_par.start();
+
+    linked = rb_build_parallel(&ptr, ptrs.data(), size, nthreads);
+
+    tm_par.stop();
+
+    succ = linked == ptr.size && str.size == ptr.size && rb_verify(&ptr);
+
+    // the same nodes, by index, in the same order
+    rb_node *sit = rb_lmst(&str), *pit = rb_lmst(&ptr);
+
+    for (size_t i = 0; i < linked && succ; ++i)
+    {
+        succ = pit == ptrs[i] && RB_CONV(Ordered<size_t>, sit, m_Node) - snodes.data() ==
+            RB_CONV(Ordered<size_t>, pit, m_Node) - pnodes.data();
+
+        sit = rb_next(sit), pit = rb_next(pit);
+    }
+
+    printf("  rb insert: %lfs, rb build parallel: %lfs. Status: %s\n",
+        tm_serial.time(), tm_par.time(), succ ? "success" : "failed");
+
+    return !succ;
+}
+
+struct ScanAcc
+{
+    size_t first, last, count;
+    uint64_t hash;
+    int sorted;
+};
+
+static void
+visitf(rb_node *node, void *args)
+{
+    ++Ordered<size_t>::convert(node);
+}
+
+static void
+reducef(void *acc, const rb_node *node, void *args)
+{
+    ScanAcc &a = *static_cast<ScanAcc *>(acc);
+    size_t key = Ordered<size_t>::convert(node);
+
+    a.sorted &= !a.count || a.last <= key;
+    a.first = a.count ? a.first : key;
+    a.last = key;
+    a.hash = a.hash * 31 + key;
+    ++a.count;
+}
+
+static void
+combinef(void *acc, const void *rhs, void *args)
+{
+    ScanAcc &a = *static_cast<ScanAcc *>(acc);
+    const ScanAcc &b = *static_cast<const ScanAcc *>(rhs);
+    uint64_t pow = 1;
+
+    for (size_t i = 0; i < b.count; ++i)
+    {
+        pow *= 31;
+    }
+
+    a.sorted &= b.sorted && (!a.count || !b.count || a.last <= b.first);
+    a.first = a.count ? a.first : b.first;
+    a.last = b.count ? b.last : a.last;
+    a.hash = a.hash * pow + b.hash;
+    a.count += b.count;
+}
+
+/*
+ * Scan a lazy tree with tombstones by rb_next and by the parallel
+ * for-each and reduce. The reduction is an order-sensitive hash, so
+ * the chunks must be combined in order.
+ */
+static int
+tst_scan(size_t size, size_t nthreads)
+{
+    std::vector<Ordered<size_t>> nodes(size);
+    std::default_random_engine e(4);
+    ScanAcc sacc = {}, pacc = {};
+    rb_tree tr;
+    Timer tm_serial, tm_par;
+    int succ = 1;
+
+    rb_init(&tr, 1, cmpf<size_t>, NULL);
+    rb_set_lazy(&tr, 1);
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        nodes[i].m_Hold = e() % size * 2;
+        rb_insert(&tr, &nodes[i].m_Node, &succ);
+    }
+    for (size_t i = 0; i < size; i += 3)
+    {
+        rb_erase(&tr, &nodes[i].m_Node);
+    }
+
+    std::cout << "<scan|parallel reduce> Size: " << tr.size << ", Threads: " << nthreads << std::endl;
+
+    sacc.sorted = pacc.sorted = 1;
+
+    tm_serial.start();
+
+    for (rb_node *it = rb_lmst(&tr); it != rb_head(&tr); it = rb_next(it))
+    {
+        reducef(&sacc, it, NULL);
+    }
+
+    tm_serial.stop();
+    tm_par.start();
+
+    rb_parallel_reduce(&tr, &pacc, sizeof(pacc), reducef, combinef, NULL, nthreads);
+
+    tm_par.stop();
+
+    succ = sacc.count == tr.size && pacc.count == tr.size && pacc.sorted &&
+        pacc.hash == sacc.hash && pacc.first == sacc.first && pacc.last == sacc.last;
+
+    // every live node once, the keys become odd
+    rb_parallel_foreach(&tr, visitf, NULL, nthreads);
+
+    for (size_t i = 0; i < size && succ; ++i)
+    {
+        succ = nodes[i].m_Hold % 2 == (i % 3 != 0);
+    }
+
+    printf("  rb scan: %lfs, rb parallel reduce: %lfs. Status: %s\n",
+        tm_serial.time(), tm_par.time(), succ ? "success" : "failed");
+
+    return !succ;
+}
+
+/*
+ * Usage: stl_rb [--latency [sample size] [trials]]
+ *        stl_rb --combining [ops per thread] [max threads]
+ *        stl_rb --bench <output json> [seed] [trials] [sample size]
+ *        stl_rb --compare <baseline json> <current json> [threshold percent]
+ */
+int main(int argc, char **argv)
+{
+    static constexpr size_t tstc = 1 << 20;
+
+    if (argc > 1 && !strcmp(argv[1], "--latency"))
+    {
+        size_t size = argc > 2 ? strtoul(argv[2], NULL, 0) : 1 << 18;
+        size_t trials = argc > 3 ? strtoul(argv[3], NULL, 0) : 5;
+
+        Suit<size_t, std::set<size_t>, 0> l1(size);
+        Suit<size_t, std::multiset<size_t>, 1> l2(size);
+
+        return l1.latency(trials) | l2.latency(trials);
+    }
+
+    if (argc > 2 && !strcmp(argv[1], "--bench"))
+    {
+        size_t trials = argc > 4 ? strtoul(argv[4], NULL, 0) : 10;
+        size_t size = argc > 5 ? strtoul(argv[5], NULL, 0) : 1 << 16;
+        Bench bench;
+
+        sample_seed = argc > 3 ? static_cast<unsigned int>(strtoul(argv[3], NULL, 0)) : 1;
+
+        Suit<size_t, std::set<size_t>, 0> l1(size);
+        Suit<size_t, std::multiset<size_t>, 1> l2(size);
+
+        return l1.latency(trials, &bench) || l2.latency(trials, &bench) ||
+            bench.save(argv[2], sample_seed, size);
+    }
+    if (argc > 3 && !strcmp(argv[1], "--compare"))
+    {
+        double threshold = argc > 4 ? strtod(argv[4], NULL) : 10;
+        Bench base, cur;
+        int regressions;
+
+        if (base.load(argv[2]) || cur.load(argv[3]))
+        {
+            return 1;
+        }
+
+        std::cout << "<bench> " << argv[3] << " against " << argv[2] <<
+            ", threshold " << threshold << "%" << std::endl;
+
+        if ((regressions = Bench::compare(base, cur, threshold)) < 0)
+        {
+            return 1;
+        }
+
+        printf("  Regressions: %d. Status: %s\n", regressions, regressions ? "failed" : "success");
+
+        return !!regressions;
+    }
+
+#if defined __linux__
+    if (argc > 1 && !strcmp(argv[1], "--combining"))
+    {
+        size_t ops = argc > 2 ? strtoul(argv[2], NULL, 0) : 1 << 18;
+        size_t threads = argc > 3 ? strtoul(argv[3], NULL, 0) : 64;
+
+        return tst_combining(ops, threads);
+    }
+#endif
+
+    Suit<size_t, std::set<size_t>, 0> s1(tstc);
+    Suit<size_t, std::multiset<size_t>, 1> s2(tstc);
+
+    if (tst_containers() || tst_strkey(1 << 16) || tst_prefix(1 << 18) ||
+        tst_index<std::set<uint32_t>, 0>(1 << 18) ||
+        tst_index<std::multiset<uint32_t>, 1>(1 << 18) ||
+        tst_parallel<0>(1 << 18, 4) || tst_parallel<1>(1 << 18, 4) || tst_scan(1 << 18, 4) ||
+        tst_chain(1 << 18, 1 << 10) || tst_defrag(1 << 18) ||
+        tst_small<std::set<size_t>, 0>(1 << 12, 16) ||
+        tst_small<std::multiset<size_t>, 1>(1 << 12, 16) || tst_typed(1 << 18) ||
+        tst_relaxed(1 << 18, 1 << 12) || tst_cache(1 << 20, 1 << 21, 1 << 12, 0.99)
+#if defined __linux__
+        || tst_file(1 << 18) || tst_combining(1 << 14, 4)
+#endif
+        )
+    {
+        return 1;
+    }
 
     return s1.run() | s2.run();
 }